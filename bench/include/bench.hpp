@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <iostream>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <algorithm>
+
+namespace bench
+{
+
+using clock = std::chrono::steady_clock;
+
+/// Measures the wall time elapsed since construction or the last reset
+class Stopwatch
+{
+    clock::time_point start_;
+
+public:
+    Stopwatch() : start_(clock::now()) { }
+
+    void reset() { start_ = clock::now(); }
+
+    double seconds() const
+    {
+        return std::chrono::duration<double>(clock::now() - start_).count();
+    }
+};
+
+/// Read a positive integer argument, falling back to a default
+inline std::size_t argument(int argc, char** argv, int i, std::size_t fallback)
+{
+    if (i < argc) {
+        auto const value = std::atol(argv[i]);
+        if (value > 0) {
+            return static_cast<std::size_t>(value);
+        }
+    }
+    return fallback;
+}
+
+inline std::size_t hardwareThreads()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+} // namespace bench
+
+#endif //BENCH_H
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef COUNTINGALLOCATOR_H
+#define COUNTINGALLOCATOR_H
+
+#include <cstdint>
+
+/**
+ * Heap allocations made through the global operator new
+ * @details The benchmarks linking counting_allocator.cpp get its replacement
+ * of operator new and delete, which counts the allocations of every thread
+ * that did not opt out. The replacement lives in a translation unit of its
+ * own so that its delete is never inlined next to a new-expression, which
+ * would make GCC pair malloc'ed memory with free at the call site
+ * (-Wmismatched-new-delete).
+ */
+namespace bench
+{
+
+/// Allocations counted so far
+std::uint64_t allocations() noexcept;
+
+/// Stop counting the allocations of the calling thread
+void uncountThread() noexcept;
+
+} // namespace bench
+
+#endif //COUNTINGALLOCATOR_H
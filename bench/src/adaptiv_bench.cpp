@@ -0,0 +1,740 @@
+// Load generator for a running adaptiv server
+//
+//   Usage: adaptiv_bench <address> <port> [options]
+//
+// Connects websocket subscribers and keep-alive HTTP clients to the server,
+// subscribes them to a topic (every topic by default), publishes messages at
+// a fixed rate through one more websocket and reports
+// the end-to-end broadcast latency percentiles, throughput and errors as
+// JSON. Every connection lives on one of several single-threaded contexts,
+// each with its own statistics, so the measuring threads never synchronise.
+//
+// Messages are stamped with the time they were scheduled at rather than the
+// time they were written, so a publisher that falls behind shows up in the
+// latencies instead of hiding it (coordinated omission).
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+#include "bench.hpp"
+#include "net.hpp"
+#include "beast.hpp"
+#include "metrics.hpp"
+
+namespace
+{
+
+struct Options
+{
+    std::string address;
+    unsigned short port = 0;
+    std::size_t subscribers = 1000;
+    std::size_t httpConnections = 16;
+    std::string httpTarget = "/";
+    std::string topic = "*";                ///< What the subscribers follow
+    double rate = 100;                      ///< Messages published per second
+    double subscriberRate = 0;              ///< Their rate limit, 0 for none
+    std::size_t messageSize = 256;
+    std::chrono::seconds duration{10};
+    std::chrono::seconds drain{2};          ///< Wait for the last deliveries
+    std::size_t threads = bench::hardwareThreads();
+    std::size_t connectBatch = 256;         ///< Handshakes in flight at once
+    bool deflate = false;
+    std::string output;                     ///< Defaults to stdout
+};
+
+void usage(std::ostream& out)
+{
+    out <<
+        "  Usage: adaptiv_bench <address> <port> [options]\n"
+        "Options:\n"
+        "  --ws=N                websocket subscribers (default 1000)\n"
+        "  --http=N              keep-alive HTTP connections (default 16)\n"
+        "  --target=path         what the HTTP connections request (default /)\n"
+        "  --topic=name          topic the subscribers follow; the publisher\n"
+        "                        sends to runs/<id> (default *, every topic)\n"
+        "  --rate=N              messages published per second (default 100)\n"
+        "  --ws-rate=N           messages per second the subscribers ask the\n"
+        "                        server for at most (default: no limit)\n"
+        "  --size=bytes          size of a published message (default 256)\n"
+        "  --duration=s          publishing time (default 10)\n"
+        "  --drain=s             time allowed for the last deliveries (default 2)\n"
+        "  --threads=N           client threads (default: the number of cores)\n"
+        "  --connect-batch=N     websocket handshakes in flight (default 256)\n"
+        "  --deflate             offer permessage-deflate\n"
+        "  --output=file         write the JSON report to a file\n"
+        "Example:\n"
+        "         adaptiv_bench 127.0.0.1 8080 --ws=5000 --rate=50\n";
+}
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+    if (argc < 3) {
+        return false;
+    }
+    options.address = argv[1];
+    options.port = static_cast<unsigned short>(std::atoi(argv[2]));
+
+    for (int i = 3; i < argc; ++i) {
+        std::string const argument = argv[i];
+        auto const equal = argument.find('=');
+        if (argument.compare(0, 2, "--") != 0) {
+            return false;
+        }
+        auto const name = argument.substr(2, equal - 2);
+        auto const value =
+            equal == std::string::npos ? std::string{} : argument.substr(equal + 1);
+        auto const count = std::atol(value.c_str());
+
+        if (name == "ws") {
+            options.subscribers = static_cast<std::size_t>(std::max(0l, count));
+        } else if (name == "http") {
+            options.httpConnections = static_cast<std::size_t>(std::max(0l, count));
+        } else if (name == "target" && !value.empty() && value[0] == '/') {
+            options.httpTarget = value;
+        } else if (name == "topic" && !value.empty()) {
+            options.topic = value;
+        } else if (name == "rate" && std::atof(value.c_str()) > 0) {
+            options.rate = std::atof(value.c_str());
+        } else if (name == "ws-rate" && std::atof(value.c_str()) > 0) {
+            options.subscriberRate = std::atof(value.c_str());
+        } else if (name == "size" && count > 0) {
+            options.messageSize = static_cast<std::size_t>(count);
+        } else if (name == "duration" && count > 0) {
+            options.duration = std::chrono::seconds(count);
+        } else if (name == "drain" && count >= 0 && !value.empty()) {
+            options.drain = std::chrono::seconds(count);
+        } else if (name == "threads" && count > 0) {
+            options.threads = static_cast<std::size_t>(count);
+        } else if (name == "connect-batch" && count > 0) {
+            options.connectBatch = static_cast<std::size_t>(count);
+        } else if (name == "deflate") {
+            options.deflate = true;
+        } else if (name == "output" && !value.empty()) {
+            options.output = value;
+        } else {
+            std::cerr << "error: invalid option '" << argument << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Thousands of sockets need more descriptors than the usual soft limit
+void raiseDescriptorLimit()
+{
+#if defined(__linux__)
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+std::uint64_t now()
+{
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<
+        std::chrono::nanoseconds>(bench::clock::now().time_since_epoch()).count());
+}
+
+// Only the thread of the context writes its counters
+template<class T>
+void bump(
+    std::atomic<T>& value,
+    T delta = 1,
+    std::memory_order order = std::memory_order_relaxed)
+{
+    value.store(value.load(std::memory_order_relaxed) + delta, order);
+}
+
+/**
+ * Statistics of the connections of one context
+ * @details Written by the thread of the context only. The counters the main
+ * thread polls while the run is in progress are atomics; the rest is read
+ * once the threads have returned.
+ */
+struct alignas(64) Stats
+{
+    /// Completed or failed, released after connected or connectErrors
+    std::atomic<std::uint64_t> handshakes{0};
+    std::atomic<std::uint64_t> received{0};
+    std::atomic<std::uint64_t> published{0};
+    std::atomic<std::uint64_t> connected{0};
+    std::atomic<std::uint64_t> connectErrors{0};
+
+    std::uint64_t readErrors = 0;
+    std::uint64_t publishErrors = 0;
+    std::uint64_t receivedBytes = 0;
+    std::uint64_t maxLatency = 0;
+    LatencyHistogram latency;
+
+    std::uint64_t requests = 0;
+    std::uint64_t httpErrors = 0;       ///< I/O errors
+    std::uint64_t statusErrors = 0;     ///< 4xx and 5xx responses
+    std::uint64_t httpBytes = 0;
+    std::uint64_t maxHttpLatency = 0;
+    LatencyHistogram httpLatency;
+};
+
+// Extract the publication time from a message
+std::uint64_t stamp(beast::flat_buffer const& buffer)
+{
+    static std::string const key = "\"sent\":";
+    auto const data = static_cast<char const*>(buffer.data().data());
+    auto const text = beast::string_view(data, buffer.size());
+    auto const found = text.find(key);
+    if (found == beast::string_view::npos) {
+        return 0;
+    }
+    return std::strtoull(data + found + key.size(), nullptr, 10);
+}
+
+class Subscriber: public std::enable_shared_from_this<Subscriber>
+{
+protected:
+    websocket::stream<beast::tcp_stream> websocket_;
+    beast::flat_buffer buffer_;
+    Stats& stats_;
+    Options const& options_;
+    std::atomic<bool> const& stopping_;
+
+    std::deque<std::string> control_;
+
+    virtual void onOpen()
+    {
+        if (options_.subscriberRate > 0) {
+            std::ostringstream rate;
+            rate << "{\"rate\":\"" << options_.subscriberRate << "\"}";
+            control_.push_back(rate.str());
+        }
+        control_.push_back("{\"subscribe\":\"" + options_.topic + "\"}");
+        writeControl();
+    }
+
+    // One control message at a time, in order
+    void writeControl()
+    {
+        if (control_.empty()) {
+            return;
+        }
+        websocket_.async_write(
+            net::buffer(control_.front()),
+            [self = shared_from_this()](error_code ec, std::size_t)
+            {
+                if (ec) {
+                    if (!self->stopping_) {
+                        bump(self->stats_.connectErrors);
+                    }
+                    return;
+                }
+                self->control_.pop_front();
+                self->writeControl();
+            });
+    }
+
+    virtual void onMessage()
+    {
+        auto const sent = stamp(buffer_);
+        if (sent == 0) {
+            return;
+        }
+        auto const received = now();
+        auto const latency = received > sent ? received - sent : 0;
+        stats_.latency.record(latency);
+        stats_.maxLatency = std::max(stats_.maxLatency, latency);
+        stats_.receivedBytes += buffer_.size();
+        bump(stats_.received);
+    }
+
+public:
+    Subscriber(
+        net::io_context& ioc,
+        Stats& stats,
+        Options const& options,
+        std::atomic<bool> const& stopping)
+        : websocket_(ioc.get_executor())
+        , stats_(stats)
+        , options_(options)
+        , stopping_(stopping)
+    { }
+
+    virtual ~Subscriber() = default;
+
+    void start(tcp::endpoint const& endpoint)
+    {
+        if (options_.deflate) {
+            websocket::permessage_deflate deflate;
+            deflate.client_enable = true;
+            websocket_.set_option(deflate);
+        }
+
+        websocket_.next_layer().expires_after(std::chrono::seconds(30));
+        websocket_.next_layer().async_connect(
+            endpoint,
+            [self = shared_from_this(), endpoint](error_code ec)
+            {
+                if (ec) {
+                    return self->onHandshake(ec);
+                }
+                self->websocket_.next_layer().expires_never();
+                self->websocket_.set_option(
+                    websocket::stream_base::timeout::suggested(
+                        beast::role_type::client));
+                self->websocket_.async_handshake(
+                    endpoint.address().to_string(), "/",
+                    [self](error_code ec)
+                    {
+                        self->onHandshake(ec);
+                    });
+            });
+    }
+
+private:
+    void onHandshake(error_code ec)
+    {
+        // Whoever sees the handshake sees its outcome
+        bump(ec ? stats_.connectErrors : stats_.connected);
+        bump(stats_.handshakes, std::uint64_t{1}, std::memory_order_release);
+        if (ec) {
+            return;
+        }
+        doRead();
+        onOpen();
+    }
+
+    void doRead()
+    {
+        websocket_.async_read(
+            buffer_,
+            [self = shared_from_this()](error_code ec, std::size_t)
+            {
+                if (ec) {
+                    if (!self->stopping_) {
+                        ++self->stats_.readErrors;
+                    }
+                    return;
+                }
+                self->onMessage();
+                self->buffer_.consume(self->buffer_.size());
+                self->doRead();
+            });
+    }
+};
+
+/**
+ * Publishes at a fixed rate through its websocket
+ * @details It does not subscribe, but still reads and ignores whatever the
+ * server sends so that nothing piles up in its queue on the server.
+ */
+class Publisher: public Subscriber
+{
+    net::steady_timer timer_;
+    std::deque<std::string> queue_;
+    bench::clock::duration interval_;
+    bench::clock::time_point next_;
+    bench::clock::time_point end_;
+    std::uint64_t sequence_ = 0;
+    std::string padding_;
+
+    void onOpen() override
+    {
+        next_ = bench::clock::now();
+        end_ = next_ + options_.duration;
+        tick();
+    }
+
+    void onMessage() override { }
+
+    void tick()
+    {
+        auto const current = bench::clock::now();
+        while (next_ <= current && next_ < end_) {
+            publish(next_);
+            next_ += interval_;
+        }
+        if (next_ >= end_) {
+            return;
+        }
+
+        timer_.expires_at(next_);
+        timer_.async_wait(
+            [self = std::static_pointer_cast<Publisher>(shared_from_this())](
+                error_code ec)
+            {
+                if (!ec) {
+                    self->tick();
+                }
+            });
+    }
+
+    void publish(bench::clock::time_point scheduled)
+    {
+        auto const sent = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            scheduled.time_since_epoch()).count();
+        std::string message = "{\"bench\":{\"sequence\":" +
+            std::to_string(sequence_++) + ",\"sent\":" + std::to_string(sent) +
+            "},\"padding\":\"";
+        if (message.size() + 2 < options_.messageSize) {
+            message.append(padding_, 0, options_.messageSize - message.size() - 2);
+        }
+        message += "\"}";
+
+        queue_.push_back(std::move(message));
+        if (queue_.size() == 1) {
+            doWrite();
+        }
+    }
+
+    void doWrite()
+    {
+        websocket_.async_write(
+            net::buffer(queue_.front()),
+            [self = std::static_pointer_cast<Publisher>(shared_from_this())](
+                error_code ec, std::size_t)
+            {
+                if (ec) {
+                    ++self->stats_.publishErrors;
+                    return;
+                }
+                bump(self->stats_.published);
+                self->queue_.pop_front();
+                if (!self->queue_.empty()) {
+                    self->doWrite();
+                }
+            });
+    }
+
+public:
+    Publisher(
+        net::io_context& ioc,
+        Stats& stats,
+        Options const& options,
+        std::atomic<bool> const& stopping)
+        : Subscriber(ioc, stats, options, stopping)
+        , timer_(ioc)
+        , interval_(std::chrono::duration_cast<bench::clock::duration>(
+            std::chrono::duration<double>(1 / options.rate)))
+        , padding_(options.messageSize, 'x')
+    { }
+};
+
+/// Requests the same target over a keep-alive connection until stopped
+class HttpClient: public std::enable_shared_from_this<HttpClient>
+{
+    beast::tcp_stream stream_;
+    beast::flat_buffer buffer_;
+    http::request<http::empty_body> request_;
+    std::optional<http::response_parser<http::string_body>> parser_;
+    tcp::endpoint endpoint_;
+    Stats& stats_;
+    std::atomic<bool> const& stopping_;
+    std::uint64_t start_ = 0;
+
+    void doConnect()
+    {
+        stream_.expires_after(std::chrono::seconds(30));
+        stream_.async_connect(
+            endpoint_,
+            [self = shared_from_this()](error_code ec)
+            {
+                if (ec) {
+                    ++self->stats_.httpErrors;
+                    return;
+                }
+                self->doWrite();
+            });
+    }
+
+    void doWrite()
+    {
+        if (stopping_) {
+            return;
+        }
+        start_ = now();
+        stream_.expires_after(std::chrono::seconds(30));
+        http::async_write(stream_, request_,
+            [self = shared_from_this()](error_code ec, std::size_t)
+            {
+                if (ec) {
+                    return self->onError();
+                }
+                self->doRead();
+            });
+    }
+
+    void doRead()
+    {
+        parser_.emplace();
+        parser_->body_limit(boost::none);
+        http::async_read(stream_, buffer_, *parser_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                if (ec) {
+                    return self->onError();
+                }
+                self->onResponse(bytes);
+            });
+    }
+
+    void onResponse(std::size_t bytes)
+    {
+        auto const latency = now() - start_;
+        stats_.httpLatency.record(latency);
+        stats_.maxHttpLatency = std::max(stats_.maxHttpLatency, latency);
+        stats_.httpBytes += bytes;
+        ++stats_.requests;
+
+        auto const& response = parser_->get();
+        if (response.result_int() >= 400) {
+            ++stats_.statusErrors;
+        }
+
+        // The server may end the connection after a response
+        if (!response.keep_alive()) {
+            error_code ec;
+            stream_.socket().close(ec);
+            return doConnect();
+        }
+        doWrite();
+    }
+
+    void onError()
+    {
+        if (stopping_) {
+            return;
+        }
+        ++stats_.httpErrors;
+        error_code ec;
+        stream_.socket().close(ec);
+        buffer_.clear();
+        doConnect();
+    }
+
+public:
+    HttpClient(
+        net::io_context& ioc,
+        tcp::endpoint const& endpoint,
+        Options const& options,
+        Stats& stats,
+        std::atomic<bool> const& stopping)
+        : stream_(ioc.get_executor())
+        , request_(http::verb::get, options.httpTarget, 11)
+        , endpoint_(endpoint)
+        , stats_(stats)
+        , stopping_(stopping)
+    {
+        request_.set(http::field::host, options.address);
+        request_.set(http::field::user_agent, "adaptiv_bench");
+        request_.keep_alive(true);
+    }
+
+    void start() { doConnect(); }
+};
+
+template<class Member>
+std::uint64_t total(std::vector<std::unique_ptr<Stats>> const& stats, Member member)
+{
+    std::uint64_t result = 0;
+    for (auto const& s : stats) {
+        result += static_cast<std::uint64_t>((*s).*member);
+    }
+    return result;
+}
+
+template<class Member>
+std::uint64_t polled(std::vector<std::unique_ptr<Stats>> const& stats, Member member)
+{
+    std::uint64_t result = 0;
+    for (auto const& s : stats) {
+        result += ((*s).*member).load(std::memory_order_acquire);
+    }
+    return result;
+}
+
+void writeLatency(
+    std::ostream& out,
+    std::vector<std::unique_ptr<Stats>> const& stats,
+    LatencyHistogram Stats::* histogram,
+    std::uint64_t Stats::* max)
+{
+    LatencyHistogram::Counts counts{};
+    std::uint64_t sum = 0;
+    std::uint64_t count = 0;
+    std::uint64_t highest = 0;
+    for (auto const& s : stats) {
+        ((*s).*histogram).mergeInto(counts, sum);
+        highest = std::max(highest, (*s).*max);
+    }
+    for (auto n : counts) {
+        count += n;
+    }
+
+    // Bucket midpoints may exceed the exact maximum
+    auto const us = [&counts, highest](double q)
+    {
+        auto const ns = std::min(LatencyHistogram::quantile(counts, q), highest);
+        return static_cast<double>(ns) / 1e3;
+    };
+    out << "{\"count\": " << count
+        << ", \"mean\": "
+        << (count > 0 ? static_cast<double>(sum) / 1e3 / static_cast<double>(count) : 0)
+        << ", \"p50\": " << us(0.5)
+        << ", \"p90\": " << us(0.9)
+        << ", \"p99\": " << us(0.99)
+        << ", \"p999\": " << us(0.999)
+        << ", \"max\": " << us(1) << '}';
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(std::cerr);
+        return EXIT_FAILURE;
+    }
+
+    error_code ec;
+    tcp::endpoint const endpoint{
+        net::ip::make_address(options.address, ec), options.port};
+    if (ec) {
+        std::cerr << "error: invalid address '" << options.address << "'\n";
+        return EXIT_FAILURE;
+    }
+    raiseDescriptorLimit();
+
+    // The statistics outlive the contexts, which own the connections
+    std::vector<std::unique_ptr<Stats>> stats;
+    std::vector<std::unique_ptr<net::io_context>> contexts;
+    for (std::size_t i = 0; i < options.threads; ++i) {
+        stats.push_back(std::make_unique<Stats>());
+        contexts.push_back(std::make_unique<net::io_context>(1));
+    }
+
+    std::vector<net::executor_work_guard<net::io_context::executor_type>> work;
+    std::vector<std::thread> threads;
+    for (auto& context : contexts) {
+        work.push_back(net::make_work_guard(*context));
+        threads.emplace_back([&context]{ context->run(); });
+    }
+    std::atomic<bool> stopping{false};
+
+    // Connect the subscribers, a batch at a time
+    bench::Stopwatch connecting;
+    for (std::size_t i = 0; i < options.subscribers; ++i) {
+        auto const index = i % contexts.size();
+        std::make_shared<Subscriber>(
+            *contexts[index], *stats[index], options, stopping)->start(endpoint);
+
+        if ((i + 1) % options.connectBatch == 0 || i + 1 == options.subscribers) {
+            while (polled(stats, &Stats::handshakes) < i + 1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+    auto const connectSeconds = connecting.seconds();
+    auto const subscribed = polled(stats, &Stats::connected);
+
+    // Load the HTTP side and publish for the duration of the run
+    bench::Stopwatch running;
+    for (std::size_t i = 0; i < options.httpConnections; ++i) {
+        auto const index = i % contexts.size();
+        std::make_shared<HttpClient>(
+            *contexts[index], endpoint, options, *stats[index], stopping)->start();
+    }
+    std::make_shared<Publisher>(
+        *contexts.front(), *stats.front(), options, stopping)->start(endpoint);
+
+    std::this_thread::sleep_for(options.duration);
+    auto const published = polled(stats, &Stats::published);
+    // A rate limited subscriber gets about one message per interval
+    auto const limited = options.subscriberRate > 0
+        ? static_cast<std::uint64_t>(
+              options.subscriberRate * static_cast<double>(options.duration.count())) + 1
+        : published;
+    auto const expected = std::min(published, limited) * subscribed;
+    auto const deadline = bench::clock::now() + options.drain;
+    while (polled(stats, &Stats::received) < expected &&
+           bench::clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto const seconds = running.seconds();
+
+    stopping = true;
+    for (auto& context : contexts) {
+        context->stop();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Report
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+    }
+    std::ostream& out = options.output.empty() ? std::cout : file;
+
+    auto const received = total(stats, &Stats::received);
+    auto const requests = total(stats, &Stats::requests);
+    auto const perSecond = [seconds](std::uint64_t n)
+    { return static_cast<double>(n) / seconds; };
+
+    out << "{\n"
+        << "  \"target\": {\"address\": \"" << options.address
+        << "\", \"port\": " << options.port << "},\n"
+        << "  \"options\": {\"subscribers\": " << options.subscribers
+        << ", \"http_connections\": " << options.httpConnections
+        << ", \"http_target\": \"" << options.httpTarget
+        << "\", \"rate\": " << options.rate
+        << ", \"ws_rate\": " << options.subscriberRate
+        << ", \"message_size\": " << options.messageSize
+        << ", \"duration_s\": " << options.duration.count()
+        << ", \"threads\": " << options.threads
+        << ", \"deflate\": " << (options.deflate ? "true" : "false") << "},\n"
+        << "  \"elapsed_s\": " << seconds << ",\n"
+        << "  \"websocket\": {\n"
+        << "    \"connected\": " << subscribed
+        << ", \"connect_errors\": " << polled(stats, &Stats::connectErrors)
+        << ", \"connect_s\": " << connectSeconds
+        << ", \"read_errors\": " << total(stats, &Stats::readErrors) << ",\n"
+        << "    \"published\": " << published
+        << ", \"publish_errors\": " << total(stats, &Stats::publishErrors)
+        << ", \"expected\": " << expected
+        << ", \"received\": " << received
+        << ", \"delivery_ratio\": "
+        << (expected > 0 ? static_cast<double>(received) / expected : 0) << ",\n"
+        << "    \"deliveries_per_s\": " << perSecond(received)
+        << ", \"bytes_per_s\": " << perSecond(total(stats, &Stats::receivedBytes))
+        << ",\n    \"latency_us\": ";
+    writeLatency(out, stats, &Stats::latency, &Stats::maxLatency);
+    out << "\n  },\n"
+        << "  \"http\": {\n"
+        << "    \"requests\": " << requests
+        << ", \"requests_per_s\": " << perSecond(requests)
+        << ", \"bytes_per_s\": " << perSecond(total(stats, &Stats::httpBytes))
+        << ", \"errors\": " << total(stats, &Stats::httpErrors)
+        << ", \"status_errors\": " << total(stats, &Stats::statusErrors) << ",\n"
+        << "    \"latency_us\": ";
+    writeLatency(out, stats, &Stats::httpLatency, &Stats::maxHttpLatency);
+    out << "\n  }\n}\n";
+
+    return EXIT_SUCCESS;
+}
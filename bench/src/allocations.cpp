@@ -0,0 +1,271 @@
+// Heap allocations made by the server threads in steady state
+//
+//   Usage: bench_allocations [clients] [messages] [requests]
+//
+// Counts the allocations of every thread but those of the benchmark itself
+// (the clients and the main thread), through the counting allocator. After
+// a warm-up, a publisher sends the messages through its websocket, so they
+// are published from a server thread as in production to every session (all
+// subscribed to every topic), and the allocations are reported per message
+// and per delivery. The same is done for keep-alive HTTP requests of a cached
+// file.
+//
+// Those figures include the work itself: parsing a published message and
+// building its copies, the path of a file, and the timeout timers of Beast's
+// streams, which type-erase the strand executor of each wait. The fan-out of
+// a message already built goes through completion handlers only, so it must
+// not allocate at all: the benchmark fails if it does.
+
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "counting_allocator.hpp"
+#include "net.hpp"
+#include "beast.hpp"
+#include "config.hpp"
+#include "server.hpp"
+#include "shared_state.hpp"
+
+namespace
+{
+
+class Receiver: public std::enable_shared_from_this<Receiver>
+{
+protected:
+    websocket::stream<beast::tcp_stream> websocket_;
+    beast::flat_buffer buffer_;
+    std::atomic<std::size_t>& received_;
+
+public:
+    Receiver(net::io_context& ioc, std::atomic<std::size_t>& received)
+        : websocket_(ioc)
+        , received_(received)
+    { }
+
+    void connect(tcp::endpoint const& endpoint)
+    {
+        websocket_.next_layer().connect(endpoint);
+        websocket_.handshake(endpoint.address().to_string(), "/");
+        websocket_.write(net::buffer(std::string(R"({"subscribe":"*"})")));
+    }
+
+    void run()
+    {
+        websocket_.async_read(
+            buffer_,
+            [self = shared_from_this()](error_code ec, std::size_t)
+            {
+                if (ec) {
+                    return;
+                }
+                self->buffer_.consume(self->buffer_.size());
+                self->received_.fetch_add(1, std::memory_order_relaxed);
+                self->run();
+            });
+    }
+};
+
+/// Writes messages one after the other, and reads its own broadcasts
+class Publisher: public Receiver
+{
+    std::string message_;
+    std::size_t remaining_ = 0;
+
+    void doWrite()
+    {
+        if (remaining_ == 0) {
+            return;
+        }
+        --remaining_;
+        websocket_.async_write(
+            net::buffer(message_),
+            [self = std::static_pointer_cast<Publisher>(shared_from_this())](
+                error_code ec, std::size_t)
+            {
+                if (!ec) {
+                    self->doWrite();
+                }
+            });
+    }
+
+public:
+    using Receiver::Receiver;
+
+    void publish(std::string const& message, std::size_t count)
+    {
+        net::post(websocket_.get_executor(),
+            [self = std::static_pointer_cast<Publisher>(shared_from_this()),
+             message, count]
+            {
+                self->message_ = message;
+                self->remaining_ = count;
+                self->doWrite();
+            });
+    }
+};
+
+void waitFor(std::atomic<std::size_t> const& counter, std::size_t expected)
+{
+    bench::Stopwatch stopwatch;
+    while (counter.load(std::memory_order_relaxed) < expected &&
+           stopwatch.seconds() < 60) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/// @return Allocations of the fan-out of a message already built
+std::uint64_t broadcast(
+    tcp::endpoint const& endpoint,
+    SharedState& state,
+    std::size_t clients,
+    std::size_t messages)
+{
+    // A residual update as produced by the client
+    std::string const message =
+        R"({"finished":"false","iteration":"42","residuals":{"momentum":)"
+        R"({"x":"0.123456789","y":"0.123456789","z":"0.123456789"},)"
+        R"("energy":"0.123456789","tke":"0.123456789","tdr":"0.123456789"}})";
+
+    net::io_context clientIoc;
+    std::atomic<std::size_t> received{0};
+    std::vector<std::shared_ptr<Receiver>> receivers;
+    for (std::size_t i = 0; i < clients; ++i) {
+        receivers.push_back(std::make_shared<Receiver>(clientIoc, received));
+        receivers.back()->connect(endpoint);
+        receivers.back()->run();
+    }
+    auto publisher = std::make_shared<Publisher>(clientIoc, received);
+    publisher->connect(endpoint);
+    publisher->run();
+    while (state.subscriptions() < clients + 1) {
+        std::this_thread::yield();
+    }
+
+    auto work = net::make_work_guard(clientIoc);
+    std::thread clientThread([&clientIoc]
+    {
+        bench::uncountThread();
+        clientIoc.run();
+    });
+
+    // Warm up: the queues, buffers and caches reach their steady size
+    auto const deliveries = clients + 1;
+    publisher->publish(message, messages);
+    waitFor(received, messages * deliveries);
+
+    auto const before = bench::allocations();
+    publisher->publish(message, messages);
+    waitFor(received, 2 * messages * deliveries);
+    auto const count = static_cast<double>(bench::allocations() - before);
+
+    std::cout << "websocket: " << clients << " clients, " << messages
+              << " messages\n"
+              << "  allocations per message:  " << std::setw(8)
+              << count / static_cast<double>(messages) << '\n'
+              << "  allocations per delivery: " << std::setw(8)
+              << count / static_cast<double>(messages * deliveries) << '\n';
+
+    // The same message to every session, one at a time so that the shards
+    // are not flooded with jobs
+    auto const shared = std::make_shared<std::string const>(message);
+    auto const fanout = [&](std::size_t round)
+    {
+        for (std::size_t i = 0; i < messages; ++i) {
+            state.send(shared);
+            waitFor(received, (round + i + 1) * deliveries);
+        }
+    };
+    fanout(2 * messages);
+    auto const fanoutBefore = bench::allocations();
+    fanout(3 * messages);
+    auto const fanoutCount = bench::allocations() - fanoutBefore;
+
+    std::cout << "fan-out of a built message: " << messages << " messages\n"
+              << "  allocations:              " << std::setw(8)
+              << fanoutCount << '\n';
+
+    clientIoc.stop();
+    clientThread.join();
+    return fanoutCount;
+}
+
+void requests(tcp::endpoint const& endpoint, std::size_t count)
+{
+    net::io_context ioc;
+    beast::tcp_stream stream(ioc);
+    stream.connect(endpoint);
+
+    http::request<http::empty_body> request{http::verb::get, "/index.html", 11};
+    request.set(http::field::host, "localhost");
+    beast::flat_buffer buffer;
+
+    auto const get = [&]
+    {
+        http::write(stream, request);
+        http::response<http::string_body> response;
+        http::read(stream, buffer, response);
+    };
+
+    for (std::size_t i = 0; i < count; ++i) {
+        get();
+    }
+    auto const before = bench::allocations();
+    for (std::size_t i = 0; i < count; ++i) {
+        get();
+    }
+    auto const allocated = static_cast<double>(bench::allocations() - before);
+
+    std::cout << "http: " << count << " keep-alive requests\n"
+              << "  allocations per request:  " << std::setw(8)
+              << allocated / static_cast<double>(count) << '\n';
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bench::uncountThread();
+    auto const clients = bench::argument(argc, argv, 1, 100);
+    auto const messages = bench::argument(argc, argv, 2, 2'000);
+    auto const count = bench::argument(argc, argv, 3, 10'000);
+
+    auto const root = std::filesystem::temp_directory_path() / "bench_allocations";
+    std::filesystem::create_directories(root);
+    std::ofstream(root / "index.html") << "<html><body>adaptiv</body></html>\n";
+
+    ServerConfig config;
+    config.port = 0;
+    config.documentRoot = root.string();
+    config.wsQueueMessages = messages;
+    config.wsQueueBytes = 64 * 1024 * 1024;
+
+    auto state = std::make_shared<SharedState>(config);
+    Server server(config, state);
+    server.start();
+
+    std::cout << std::fixed << std::setprecision(2);
+    auto const fanoutAllocations =
+        broadcast(server.localEndpoint(), *state, clients, messages);
+    requests(server.localEndpoint(), count);
+
+    server.stop();
+    server.join();
+    std::filesystem::remove_all(root);
+
+    if (fanoutAllocations > 0) {
+        std::cerr << "error: the fan-out allocated " << fanoutAllocations
+                  << " times in steady state\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+// Broadcast throughput of an in-process server as the thread count goes up
+//
+//   Usage: bench_broadcast [clients] [messages] [maxThreads] [--reuseport]
+//
+// For 1, 2, 4, ... maxThreads server threads (or SO_REUSEPORT shards with
+// --reuseport), connects the websocket clients, broadcasts the messages
+// through SharedState::send and reports the number of messages delivered per
+// second once every client has received all of them, along with the mean
+// fan-out latency (from send to the last session enqueued).
+
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "net.hpp"
+#include "beast.hpp"
+#include "config.hpp"
+#include "server.hpp"
+#include "shared_state.hpp"
+
+namespace
+{
+
+class Receiver: public std::enable_shared_from_this<Receiver>
+{
+    websocket::stream<beast::tcp_stream> websocket_;
+    beast::flat_buffer buffer_;
+    std::atomic<std::size_t>& received_;
+
+public:
+    Receiver(net::io_context& ioc, std::atomic<std::size_t>& received)
+        : websocket_(net::make_strand(ioc))
+        , received_(received)
+    { }
+
+    void connect(tcp::endpoint const& endpoint)
+    {
+        websocket_.next_layer().connect(endpoint);
+        websocket_.handshake(endpoint.address().to_string(), "/");
+    }
+
+    void run()
+    {
+        websocket_.async_read(
+            buffer_,
+            [self = shared_from_this()](error_code ec, std::size_t)
+            {
+                if (ec) {
+                    return;
+                }
+                self->buffer_.consume(self->buffer_.size());
+                self->received_.fetch_add(1, std::memory_order_relaxed);
+                self->run();
+            });
+    }
+};
+
+struct Result
+{
+    double rate;
+    FanoutStats fanout;
+};
+
+Result broadcast(
+    bool reusePort,
+    std::size_t threads,
+    std::size_t clients,
+    std::size_t messages,
+    std::string const& message)
+{
+    ServerConfig config;
+    config.port = 0;
+    config.threads = threads;
+    config.reusePort = reusePort;
+    // Measure throughput, not the slow consumer policy
+    config.wsQueueMessages = messages;
+    config.wsQueueBytes = messages * message.size();
+
+    auto state = std::make_shared<SharedState>(config);
+    Server server(config, state);
+    server.start();
+
+    // Clients run on their own context so they do not steal server threads
+    net::io_context clientIoc;
+    std::atomic<std::size_t> received{0};
+    std::vector<std::shared_ptr<Receiver>> receivers;
+    for (std::size_t i = 0; i < clients; ++i) {
+        receivers.push_back(std::make_shared<Receiver>(clientIoc, received));
+        receivers.back()->connect(server.localEndpoint());
+        receivers.back()->run();
+    }
+    while (state->size() < clients) {
+        std::this_thread::yield();
+    }
+    auto work = net::make_work_guard(clientIoc);
+    std::thread clientThread([&clientIoc]{ clientIoc.run(); });
+
+    bench::Stopwatch stopwatch;
+    for (std::size_t i = 0; i < messages; ++i) {
+        state->send(message);
+    }
+    auto const expected = clients * messages;
+    while (received.load(std::memory_order_relaxed) < expected &&
+           stopwatch.seconds() < 60) {
+        std::this_thread::yield();
+    }
+    auto const elapsed = stopwatch.seconds();
+
+    server.stop();
+    server.join();
+    clientIoc.stop();
+    clientThread.join();
+
+    return {static_cast<double>(received.load()) / elapsed, state->fanoutStats()};
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const clients = bench::argument(argc, argv, 1, 200);
+    auto const messages = bench::argument(argc, argv, 2, 2'000);
+    auto const maxThreads =
+        bench::argument(argc, argv, 3, bench::hardwareThreads());
+    auto const reusePort = std::string(argv[argc - 1]) == "--reuseport";
+
+    // A residual update as produced by the client
+    std::string const message =
+        R"({"finished":"false","iteration":"42","residuals":{"momentum":)"
+        R"({"x":"0.123456789","y":"0.123456789","z":"0.123456789"},)"
+        R"("energy":"0.123456789","tke":"0.123456789","tdr":"0.123456789"}})";
+
+    std::cout << "clients: " << clients << ", messages: " << messages
+              << (reusePort ? ", sharded (SO_REUSEPORT)" : "") << '\n'
+              << std::setw(8) << "threads"
+              << std::setw(20) << "deliveries/s"
+              << std::setw(20) << "mean fan-out us" << '\n';
+
+    for (std::size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        auto const result =
+            broadcast(reusePort, threads, clients, messages, message);
+        std::cout << std::setw(8) << threads
+                  << std::setw(20) << std::fixed << std::setprecision(0)
+                  << result.rate
+                  << std::setw(20) << std::setprecision(1)
+                  << static_cast<double>(result.fanout.mean.count()) / 1e3
+                  << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
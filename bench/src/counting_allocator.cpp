@@ -0,0 +1,44 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "counting_allocator.hpp"
+
+namespace
+{
+
+std::atomic<std::uint64_t> counted{0};
+thread_local bool uncounted = false;
+
+} // namespace
+
+std::uint64_t bench::allocations() noexcept
+{
+    return counted.load(std::memory_order_relaxed);
+}
+
+void bench::uncountThread() noexcept
+{
+    uncounted = true;
+}
+
+void* operator new(std::size_t size)
+{
+    if (!uncounted) {
+        counted.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
@@ -0,0 +1,150 @@
+// Bandwidth versus CPU of permessage-deflate on the residual stream
+//
+//   Usage: bench_deflate [messages]
+//
+// Generates the messages RANS::toJson produces and compresses them the way a
+// websocket session does (raw deflate, one sync flush per message, trailer
+// stripped), for several compression settings. Every session owns its own
+// compression context, so the CPU time is per subscriber and per message.
+//
+// websocket::stream ends each message with a full flush, which forgets the
+// matches of previous messages even with context takeover. The sync flush
+// rows show what keeping them (as zlib based peers do) would gain.
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "net.hpp"
+#include "beast.hpp"
+#include "solver.hpp"
+
+namespace
+{
+
+struct Settings
+{
+    char const* name;
+    int level;
+    int windowBits;
+    int memLevel;
+    bool takeover;
+    beast::zlib::Flush flush;
+};
+
+std::vector<std::string> residuals(std::size_t count)
+{
+    std::vector<std::string> messages;
+    messages.reserve(count);
+
+    solver::RANS rans(count, std::chrono::milliseconds(0));
+    while (messages.size() < count) {
+        std::ostringstream out;
+        rans.toJson(out, false);
+        messages.push_back(out.str());
+        rans.update();
+    }
+    return messages;
+}
+
+// Compress one message like websocket::stream does, returning its size
+std::size_t compress(
+    beast::zlib::deflate_stream& stream,
+    std::string const& message,
+    beast::zlib::Flush flush,
+    std::vector<unsigned char>& out)
+{
+    beast::zlib::z_params zs;
+    zs.next_in = message.data();
+    zs.avail_in = message.size();
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    error_code ec;
+    stream.write(zs, beast::zlib::Flush::none, ec);
+    stream.write(zs, beast::zlib::Flush::block, ec);
+    stream.write(zs, flush, ec);
+
+    // The empty stored block of the flush is not sent
+    return zs.total_out - 4;
+}
+
+void measure(Settings const& settings, std::vector<std::string> const& messages)
+{
+    beast::zlib::deflate_stream stream;
+    stream.reset(
+        settings.level,
+        settings.windowBits,
+        settings.memLevel,
+        beast::zlib::Strategy::normal);
+    std::vector<unsigned char> out(64 * 1024);
+
+    std::size_t raw = 0;
+    std::size_t sent = 0;
+    bench::Stopwatch stopwatch;
+    for (auto const& message : messages) {
+        raw += message.size();
+        sent += compress(stream, message, settings.flush, out);
+        if (!settings.takeover) {
+            stream.reset();
+        }
+    }
+    auto const seconds = stopwatch.seconds();
+
+    auto const count = static_cast<double>(messages.size());
+    auto const memory = (1 << (settings.windowBits + 2)) +
+        (1 << (settings.memLevel + 9));
+    std::cout
+        << std::left << std::setw(26) << settings.name << std::right
+        << std::setw(10) << static_cast<double>(sent) / count
+        << std::setw(9) << static_cast<double>(raw) / static_cast<double>(sent)
+        << std::setw(11) << seconds * 1e6 / count
+        << std::setw(11) << static_cast<double>(raw) / seconds / 1e6
+        << std::setw(11) << memory / 1024 << '\n';
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const count = bench::argument(argc, argv, 1, 100'000);
+    auto const messages = residuals(count);
+
+    std::size_t raw = 0;
+    for (auto const& message : messages) {
+        raw += message.size();
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+        << count << " residual messages, "
+        << static_cast<double>(raw) / static_cast<double>(count)
+        << " bytes each\n\n"
+        << std::left << std::setw(26) << "settings" << std::right
+        << std::setw(10) << "B/msg"
+        << std::setw(9) << "ratio"
+        << std::setw(11) << "us/msg"
+        << std::setw(11) << "MB/s in"
+        << std::setw(11) << "zlib KiB" << '\n';
+
+    auto constexpr full = beast::zlib::Flush::full;
+    auto constexpr sync = beast::zlib::Flush::sync;
+    Settings const settings[] = {
+        {"level 1",                  1, 15, 4, true,  full},
+        {"level 6",                  6, 15, 4, true,  full},
+        {"level 8 (beast default)",  8, 15, 4, true,  full},
+        {"level 9",                  9, 15, 4, true,  full},
+        {"level 6, mem 8",           6, 15, 8, true,  full},
+        {"level 6, window 12",       6, 12, 4, true,  full},
+        {"level 6, window 9",        6,  9, 4, true,  full},
+        {"level 6, no takeover",     6, 15, 4, false, full},
+        {"level 1, sync flush",      1, 15, 4, true,  sync},
+        {"level 6, sync flush",      6, 15, 4, true,  sync},
+        {"level 6, window 12, sync", 6, 12, 4, true,  sync},
+    };
+    for (auto const& setting : settings) {
+        measure(setting, messages);
+    }
+}
@@ -0,0 +1,127 @@
+// Cost of the residual history of the runs and of the snapshots it sends
+//
+//   Usage: bench_history [iterations] [runs]
+//
+// Records the residuals of the client solver for a number of runs through
+// the RunRegistry, as the websocket sessions do, then takes the snapshot a
+// late subscriber gets, binary and JSON. A late subscriber used to need
+// every iteration again, so the snapshots are compared with the frames and
+// JSON messages of the same iterations, and with the snapshots downsampled
+// to a budget of points. Last, the same runs are recorded under a memory
+// budget of a quarter of what they need.
+
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "solver.hpp"
+#include "residual_frame.hpp"
+#include "run_registry.hpp"
+
+namespace
+{
+
+std::vector<residual::Frame> frames(std::size_t count)
+{
+    std::vector<residual::Frame> result;
+    result.reserve(count);
+
+    solver::RANS rans(count, std::chrono::milliseconds(0));
+    while (result.size() < count) {
+        result.push_back(rans.frame());
+        rans.update();
+    }
+    return result;
+}
+
+// Record the runs side by side, one iteration of each at a time
+double record(
+    RunRegistry& registry,
+    std::vector<residual::Frame> const& input,
+    std::size_t runs)
+{
+    std::vector<std::uint64_t> ids;
+    for (std::size_t i = 0; i < runs; ++i) {
+        ids.push_back(registry.open());
+    }
+    auto const message = std::make_shared<std::string const>("{}");
+
+    bench::Stopwatch stopwatch;
+    for (auto const& frame : input) {
+        for (auto const id : ids) {
+            registry.record(id, message, &frame);
+        }
+    }
+    return stopwatch.seconds() * 1e9 / static_cast<double>(input.size() * runs);
+}
+
+void snapshot(
+    char const* name,
+    RunRegistry const& registry,
+    bool binary,
+    std::size_t repeat,
+    std::size_t points = 0)
+{
+    std::size_t bytes = 0;
+    bench::Stopwatch stopwatch;
+    for (std::size_t i = 0; i < repeat; ++i) {
+        bytes = registry.snapshot(1, binary, points).size();
+    }
+    std::cout << std::left << std::setw(22) << name << std::right
+              << std::setw(12) << bytes
+              << std::setw(12) << stopwatch.seconds() * 1e6 / static_cast<double>(repeat)
+              << '\n';
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const iterations = bench::argument(argc, argv, 1, 4096);
+    auto const runs = bench::argument(argc, argv, 2, 64);
+    auto const input = frames(iterations);
+
+    // Every iteration kept, within a budget that fits every run
+    auto const needed = runs * iterations * ResidualHistory::entrySize;
+    RunRegistry registry(runs, iterations, 2 * needed);
+    auto const ns = record(registry, input, runs);
+
+    std::cout << "iterations: " << iterations << ", runs: " << runs << '\n'
+              << "record:   " << ns << " ns/frame\n"
+              << "memory:   " << registry.historyBytes() / runs << " bytes/run, "
+              << static_cast<double>(registry.historyBytes()) /
+                 static_cast<double>(runs * iterations) << " bytes/iteration\n\n";
+
+    std::size_t jsonBytes = 0;
+    char json[residual::maxJsonSize];
+    for (auto const& frame : input) {
+        jsonBytes += residual::toJson(frame, json);
+    }
+    std::cout << "catching up             bytes   us/snapshot\n"
+              << std::left << std::setw(22) << "every frame" << std::right
+              << std::setw(12) << iterations * residual::frameSize(residual::Encoding::float64)
+              << std::setw(12) << '-' << '\n'
+              << std::left << std::setw(22) << "every JSON message" << std::right
+              << std::setw(12) << jsonBytes << std::setw(12) << '-' << '\n';
+    snapshot("binary snapshot", registry, true, 1000);
+    snapshot("JSON snapshot", registry, false, 20);
+    snapshot("binary, 500 points", registry, true, 1000, 500);
+    snapshot("JSON, 500 points", registry, false, 100, 500);
+
+    // The oldest histories go first once over budget
+    RunRegistry capped(runs, iterations, needed / 4);
+    record(capped, input, runs);
+    std::size_t kept = 0;
+    capped.forEach([&kept](RunRegistry::Run const& run)
+    {
+        kept += run.history.empty() ? 0 : 1;
+    });
+    std::cout << "\nbudget:   " << needed / 4 << " bytes, held "
+              << capped.historyBytes() << " bytes, " << kept << " of " << runs
+              << " histories kept\n";
+
+    return EXIT_SUCCESS;
+}
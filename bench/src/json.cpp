@@ -0,0 +1,129 @@
+// Cost of the JSON of one solver iteration, property tree versus JsonWriter
+//
+//   Usage: bench_json [iterations]
+//
+// Serializes the same residuals the way RANS::toJson used to (a ptree built
+// and written by write_json into a string stream) and the way it does now
+// (util::JsonWriter into a reused buffer), in both layouts. Reports the time
+// and the heap allocations per document, counted by the counting allocator.
+
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "counting_allocator.hpp"
+#include "json.hpp"
+#include "json_writer.hpp"
+#include "solver.hpp"
+
+namespace
+{
+
+std::vector<residual::Frame> frames(std::size_t count)
+{
+    std::vector<residual::Frame> result;
+    result.reserve(count);
+
+    solver::RANS rans(count, std::chrono::milliseconds(0));
+    while (result.size() < count) {
+        result.push_back(rans.frame());
+        rans.update();
+    }
+    return result;
+}
+
+// What RANS::toJson did before JsonWriter
+std::size_t propertyTree(residual::Frame const& frame, bool pretty)
+{
+    auto const& r = frame.residuals;
+    json::ptree results;
+    results.put("finished", frame.finished());
+    results.put("iteration", frame.iteration);
+    results.put("residuals.momentum.x", r[0]);
+    results.put("residuals.momentum.y", r[1]);
+    results.put("residuals.momentum.z", r[2]);
+    results.put("residuals.energy", r[3]);
+    results.put("residuals.tke", r[4]);
+    results.put("residuals.tdr", r[5]);
+
+    std::ostringstream out;
+    json::write_json(out, results, pretty);
+    return out.str().size();
+}
+
+std::size_t writer(util::JsonWriter& json, residual::Frame const& frame, bool pretty)
+{
+    auto const& r = frame.residuals;
+    json.clear(pretty);
+    json.beginObject();
+    json.member("finished", frame.finished());
+    json.member("iteration", frame.iteration);
+    json.beginObject("residuals");
+    json.beginObject("momentum");
+    json.member("x", r[0]);
+    json.member("y", r[1]);
+    json.member("z", r[2]);
+    json.endObject();
+    json.member("energy", r[3]);
+    json.member("tke", r[4]);
+    json.member("tdr", r[5]);
+    json.endObject();
+    json.endObject();
+    return json.str().size();
+}
+
+template<class Serialize>
+void measure(
+    char const* name,
+    std::vector<residual::Frame> const& input,
+    Serialize serialize)
+{
+    // Warm up, so that reused buffers reach their size
+    std::size_t bytes = serialize(input.front());
+
+    auto const before = bench::allocations();
+    bench::Stopwatch stopwatch;
+    for (auto const& frame : input) {
+        bytes += serialize(frame);
+    }
+    auto const seconds = stopwatch.seconds();
+    auto const count = static_cast<double>(input.size());
+    auto const allocated = static_cast<double>(bench::allocations() - before);
+
+    std::cout
+        << std::left << std::setw(20) << name << std::right
+        << std::setw(9) << static_cast<double>(bytes) / (count + 1)
+        << std::setw(11) << seconds * 1e9 / count
+        << std::setw(14) << allocated / count << '\n';
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const count = bench::argument(argc, argv, 1, 100'000);
+    auto const input = frames(count);
+
+    std::cout << "documents: " << count << '\n'
+              << "serializer              bytes    ns/doc   allocs/doc\n";
+    for (auto const pretty : {false, true}) {
+        measure(pretty ? "ptree (pretty)" : "ptree", input,
+            [pretty](residual::Frame const& frame)
+            {
+                return propertyTree(frame, pretty);
+            });
+
+        util::JsonWriter json;
+        measure(pretty ? "JsonWriter (pretty)" : "JsonWriter", input,
+            [&json, pretty](residual::Frame const& frame)
+            {
+                return writer(json, frame, pretty);
+            });
+    }
+
+    return EXIT_SUCCESS;
+}
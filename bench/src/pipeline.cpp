@@ -0,0 +1,114 @@
+// Requests per second on a single keep-alive connection, with pipelining
+//
+//   Usage: bench_pipeline [requests] [maxDepth]
+//
+// Serves a small cached file and requests it over one connection, writing
+// `depth` requests at a time before reading their responses. Depth 1 is the
+// classic request/response round trip. Each depth runs once against a server
+// that answers one request at a time (--http-pipeline=1) and once against the
+// default queue of the server.
+
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "bench.hpp"
+#include "net.hpp"
+#include "beast.hpp"
+#include "config.hpp"
+#include "server.hpp"
+#include "shared_state.hpp"
+
+namespace
+{
+
+// Requests per second, or 0 if a response went missing
+double measure(
+    tcp::endpoint const& endpoint,
+    std::size_t requests,
+    std::size_t depth)
+{
+    net::io_context ioc;
+    tcp::socket socket(ioc);
+    socket.connect(endpoint);
+    socket.set_option(tcp::no_delay(true));
+
+    std::string batch;
+    for (std::size_t i = 0; i < depth; ++i) {
+        batch += "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    }
+    beast::flat_buffer buffer;
+
+    bench::Stopwatch stopwatch;
+    std::size_t received = 0;
+    while (received < requests) {
+        net::write(socket, net::buffer(batch));
+        for (std::size_t i = 0; i < depth; ++i) {
+            http::response<http::string_body> response;
+            error_code ec;
+            http::read(socket, buffer, response, ec);
+            if (ec || response.result() != http::status::ok) {
+                std::clog << "error: " << ec.message() << '\n';
+                return 0;
+            }
+        }
+        received += depth;
+    }
+    return static_cast<double>(received) / stopwatch.seconds();
+}
+
+double measure(
+    ServerConfig const& config,
+    std::size_t requests,
+    std::size_t depth)
+{
+    auto state = std::make_shared<SharedState>(config);
+    Server server(config, state);
+    server.start();
+
+    // Warm the file cache and the arenas of the session
+    measure(server.localEndpoint(), depth, depth);
+    auto const rate = measure(server.localEndpoint(), requests, depth);
+
+    server.stop();
+    server.join();
+    return rate;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const requests = bench::argument(argc, argv, 1, 100'000);
+    auto const maxDepth = bench::argument(argc, argv, 2, 32);
+
+    auto const root = std::filesystem::temp_directory_path() / "bench_pipeline";
+    std::filesystem::create_directories(root);
+    std::ofstream(root / "index.html") << "<html><body>adaptiv</body></html>\n";
+
+    ServerConfig config;
+    config.port = 0;
+    config.documentRoot = root.string();
+    auto serial = config;
+    serial.httpPipeline = 1;
+
+    std::clog << "requests: " << requests << ", pipeline queue: "
+              << config.httpPipeline << '\n'
+              << std::setw(8) << "depth"
+              << std::setw(16) << "serial req/s"
+              << std::setw(16) << "pipelined req/s" << '\n'
+              << std::fixed << std::setprecision(0);
+
+    for (std::size_t depth = 1; depth <= maxDepth; depth *= 2) {
+        std::clog << std::setw(8) << depth
+                  << std::setw(16) << measure(serial, requests, depth)
+                  << std::setw(16) << measure(config, requests, depth) << '\n';
+    }
+
+    std::filesystem::remove_all(root);
+
+    return EXIT_SUCCESS;
+}
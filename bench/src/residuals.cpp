@@ -0,0 +1,205 @@
+// Size and cost of the residual wire formats, per frame
+//
+//   Usage: bench_residuals [frames]
+//
+// Generates the residuals of the client solver and writes each iteration in
+// every format: the JSON of RANS::toJson, the same JSON written by the server
+// from a binary frame, and the binary frames. Every
+// format is also read back, the JSON with the property tree parser a legacy
+// client would use. The deflated size is that of a websocket session with
+// the default settings, whose context is kept between messages.
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "net.hpp"
+#include "beast.hpp"
+#include "json.hpp"
+#include "solver.hpp"
+#include "residual_frame.hpp"
+
+namespace
+{
+
+std::vector<residual::Frame> frames(std::size_t count)
+{
+    std::vector<residual::Frame> result;
+    result.reserve(count);
+
+    solver::RANS rans(count, std::chrono::milliseconds(0));
+    while (result.size() < count) {
+        result.push_back(rans.frame());
+        rans.update();
+    }
+    return result;
+}
+
+// Size of a message deflated like websocket::stream does
+std::size_t deflated(
+    beast::zlib::deflate_stream& stream,
+    std::string const& message,
+    std::vector<unsigned char>& out)
+{
+    beast::zlib::z_params zs;
+    zs.next_in = message.data();
+    zs.avail_in = message.size();
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    error_code ec;
+    stream.write(zs, beast::zlib::Flush::none, ec);
+    stream.write(zs, beast::zlib::Flush::block, ec);
+    stream.write(zs, beast::zlib::Flush::full, ec);
+    return zs.total_out - 4;
+}
+
+void report(
+    char const* name,
+    std::vector<std::string> const& messages,
+    double encodeSeconds,
+    double decodeSeconds)
+{
+    beast::zlib::deflate_stream stream;
+    stream.reset(6, 12, 4, beast::zlib::Strategy::normal);
+    std::vector<unsigned char> out(64 * 1024);
+
+    std::size_t bytes = 0;
+    std::size_t compressed = 0;
+    for (auto const& message : messages) {
+        bytes += message.size();
+        compressed += deflated(stream, message, out);
+    }
+
+    auto const count = static_cast<double>(messages.size());
+    std::cout
+        << std::left << std::setw(18) << name << std::right
+        << std::setw(9) << static_cast<double>(bytes) / count
+        << std::setw(11) << static_cast<double>(compressed) / count
+        << std::setw(12) << encodeSeconds * 1e9 / count
+        << std::setw(12) << decodeSeconds * 1e9 / count << '\n';
+}
+
+// Read back every message, returning the time taken
+template<class Decode>
+double decodeAll(std::vector<std::string> const& messages, Decode decode)
+{
+    double sum = 0;
+    bench::Stopwatch stopwatch;
+    for (auto const& message : messages) {
+        sum += decode(message);
+    }
+    auto const seconds = stopwatch.seconds();
+
+    // Keep the decoding from being optimised away
+    if (sum < 0) {
+        std::cout << sum;
+    }
+    return seconds;
+}
+
+void propertyTree(std::size_t count)
+{
+    std::vector<std::string> messages;
+    messages.reserve(count);
+
+    // The solver update draws random numbers, which is not timed
+    solver::RANS rans(count, std::chrono::milliseconds(0));
+    double encodeSeconds = 0;
+    while (messages.size() < count) {
+        bench::Stopwatch stopwatch;
+        auto const json = rans.toJson(false);
+        encodeSeconds += stopwatch.seconds();
+        messages.emplace_back(json);
+        rans.update();
+    }
+
+    auto const decodeSeconds = decodeAll(messages, [](std::string const& message)
+    {
+        std::istringstream in(message);
+        json::ptree tree;
+        json::read_json(in, tree);
+        return tree.get<double>("residuals.tdr");
+    });
+    report("json (toJson)", messages, encodeSeconds, decodeSeconds);
+}
+
+void transcoded(std::vector<residual::Frame> const& input)
+{
+    std::vector<std::string> messages;
+    messages.reserve(input.size());
+
+    std::vector<char> out(input.size() * residual::maxJsonSize);
+    std::vector<std::size_t> sizes(input.size());
+    bench::Stopwatch stopwatch;
+    for (std::size_t i = 0; i < input.size(); ++i) {
+        sizes[i] = residual::toJson(
+            input[i], out.data() + i * residual::maxJsonSize);
+    }
+    auto const encodeSeconds = stopwatch.seconds();
+    for (std::size_t i = 0; i < input.size(); ++i) {
+        messages.emplace_back(out.data() + i * residual::maxJsonSize, sizes[i]);
+    }
+
+    auto const decodeSeconds = decodeAll(messages, [](std::string const& message)
+    {
+        std::istringstream in(message);
+        json::ptree tree;
+        json::read_json(in, tree);
+        return tree.get<double>("residuals.tdr");
+    });
+    report("json (server)", messages, encodeSeconds, decodeSeconds);
+}
+
+void binary(
+    char const* name,
+    residual::Encoding encoding,
+    std::vector<residual::Frame> const& input)
+{
+    std::vector<std::string> messages;
+    messages.reserve(input.size());
+
+    auto const size = residual::frameSize(encoding);
+    std::vector<char> out(input.size() * size);
+    residual::Frame previous;
+    bench::Stopwatch stopwatch;
+    for (std::size_t i = 0; i < input.size(); ++i) {
+        residual::encode(input[i], encoding, out.data() + i * size, previous);
+        previous = input[i];
+    }
+    auto const encodeSeconds = stopwatch.seconds();
+    for (std::size_t i = 0; i < input.size(); ++i) {
+        messages.emplace_back(out.data() + i * size, size);
+    }
+
+    residual::Frame frame;
+    auto const decodeSeconds = decodeAll(messages,
+        [&frame](std::string const& message)
+        {
+            auto const last = frame;
+            residual::decode(message, frame, last);
+            return frame.residuals.back();
+        });
+    report(name, messages, encodeSeconds, decodeSeconds);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const count = bench::argument(argc, argv, 1, 100'000);
+    auto const input = frames(count);
+
+    std::cout << "frames: " << count << '\n'
+              << "format               bytes   deflated   encode ns   decode ns\n";
+    propertyTree(count);
+    transcoded(input);
+    binary("binary float64", residual::Encoding::float64, input);
+    binary("binary float32", residual::Encoding::float32, input);
+    binary("binary delta", residual::Encoding::delta, input);
+
+    return EXIT_SUCCESS;
+}
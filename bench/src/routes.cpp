@@ -0,0 +1,80 @@
+// Cost of dispatching a request target and of looking up a mime type
+//
+//   Usage: bench_routes [iterations]
+//
+// Times route() over the API endpoints polled by the dashboards and over
+// static file targets (which leave the router at the first segment), then
+// mimeType() over common extensions.
+
+#include <iostream>
+#include <iomanip>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "beast.hpp"
+#include "mime_type.hpp"
+#include "router.hpp"
+
+namespace
+{
+
+template<class F>
+void measure(
+    char const* name,
+    std::vector<std::string> const& inputs,
+    std::size_t iterations,
+    F&& f)
+{
+    std::size_t checksum = 0;
+    bench::Stopwatch stopwatch;
+    for (std::size_t i = 0; i < iterations; ++i) {
+        checksum += f(inputs[i % inputs.size()]);
+    }
+    auto const ns = stopwatch.seconds() * 1e9 / static_cast<double>(iterations);
+
+    std::clog << std::setw(12) << name
+              << std::setw(12) << std::fixed << std::setprecision(1) << ns
+              << std::setw(14) << checksum << '\n';
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const iterations = bench::argument(argc, argv, 1, 10'000'000);
+
+    std::vector<std::string> const api = {
+        "/api/runs",
+        "/api/runs/42",
+        "/api/runs/42/residuals",
+        "/api/runs/1234567/residuals?since=10",
+        "/api/unknown",
+    };
+    std::vector<std::string> const files = {
+        "/index.html",
+        "/js/dashboard.js",
+        "/css/style.css",
+        "/img/logo.svg",
+    };
+
+    std::clog << "iterations: " << iterations << '\n'
+              << std::setw(12) << "lookup"
+              << std::setw(12) << "ns/call"
+              << std::setw(14) << "checksum" << '\n';
+
+    auto const dispatch = [](std::string const& target)
+    {
+        auto const match = route(target);
+        return static_cast<std::size_t>(match.route) + match.ids[0];
+    };
+    measure("api", api, iterations, dispatch);
+    measure("files", files, iterations, dispatch);
+    measure("mime", files, iterations, [](std::string const& path)
+    {
+        return mimeType(path).size();
+    });
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+// Cost of the run logs: appending every message, and reading a range back
+//
+//   Usage: bench_run_log [iterations] [directory]
+//
+// Appends the JSON of the residuals of the client solver to a RunLog, as
+// the publishing sessions do, then reads ranges of a hundred iterations at
+// random through its sparse index, and the same ranges by reading the
+// whole file and looking at every line, which is what a post-mortem tool
+// without the index would do.
+
+#include <iostream>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "solver.hpp"
+#include "residual_frame.hpp"
+#include "run_log.hpp"
+
+int main(int argc, char** argv)
+{
+    auto const iterations = bench::argument(argc, argv, 1, 1'000'000);
+    auto const directory = std::filesystem::path(
+        argc > 2 ? argv[2] : std::filesystem::temp_directory_path().string()) /
+        "bench_run_log";
+    std::filesystem::create_directories(directory);
+    auto const path = (directory / "run").string();
+
+    std::vector<std::string> lines;
+    lines.reserve(iterations);
+    solver::RANS rans(iterations, std::chrono::milliseconds(0));
+    char json[residual::maxJsonSize];
+    while (lines.size() < iterations) {
+        lines.emplace_back(json, residual::toJson(rans.frame(), json));
+        rans.update();
+    }
+
+    RunLog log(path, 64 * 1024 * 1024);
+    bench::Stopwatch stopwatch;
+    for (auto const& line : lines) {
+        log.append(line);
+    }
+    auto const appendNs = stopwatch.seconds() * 1e9 / static_cast<double>(iterations);
+    std::cout << "iterations: " << iterations << ", log: " << log.size() << " bytes\n"
+              << "append:     " << appendNs << " ns/line\n";
+
+    std::mt19937 engine(42);
+    std::uniform_int_distribution<std::uint32_t> pick(
+        0, static_cast<std::uint32_t>(iterations > 100 ? iterations - 100 : 0));
+    constexpr std::size_t ranges = 1000;
+    std::uint64_t bytes = 0;
+    stopwatch.reset();
+    for (std::size_t i = 0; i < ranges; ++i) {
+        auto const first = pick(engine);
+        bytes += log.read(first, first + 99).size;
+    }
+    std::cout << "indexed:    " << stopwatch.seconds() * 1e6 / ranges
+              << " us/range of 100, " << bytes / ranges << " bytes\n";
+
+    // The whole file, line by line
+    log.close();
+    constexpr std::size_t scans = 3;
+    bytes = 0;
+    stopwatch.reset();
+    for (std::size_t i = 0; i < scans; ++i) {
+        auto const first = pick(engine);
+        for (std::size_t segment = 0;; ++segment) {
+            std::ifstream file(path + '.' + std::to_string(segment) + ".ndjson");
+            if (!file) {
+                break;
+            }
+            std::string line;
+            while (std::getline(file, line)) {
+                auto const at = line.find("\"iteration\":\"");
+                auto const iteration = std::strtoul(line.c_str() + at + 13, nullptr, 10);
+                if (iteration >= first && iteration <= first + 99) {
+                    bytes += line.size() + 1;
+                }
+            }
+        }
+    }
+    std::cout << "full scan:  " << stopwatch.seconds() * 1e6 / scans
+              << " us/range of 100, " << bytes / scans << " bytes\n";
+
+    std::filesystem::remove_all(directory);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+// Throughput and CPU cost of large file downloads, sendfile(2) vs file_body
+//
+//   Usage: bench_sendfile [megabytes] [downloads]
+//
+// Serves a file of the given size from a temporary document root and
+// downloads it repeatedly over a keep-alive connection, once with the
+// zero-copy path and once through the Beast serializer. The server CPU time
+// is the process CPU time minus the time spent by the downloading thread.
+
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "bench.hpp"
+#include "net.hpp"
+#include "config.hpp"
+#include "server.hpp"
+#include "shared_state.hpp"
+
+namespace
+{
+
+double processCpuSeconds()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+        static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double threadCpuSeconds()
+{
+    timespec time{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_nsec) / 1e9;
+}
+
+// Download the file and discard it, returning the number of body bytes
+std::size_t download(tcp::socket& socket, std::vector<char>& buffer)
+{
+    static std::string const request =
+        "GET /payload.bin HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    net::write(socket, net::buffer(request));
+
+    // Read up to the end of the header
+    std::string header;
+    std::size_t body = 0;
+    while (true) {
+        auto const n = socket.read_some(net::buffer(buffer));
+        header.append(buffer.data(), n);
+        auto const end = header.find("\r\n\r\n");
+        if (end != std::string::npos) {
+            body = header.size() - end - 4;
+            header.resize(end);
+            break;
+        }
+    }
+
+    auto const field = header.find("Content-Length: ");
+    auto const length = std::stoull(header.substr(field + 16));
+    while (body < length) {
+        body += socket.read_some(net::buffer(buffer));
+    }
+    return body;
+}
+
+void measure(
+    bool sendfile,
+    std::filesystem::path const& root,
+    std::size_t downloads,
+    std::size_t size)
+{
+    ServerConfig config;
+    config.port = 0;
+    config.documentRoot = root.string();
+    config.sendfile = sendfile;
+
+    auto state = std::make_shared<SharedState>(config);
+    Server server(config, state);
+    server.start();
+
+    net::io_context ioc;
+    tcp::socket socket(ioc);
+    socket.connect(server.localEndpoint());
+    std::vector<char> buffer(1024 * 1024);
+
+    auto const cpuStart = processCpuSeconds();
+    auto const clientStart = threadCpuSeconds();
+    bench::Stopwatch stopwatch;
+
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i < downloads; ++i) {
+        bytes += download(socket, buffer);
+    }
+
+    auto const elapsed = stopwatch.seconds();
+    auto const serverCpu =
+        (processCpuSeconds() - cpuStart) - (threadCpuSeconds() - clientStart);
+    auto const gigabytes = static_cast<double>(bytes) / 1e9;
+
+    std::clog << std::setw(10) << (sendfile ? "sendfile" : "file_body")
+              << std::setw(14) << std::fixed << std::setprecision(2)
+              << gigabytes / elapsed
+              << std::setw(20) << std::setprecision(3)
+              << serverCpu / gigabytes << '\n';
+
+    if (bytes != downloads * size) {
+        std::clog << "error: received " << bytes << " bytes\n";
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    auto const megabytes = bench::argument(argc, argv, 1, 256);
+    auto const downloads = bench::argument(argc, argv, 2, 8);
+    auto const size = megabytes * 1024 * 1024;
+
+    // A document root holding a single, uncacheable, payload
+    auto const root = std::filesystem::temp_directory_path() / "adaptiv_bench_sendfile";
+    std::filesystem::create_directories(root);
+    {
+        std::ofstream payload(root / "payload.bin", std::ios::binary);
+        std::vector<char> chunk(1024 * 1024, 'x');
+        for (std::size_t i = 0; i < megabytes; ++i) {
+            payload.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        }
+    }
+
+    std::clog << "file: " << megabytes << " MiB, downloads: " << downloads << '\n'
+              << std::setw(10) << "path"
+              << std::setw(14) << "GB/s"
+              << std::setw(20) << "server cpu s/GB" << '\n';
+
+    measure(false, root, downloads, size);
+    measure(true, root, downloads, size);
+
+    std::filesystem::remove_all(root);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+// Parameter sweeps of the client solver as the number of threads goes up
+//
+//   Usage: bench_sweep [cases] [iterations]
+//
+// Runs the same batch of RANS cases, with no simulated iteration time, on
+// thread pools of 1, 2, 4... threads up to the number of cores, and reports
+// the cases and iterations per second and the speedup over one thread.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "bench.hpp"
+#include "solver.hpp"
+
+int main(int argc, char** argv)
+{
+    solver::Case parameters;
+    auto const count = bench::argument(argc, argv, 1, 1000);
+    parameters.iterations = bench::argument(argc, argv, 2, 1000);
+    std::vector<solver::Case> const cases(count, parameters);
+
+    std::vector<std::size_t> threads;
+    for (std::size_t n = 1; n < bench::hardwareThreads(); n *= 2) {
+        threads.push_back(n);
+    }
+    threads.push_back(bench::hardwareThreads());
+
+    std::cout << "cases: " << count << ", iterations: " << parameters.iterations
+              << '\n'
+              << " threads     cases/s  iterations/s   speedup\n";
+    double single = 0;
+    for (auto const n : threads) {
+        util::ThreadPool pool(n);
+        bench::Stopwatch stopwatch;
+        solver::batch(cases, pool);
+        auto const seconds = stopwatch.seconds();
+
+        auto const rate = static_cast<double>(count) / seconds;
+        if (single == 0) {
+            single = rate;
+        }
+        std::cout << std::setw(8) << n
+                  << std::setw(12) << rate
+                  << std::setw(14) << rate * static_cast<double>(parameters.iterations)
+                  << std::setw(10) << rate / single << '\n';
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef JSONWRITER_H
+#define JSONWRITER_H
+
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace util
+{
+
+/**
+ * Writes JSON objects into a buffer reused from one document to the next
+ * @details Once the buffer has grown to the size of a document, writing
+ * another one does not allocate. The output has the layout of write_json:
+ * every scalar is a string, numbers are formatted by std::to_chars in their
+ * shortest form that reads back to the same value, and the document ends
+ * with a new line.
+ * @note Keys and string values are written as given, without escaping.
+ */
+class JsonWriter
+{
+    static constexpr std::size_t maxDepth = 16;
+
+    std::string buffer_;
+    std::array<bool, maxDepth> empty_{};    ///< No member yet, per level
+    std::size_t depth_ = 0;
+    bool pretty_;
+
+    void newLine()
+    {
+        if (pretty_) {
+            buffer_ += '\n';
+            buffer_.append(4 * depth_, ' ');
+        }
+    }
+
+    void key(std::string_view name)
+    {
+        assert(depth_ > 0);
+        if (!empty_[depth_ - 1]) {
+            buffer_ += ',';
+        }
+        empty_[depth_ - 1] = false;
+        newLine();
+        buffer_ += '"';
+        buffer_ += name;
+        buffer_ += pretty_ ? "\": " : "\":";
+    }
+
+public:
+    explicit JsonWriter(bool pretty = false)
+        : pretty_(pretty)
+    { }
+
+    /// Start a new document, keeping the memory of the buffer
+    void clear(bool pretty)
+    {
+        buffer_.clear();
+        depth_ = 0;
+        pretty_ = pretty;
+    }
+
+    /// Open the document, or an object member if a name is given
+    void beginObject(std::string_view name = {})
+    {
+        assert(depth_ < maxDepth);
+        if (depth_ > 0) {
+            key(name);
+        }
+        buffer_ += '{';
+        empty_[depth_++] = true;
+    }
+
+    void endObject()
+    {
+        assert(depth_ > 0);
+        auto const empty = empty_[--depth_];
+        if (!empty) {
+            newLine();
+        }
+        buffer_ += '}';
+        if (depth_ == 0) {
+            buffer_ += '\n';
+        }
+    }
+
+    void member(std::string_view name, std::string_view value)
+    {
+        key(name);
+        buffer_ += '"';
+        buffer_ += value;
+        buffer_ += '"';
+    }
+
+    void member(std::string_view name, char const* value)
+    {
+        member(name, std::string_view(value));
+    }
+
+    void member(std::string_view name, bool value)
+    {
+        member(name, value ? std::string_view("true") : std::string_view("false"));
+    }
+
+    template<class T, class = std::enable_if_t<std::is_arithmetic_v<T>>>
+    void member(std::string_view name, T value)
+    {
+        char number[32];
+        auto const end = std::to_chars(number, number + sizeof(number), value).ptr;
+        member(name, std::string_view(number, static_cast<std::size_t>(end - number)));
+    }
+
+    /// The document written since the last clear
+    std::string_view str() const noexcept { return buffer_; }
+};
+
+} // namespace util
+
+#endif //JSONWRITER_H
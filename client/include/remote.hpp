@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "net.hpp"
+#include "beast.hpp"
+#include "residual_frame.hpp"
+#include "spsc_queue.hpp"
+
+/// Talking to the adaptiv server
+namespace remote
+{
+
+using Stream = websocket::stream<beast::tcp_stream>;
+
+/// Connect and upgrade a websocket to the server, synchronously
+/// @throws boost::system::system_error
+inline void connect(Stream& websocket, std::string const& host, std::string const& port)
+{
+    tcp::resolver resolver(websocket.get_executor());
+    auto& stream = beast::get_lowest_layer(websocket);
+    stream.connect(resolver.resolve(host, port));
+    stream.socket().set_option(tcp::no_delay(true));
+
+    websocket.set_option(
+        websocket::stream_base::timeout::suggested(beast::role_type::client));
+    websocket.handshake(host, "/");
+}
+
+/// The thread running the network I/O of the client
+class IoThread
+{
+    net::io_context ioc_{1};
+    net::executor_work_guard<net::io_context::executor_type> work_;
+    std::thread thread_;
+
+public:
+    IoThread()
+        : work_(net::make_work_guard(ioc_))
+        , thread_([this]{ ioc_.run(); })
+    { }
+
+    IoThread(IoThread const&) = delete;
+    IoThread& operator=(IoThread const&) = delete;
+
+    /// Returns once every connection using it is closed
+    ~IoThread()
+    {
+        work_.reset();
+        thread_.join();
+    }
+
+    net::io_context& context() noexcept { return ioc_; }
+};
+
+struct PublisherStats
+{
+    std::uint64_t frames = 0;       ///< Frames written to the server
+    std::uint64_t dropped = 0;      ///< Frames lost to a full queue or an error
+    std::uint64_t messages = 0;     ///< Websocket messages they took
+    std::uint64_t bytes = 0;
+};
+
+/**
+ * Publishes the residual frames of one solver run to the server
+ * @details The solver thread only pushes frames into a lock-free queue and,
+ * when the I/O thread is not already due to look at it, posts it a wake-up,
+ * so an iteration never waits for the network. A full queue drops the frame
+ * instead. The I/O thread writes one message at a time: the frames that pile
+ * up while a write is in flight go out together in the next one, so a slow
+ * link gets fewer, larger writes.
+ * @note publish() and close() must be called from one thread at a time.
+ */
+class Publisher
+{
+    static constexpr std::size_t maxBatch = 64;
+
+    Stream websocket_;
+    util::SpscQueue<residual::Frame> queue_;
+    residual::Encoding encoding_;
+    std::atomic<bool> scheduled_{false};
+    std::atomic<bool> failed_{false};
+
+    // Owned by the I/O thread
+    beast::flat_buffer buffer_;
+    std::string batch_;
+    residual::Frame previous_;
+    bool writing_ = false;
+    bool reading_ = false;
+    bool closing_ = false;
+    bool closed_ = false;
+    std::promise<void> done_;
+
+    /// Owned by the thread publishing
+    bool connected_ = false;
+
+    std::atomic<std::uint64_t> frames_{0};
+    std::atomic<std::uint64_t> dropped_{0};
+    std::atomic<std::uint64_t> messages_{0};
+    std::atomic<std::uint64_t> bytes_{0};
+
+    // The server sends nothing to a publisher, but pings and the closing
+    // handshake still need a read
+    void doRead()
+    {
+        reading_ = true;
+        websocket_.async_read(
+            buffer_,
+            [this](error_code ec, std::size_t)
+            {
+                buffer_.consume(buffer_.size());
+                if (!ec) {
+                    return doRead();
+                }
+                reading_ = false;
+                if (!closing_) {
+                    fail();
+                }
+                settle();
+            });
+    }
+
+    void flush()
+    {
+        if (writing_ || failed_) {
+            return;
+        }
+
+        auto const frameSize = residual::frameSize(encoding_);
+        std::size_t count = 0;
+        residual::Frame frame;
+        batch_.resize(maxBatch * frameSize);
+        while (count < maxBatch && queue_.pop(frame)) {
+            residual::encode(
+                frame, encoding_, batch_.data() + count * frameSize, previous_);
+            previous_ = frame;
+            ++count;
+        }
+        batch_.resize(count * frameSize);
+
+        if (count == 0) {
+            if (closing_ && !closed_) {
+                closed_ = true;
+                websocket_.async_close(
+                    websocket::close_code::normal,
+                    [this](error_code)
+                    {
+                        settle();
+                    });
+            }
+            return;
+        }
+
+        writing_ = true;
+        websocket_.async_write(
+            net::buffer(batch_),
+            [this, count](error_code ec, std::size_t bytes)
+            {
+                writing_ = false;
+                if (ec) {
+                    dropped_.fetch_add(count, std::memory_order_relaxed);
+                    fail();
+                    return settle();
+                }
+                frames_.fetch_add(count, std::memory_order_relaxed);
+                messages_.fetch_add(1, std::memory_order_relaxed);
+                bytes_.fetch_add(bytes, std::memory_order_relaxed);
+                flush();
+            });
+    }
+
+    void fail()
+    {
+        failed_ = true;
+        closed_ = true;
+        error_code ec;
+        beast::get_lowest_layer(websocket_).socket().close(ec);
+    }
+
+    // Wake close() once nothing refers to this object any more
+    void settle()
+    {
+        if (closing_ && closed_ && !reading_ && !writing_) {
+            closing_ = false;
+            done_.set_value();
+        }
+    }
+
+public:
+    /**
+     * @param capacity Frames the queue holds before publish() drops them
+     */
+    Publisher(
+        net::io_context& ioc,
+        residual::Encoding encoding = residual::Encoding::float64,
+        std::size_t capacity = 4096)
+        : websocket_(ioc)
+        , queue_(capacity)
+        , encoding_(encoding)
+    {
+        batch_.reserve(maxBatch * residual::maxFrameSize);
+    }
+
+    Publisher(Publisher const&) = delete;
+    Publisher& operator=(Publisher const&) = delete;
+
+    ~Publisher()
+    {
+        if (connected_) {
+            close();
+        }
+    }
+
+    /**
+     * Connect to the server, before the first publish
+     * @throws boost::system::system_error
+     */
+    void connect(std::string const& host, std::string const& port)
+    {
+        remote::connect(websocket_, host, port);
+        websocket_.binary(true);
+        connected_ = true;
+        net::post(websocket_.get_executor(), [this]{ doRead(); });
+    }
+
+    /**
+     * Queue a frame for the I/O thread, without blocking
+     * @return false if it was dropped
+     */
+    bool publish(residual::Frame const& frame)
+    {
+        if (failed_.load(std::memory_order_relaxed) || !queue_.push(frame)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // The I/O thread clears the flag before draining the queue, so either
+        // it sees this frame or the exchange below posts another wake-up
+        if (!scheduled_.exchange(true, std::memory_order_acq_rel)) {
+            net::post(websocket_.get_executor(), [this]
+            {
+                scheduled_.exchange(false, std::memory_order_acq_rel);
+                flush();
+            });
+        }
+        return true;
+    }
+
+    /// Send the frames still queued, then close the websocket and wait for it
+    PublisherStats close()
+    {
+        if (connected_) {
+            connected_ = false;
+            auto done = done_.get_future();
+            net::post(websocket_.get_executor(), [this]
+            {
+                closing_ = true;
+                flush();
+                settle();
+            });
+            done.wait();
+        }
+        return stats();
+    }
+
+    PublisherStats stats() const
+    {
+        PublisherStats result;
+        result.frames = frames_.load(std::memory_order_relaxed);
+        result.dropped = dropped_.load(std::memory_order_relaxed);
+        result.messages = messages_.load(std::memory_order_relaxed);
+        result.bytes = bytes_.load(std::memory_order_relaxed);
+        return result;
+    }
+};
+
+/**
+ * Measure the round trip time to the server with websocket pings
+ * @param timeout For the connection and the handshake, then for each pong
+ * and for the closing handshake; the pings stop at the first one missed
+ * @throws boost::system::system_error if it cannot connect in time
+ */
+inline void ping(
+    std::string const& host,
+    std::string const& port,
+    std::size_t count,
+    std::chrono::steady_clock::duration timeout = std::chrono::seconds(5))
+{
+    using clock = std::chrono::steady_clock;
+
+    net::io_context ioc;
+    Stream websocket(ioc);
+    auto& stream = beast::get_lowest_layer(websocket);
+    net::steady_timer deadline(ioc);
+    error_code connectError;
+
+    std::vector<double> rtts;
+    std::uint64_t sequence = 0;
+    std::string payload;
+    clock::time_point sent;
+    beast::flat_buffer buffer;
+
+    // Whatever does not complete in time is abandoned with the socket,
+    // which completes the pending read
+    auto const expire = [&]
+    {
+        deadline.expires_after(timeout);
+        deadline.async_wait([&](error_code ec)
+        {
+            if (!ec) {
+                stream.close();
+            }
+        });
+    };
+
+    auto const send = [&]
+    {
+        payload = std::to_string(++sequence);
+        sent = clock::now();
+        expire();
+        websocket.async_ping(
+            websocket::ping_data(payload.c_str()), [](error_code){ });
+    };
+
+    // Pongs are seen by the pending read
+    websocket.control_callback(
+        [&](websocket::frame_type kind, beast::string_view data)
+        {
+            if (kind != websocket::frame_type::pong || data != payload) {
+                return;
+            }
+            rtts.push_back(std::chrono::duration<double, std::micro>(
+                clock::now() - sent).count());
+            if (rtts.size() < count) {
+                send();
+            } else {
+                expire();
+                websocket.async_close(
+                    websocket::close_code::normal, [](error_code){ });
+            }
+        });
+
+    tcp::resolver resolver(ioc);
+    stream.expires_after(timeout);
+    stream.async_connect(resolver.resolve(host, port),
+        [&](error_code ec, tcp::endpoint)
+        {
+            if (ec) {
+                connectError = ec;
+                return;
+            }
+            // The deadlines above are the only ones: the timeouts of the
+            // websocket itself would keep the context running past them
+            stream.socket().set_option(tcp::no_delay(true));
+            websocket.async_handshake(host, "/", [&](error_code ec)
+            {
+                if (ec) {
+                    connectError = ec;
+                    return;
+                }
+                // The websocket keeps its own time from here on
+                stream.expires_never();
+                websocket.async_read(buffer, [&](error_code, std::size_t)
+                {
+                    deadline.cancel();
+                });
+                send();
+            });
+        });
+    ioc.run();
+
+    if (connectError) {
+        throw boost::system::system_error(connectError);
+    }
+    if (rtts.empty()) {
+        std::cerr << "error: no pong from " << host << ':' << port << '\n';
+        return;
+    }
+    auto const [min, max] = std::minmax_element(rtts.begin(), rtts.end());
+    double sum = 0;
+    for (auto const rtt : rtts) {
+        sum += rtt;
+    }
+    std::cout << rtts.size() << " pings to " << host << ':' << port
+              << ": min " << *min << " us, mean "
+              << sum / static_cast<double>(rtts.size()) << " us, max "
+              << *max << " us\n";
+}
+
+} // namespace remote
+
+#endif //REMOTE_H
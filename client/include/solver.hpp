@@ -10,11 +10,16 @@
 
 #include <iostream>
 #include <cstddef>
+#include <cstdint>
+#include <string_view>
 #include <thread>
 #include <chrono>
+#include <vector>
 
 #include "util.hpp"
-#include "json.hpp"
+#include "json_writer.hpp"
+#include "thread_pool.hpp"
+#include "residual_frame.hpp"
 
 namespace solver
 {
@@ -48,6 +53,9 @@ private:
     miliseconds_t iterationTime_;
     bool hasFinished_ = false;
 
+    /// Reused by every call to toJson
+    util::JsonWriter json_;
+
 public:
     RANS(
         std::size_t iterations = 32,
@@ -56,6 +64,7 @@ public:
     , residuals_{{1, 1, 1}, 1, 1, 1}
     , maxIterations_(iterations)
     , iterationTime_(iterationTime)
+    , hasFinished_(iterations == 0)
     { }
 
     bool hasFinished() const { return hasFinished_; }
@@ -66,8 +75,11 @@ public:
             return;
         }
 
+        // Simulate solver runtime
+        std::this_thread::sleep_for(iterationTime_);
+
         ++iteration_;
-        hasFinished_ = iteration_ == maxIterations_;
+        hasFinished_ = iteration_ >= maxIterations_;
 
         residuals_.momentum_.x_ = util::random(Residuals::min, Residuals::max);
         residuals_.momentum_.y_ = util::random(Residuals::min, Residuals::max);
@@ -84,35 +96,179 @@ public:
         residuals_ = {{1, 1, 1}, 1, 1, 1};
     }
 
-    void toJson(std::ostream& out, bool pretty = true)
+    /**
+     * The current results as JSON
+     * @details Written into a buffer the solver keeps, so that streaming the
+     * results does not allocate once the buffer has grown.
+     * @return A view of the buffer, valid until the next call
+     */
+    std::string_view toJson(bool pretty = true)
     {
-        json::ptree results;
-        results.put("finished", hasFinished_);
-        results.put("iteration", iteration_);
-        results.put("residuals.momentum.x", residuals_.momentum_.x_);
-        results.put("residuals.momentum.y", residuals_.momentum_.y_);
-        results.put("residuals.momentum.z", residuals_.momentum_.z_);
-        results.put("residuals.energy", residuals_.energy_);
-        results.put("residuals.tke", residuals_.tke_);
-        results.put("residuals.tdr", residuals_.tdr_);
+        json_.clear(pretty);
+        json_.beginObject();
+        json_.member("finished", hasFinished_);
+        json_.member("iteration", iteration_);
+        json_.beginObject("residuals");
+        json_.beginObject("momentum");
+        json_.member("x", residuals_.momentum_.x_);
+        json_.member("y", residuals_.momentum_.y_);
+        json_.member("z", residuals_.momentum_.z_);
+        json_.endObject();
+        json_.member("energy", residuals_.energy_);
+        json_.member("tke", residuals_.tke_);
+        json_.member("tdr", residuals_.tdr_);
+        json_.endObject();
+        json_.endObject();
+        return json_.str();
+    }
 
-        // Simulate solver runtime
-        std::this_thread::sleep_for(iterationTime_);
+    void toJson(std::ostream& out, bool pretty = true)
+    {
+        auto const json = toJson(pretty);
+        out.write(json.data(), static_cast<std::streamsize>(json.size()));
+    }
 
-        json::write_json(out, results, pretty);
+    /// The current residuals, to be sent with residual::encode
+    residual::Frame frame() const
+    {
+        residual::Frame result;
+        result.iteration = static_cast<std::uint32_t>(iteration_);
+        result.flags = hasFinished_ ? residual::Flags::finished : 0;
+        result.residuals = {
+            residuals_.momentum_.x_, residuals_.momentum_.y_,
+            residuals_.momentum_.z_, residuals_.energy_,
+            residuals_.tke_, residuals_.tdr_};
+        return result;
     }
 };
 
-inline void solve()
+/// One case of a parameter sweep
+struct Case
+{
+    std::size_t iterations = 32;
+    miliseconds_t iterationTime = 0ms;
+};
+
+/// What a case of a sweep ended with
+struct CaseResult
+{
+    residual::Frame last;                   ///< Residuals of the last iteration
+    std::size_t bytes = 0;                  ///< JSON written over the run
+    std::chrono::nanoseconds elapsed{0};
+};
+
+/**
+ * Run every case on a thread pool, one task per case
+ * @param observe Called as observe(index, rans, json) after each iteration,
+ * on the thread running the case, for instance to stream the results
+ * @return The results in the order of the cases
+ */
+template<class Observer>
+std::vector<CaseResult> batch(
+    std::vector<Case> const& cases,
+    util::ThreadPool& pool,
+    Observer observe)
+{
+    // Each task only writes its own result, so none of them synchronise
+    std::vector<CaseResult> results(cases.size());
+    for (std::size_t i = 0; i < cases.size(); ++i) {
+        pool.submit([&cases, &results, &observe, i]
+        {
+            auto const start = std::chrono::steady_clock::now();
+            auto& result = results[i];
+
+            RANS solver(cases[i].iterations, cases[i].iterationTime);
+            auto json = solver.toJson(false);
+            result.bytes += json.size();
+            observe(i, solver, json);
+            while (!solver.hasFinished()) {
+                solver.update();
+                json = solver.toJson(false);
+                result.bytes += json.size();
+                observe(i, solver, json);
+            }
+
+            result.last = solver.frame();
+            result.elapsed = std::chrono::steady_clock::now() - start;
+        });
+    }
+    pool.wait();
+    return results;
+}
+
+inline std::vector<CaseResult> batch(
+    std::vector<Case> const& cases,
+    util::ThreadPool& pool)
+{
+    return batch(cases, pool, [](std::size_t, RANS const&, std::string_view){});
+}
+
+/// Run a sweep of identical cases, observed like batch(), and print a summary
+template<class Observer>
+void batch(
+    std::size_t count,
+    Case const& parameters,
+    std::size_t threads,
+    Observer observe)
+{
+    // Nothing to average over
+    if (count == 0) {
+        std::cout << "0 cases: nothing to run\n";
+        return;
+    }
+
+    util::ThreadPool pool(threads);
+    std::vector<Case> const cases(count, parameters);
+
+    auto const start = std::chrono::steady_clock::now();
+    auto const results = batch(cases, pool, std::move(observe));
+    auto const seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::size_t bytes = 0;
+    std::chrono::nanoseconds busy{0};
+    for (auto const& result : results) {
+        bytes += result.bytes;
+        busy += result.elapsed;
+    }
+    std::cout
+        << count << " cases of " << parameters.iterations << " iterations on "
+        << pool.size() << " threads: " << seconds << " s, "
+        << static_cast<double>(count) / seconds << " cases/s, "
+        << static_cast<double>(count * parameters.iterations) / seconds
+        << " iterations/s, " << bytes << " bytes of JSON\n"
+        << "mean case time: "
+        << std::chrono::duration<double, std::milli>(busy).count() /
+           static_cast<double>(count) << " ms\n";
+}
+
+inline void batch(std::size_t count, Case const& parameters, std::size_t threads)
+{
+    batch(count, parameters, threads,
+        [](std::size_t, RANS const&, std::string_view){});
+}
+
+/**
+ * Run one case, calling observe(rans) with every iteration including the
+ * initial state
+ */
+template<class Observer>
+void solve(Observer observe)
 {
     RANS solver(50, 250ms);
-    solver.toJson(std::cout, false);
+    observe(solver);
     while (!solver.hasFinished()) {
         solver.update();
-        solver.toJson(std::cout, false);
+        observe(solver);
     }
 }
 
+/// Run one case, printing the results
+inline void solve()
+{
+    solve([](RANS& solver){ solver.toJson(std::cout, false); });
+}
+
 } // namespace solve
 
 #endif //SOLVE_H
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+namespace util
+{
+
+/**
+ * Bounded lock-free queue between one producer thread and one consumer thread
+ * @details A ring of a power of two slots indexed by two counters that only
+ * grow, each written by a single side. Each side also caches the last value
+ * it read of the other's counter, so it only touches the other's cache line
+ * when the ring looks full (producer) or empty (consumer).
+ */
+template<class T>
+class SpscQueue
+{
+    static_assert(std::is_trivially_copyable_v<T>,
+        "SpscQueue only moves trivially copyable values");
+
+    static constexpr std::size_t cacheLine = 64;
+
+    std::unique_ptr<T[]> slots_;
+    std::size_t mask_;
+
+    alignas(cacheLine) std::atomic<std::size_t> tail_{0};   ///< Next push
+    std::size_t headCache_ = 0;                             ///< Producer's view
+
+    alignas(cacheLine) std::atomic<std::size_t> head_{0};   ///< Next pop
+    std::size_t tailCache_ = 0;                             ///< Consumer's view
+
+    static std::size_t roundUp(std::size_t capacity)
+    {
+        std::size_t result = 1;
+        while (result < capacity) {
+            result *= 2;
+        }
+        return result;
+    }
+
+public:
+    /// @param capacity Rounded up to a power of two
+    explicit SpscQueue(std::size_t capacity)
+        : slots_(new T[roundUp(capacity)])
+        , mask_(roundUp(capacity) - 1)
+    { }
+
+    SpscQueue(SpscQueue const&) = delete;
+    SpscQueue& operator=(SpscQueue const&) = delete;
+
+    /// @return false if the queue is full. Producer only.
+    bool push(T const& value) noexcept
+    {
+        auto const tail = tail_.load(std::memory_order_relaxed);
+        if (tail - headCache_ > mask_) {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (tail - headCache_ > mask_) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @return false if the queue is empty. Consumer only.
+    bool pop(T& value) noexcept
+    {
+        auto const head = head_.load(std::memory_order_relaxed);
+        if (head == tailCache_) {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (head == tailCache_) {
+                return false;
+            }
+        }
+        value = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Whether the queue looks empty to the consumer. Consumer only.
+    bool empty() const noexcept
+    {
+        return head_.load(std::memory_order_relaxed) ==
+               tail_.load(std::memory_order_acquire);
+    }
+
+    std::size_t capacity() const noexcept { return mask_ + 1; }
+};
+
+} // namespace util
+
+#endif //SPSCQUEUE_H
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace util
+{
+
+/**
+ * Fixed set of threads running tasks, with work stealing
+ * @details Every worker has its own deque. Tasks submitted from a worker go
+ * to the back of its deque, and it takes its tasks from the back, which
+ * keeps related work on one core. Tasks submitted from outside are spread
+ * over the deques in turn. A worker whose deque is empty steals from the
+ * front of the others, so uneven tasks still keep every core busy, and
+ * sleeps only once nothing is queued anywhere.
+ */
+class ThreadPool
+{
+    using Task = std::function<void()>;
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    std::atomic<std::size_t> queued_{0};     ///< Submitted, not yet taken
+    std::size_t unfinished_ = 0;             ///< Submitted, not yet done
+    std::size_t next_ = 0;                   ///< Deque of the next outside task
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable idle_;
+
+    /// Index of the worker running on this thread, if any, per pool
+    static std::pair<ThreadPool const*, std::size_t>& current()
+    {
+        thread_local std::pair<ThreadPool const*, std::size_t> worker{nullptr, 0};
+        return worker;
+    }
+
+    std::optional<Task> pop(std::size_t self)
+    {
+        {
+            auto& own = *workers_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                auto task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return task;
+            }
+        }
+        for (std::size_t i = 1; i < workers_.size(); ++i) {
+            auto& victim = *workers_[(self + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                auto task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return task;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void run(std::size_t self)
+    {
+        current() = {this, self};
+        while (true) {
+            if (auto task = pop(self)) {
+                queued_.fetch_sub(1, std::memory_order_relaxed);
+                (*task)();
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (--unfinished_ == 0) {
+                    idle_.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this]
+            {
+                return stopping_ || queued_.load(std::memory_order_relaxed) > 0;
+            });
+            if (stopping_ && queued_.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(
+        std::size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+    {
+        threads = std::max<std::size_t>(threads, 1);
+        for (std::size_t i = 0; i < threads; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (std::size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this, i]{ run(i); });
+        }
+    }
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    /// Runs the tasks still queued, then joins the threads
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    std::size_t size() const noexcept { return threads_.size(); }
+
+    /// Queue a task. Thread-safe, and may be called from a task.
+    void submit(Task task)
+    {
+        std::size_t target;
+        {
+            // Counted under the lock, so a worker cannot miss it between its
+            // last look at the deques and going to sleep
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++unfinished_;
+            queued_.fetch_add(1, std::memory_order_relaxed);
+            auto const [pool, index] = current();
+            target = pool == this ? index : next_++ % workers_.size();
+        }
+        {
+            auto& worker = *workers_[target];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        ready_.notify_one();
+    }
+
+    /**
+     * Block until every task submitted so far, and those they submit, is done
+     * @warning Must not be called from a task
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]{ return unfinished_ == 0; });
+    }
+};
+
+} // namespace util
+
+#endif //THREADPOOL_H
@@ -14,6 +14,7 @@
 #include <algorithm>
 #include <type_traits>
 #include <random>
+#include <cstdlib>
 
 namespace util
 {
@@ -24,6 +25,7 @@ inline void help()
               "List of commands\n" <<
               "   ping  - ping adaptiv server\n"
               "   solve - start solution process\n"
+              "   batch - run many cases in parallel\n"
               "   help  - show this menu\n"
               "   quit  - close client\n";
 }
@@ -40,15 +42,46 @@ inline std::string getCommand()
     return command;
 }
 
+/// Ask for a line, falling back to a default on an empty answer
+inline std::string getLine(std::string const& prompt, std::string const& fallback)
+{
+    std::cout << prompt;
+    if (!fallback.empty()) {
+        std::cout << " [" << fallback << ']';
+    }
+    std::cout << ": ";
+
+    std::string line;
+    std::getline(std::cin, line);
+    return line.empty() ? fallback : line;
+}
+
+/// Ask for a number, falling back to a default on an empty or invalid answer
+inline std::size_t getNumber(std::string const& prompt, std::size_t fallback)
+{
+    auto const line = getLine(prompt, std::to_string(fallback));
+
+    char* end = nullptr;
+    auto const value = std::strtol(line.c_str(), &end, 10);
+    if (*end != '\0' || value < 0) {
+        return fallback;
+    }
+    return static_cast<std::size_t>(value);
+}
+
+/// The random engine of the calling thread, seeded once from a random device
+inline std::mt19937& randomEngine()
+{
+    thread_local std::mt19937 engine(std::random_device{}());
+    return engine;
+}
+
 template<class T>
 T random(T min, T max)
 {
     static_assert(std::is_arithmetic_v<T>, "T must be an integral type");
 
-    // Seed with a real random device
-    std::random_device rd;
-
-    std::mt19937 gen(rd());
+    auto& gen = randomEngine();
     if constexpr (std::is_integral_v<T>) {
         std::uniform_int_distribution<T> uniformIntDistribution(min, max);
         return uniformIntDistribution(gen);
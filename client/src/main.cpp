@@ -1,10 +1,135 @@
 #include <iostream>
 #include <string>
 #include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "util.hpp"
 #include "solver.hpp"
+#include "remote.hpp"
 
+namespace
+{
+
+// Ask for host:port, false if the answer is empty or not an address
+bool getServer(
+    std::string const& prompt,
+    std::string const& fallback,
+    std::string& host,
+    std::string& port)
+{
+    auto const address = util::getLine(prompt, fallback);
+    auto const colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+        if (!address.empty()) {
+            std::cerr << "error: invalid server '" << address << "'\n";
+        }
+        return false;
+    }
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+void report(remote::PublisherStats const& stats)
+{
+    std::cout << "published " << stats.frames << " frames in " << stats.messages
+              << " messages (" << stats.bytes << " bytes), dropped "
+              << stats.dropped << '\n';
+}
+
+void ping()
+{
+    std::string host;
+    std::string port;
+    if (!getServer("server", "127.0.0.1:8080", host, port)) {
+        return;
+    }
+    auto const count = util::getNumber("pings", 10);
+    try {
+        remote::ping(host, port, std::max<std::size_t>(count, 1));
+    } catch (boost::system::system_error const& e) {
+        std::cerr << "error: " << e.what() << '\n';
+    }
+}
+
+void solve()
+{
+    std::string host;
+    std::string port;
+    if (!getServer("server (empty prints the results)", "", host, port)) {
+        return solver::solve();
+    }
+
+    remote::IoThread io;
+    remote::Publisher publisher(io.context());
+    try {
+        publisher.connect(host, port);
+    } catch (boost::system::system_error const& e) {
+        std::cerr << "error: " << e.what() << '\n';
+        return;
+    }
+    solver::solve([&publisher](solver::RANS& rans)
+    {
+        publisher.publish(rans.frame());
+    });
+    report(publisher.close());
+}
+
+void batch()
+{
+    solver::Case parameters;
+    auto const cases = util::getNumber("cases", 100);
+    parameters.iterations = util::getNumber("iterations per case", 1000);
+    parameters.iterationTime = std::chrono::milliseconds(
+        util::getNumber("milliseconds per iteration", 0));
+    auto const threads = util::getNumber(
+        "threads", std::max(1u, std::thread::hardware_concurrency()));
+
+    std::string host;
+    std::string port;
+    if (!getServer("server (empty keeps the results local)", "", host, port)) {
+        return solver::batch(cases, parameters, threads);
+    }
+
+    // One run, so one connection, per case
+    remote::IoThread io;
+    std::vector<std::unique_ptr<remote::Publisher>> publishers;
+    try {
+        for (std::size_t i = 0; i < cases; ++i) {
+            publishers.push_back(std::make_unique<remote::Publisher>(io.context()));
+            publishers.back()->connect(host, port);
+        }
+    } catch (boost::system::system_error const& e) {
+        std::cerr << "error: " << e.what() << '\n';
+        return;
+    }
+
+    std::vector<remote::PublisherStats> stats(cases);
+    solver::batch(cases, parameters, threads,
+        [&publishers, &stats](
+            std::size_t i, solver::RANS const& rans, std::string_view)
+        {
+            publishers[i]->publish(rans.frame());
+            if (rans.hasFinished()) {
+                stats[i] = publishers[i]->close();
+            }
+        });
+
+    remote::PublisherStats total;
+    for (auto const& s : stats) {
+        total.frames += s.frames;
+        total.dropped += s.dropped;
+        total.messages += s.messages;
+        total.bytes += s.bytes;
+    }
+    report(total);
+}
+
+} // namespace
 
 int main()
 {
@@ -13,9 +138,11 @@ int main()
         auto command = util::getCommand();
 
         if (command == "ping") {
-
+            ping();
         } else if (command == "solve") {
-            solver::solve();
+            solve();
+        } else if (command == "batch") {
+            batch();
         } else if (command == "help") {
             util::help();
         } else if (command == "quit") {
@@ -26,4 +153,4 @@ int main()
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
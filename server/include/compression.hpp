@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+
+#include "beast.hpp"
+
+/// Content codings the server knows how to send
+enum class ContentEncoding
+{
+    brotli, ///< Only served from precompressed .br files
+    gzip
+};
+
+/// Token used in the Accept-Encoding and Content-Encoding fields
+beast::string_view encodingName(ContentEncoding encoding);
+
+/// File extension of precompressed siblings (e.g. ".gz")
+beast::string_view encodingExtension(ContentEncoding encoding);
+
+/**
+ * Whether an Accept-Encoding field accepts a content coding
+ * @details Honours "*" and q-values (a coding with q=0 is refused); the q of
+ * the coding itself prevails over that of "*", as in RFC 7231 section 5.3.4
+ */
+bool acceptsEncoding(beast::string_view acceptEncoding, ContentEncoding encoding);
+
+/**
+ * Compress data in the gzip format (RFC 1952)
+ * @details Uses the deflate implementation shipped with Beast, so there is no
+ * dependency on an external zlib
+ * @return Empty if the deflate failed
+ */
+std::string gzip(beast::string_view data, int level = 6);
+
+#endif //COMPRESSION_H
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <iosfwd>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "net.hpp"
+#include "logger.hpp"
+
+/// What a websocket session does when its write queue is full
+enum class SlowConsumerPolicy
+{
+    dropOldest, ///< Discard the oldest queued message
+    keepLatest, ///< Conflate: discard every queued message but the newest
+    disconnect  ///< Close the connection
+};
+
+/// Runtime configuration of the server, usually built from the command line
+struct ServerConfig
+{
+    net::ip::address address = net::ip::make_address("127.0.0.1");
+    unsigned short port = 8080;    ///< Use 0 to bind to an ephemeral port
+    std::string documentRoot = ".";
+
+    /// Number of threads running the I/O context
+    std::size_t threads = 1;
+
+    /**
+     * Sharded mode: run one io_context, one thread and one listener bound
+     * with SO_REUSEPORT per shard (instead of a single context shared by a
+     * pool of threads). The kernel load-balances the accepts and a session
+     * stays on the shard that accepted it.
+     */
+    bool reusePort = false;
+
+    /// CPUs the threads are pinned to (thread i runs on cpus[i % size])
+    std::vector<int> affinity;
+
+    /// Memory budget of the static file cache in bytes (0 disables it)
+    std::size_t cacheSize = 64 * 1024 * 1024;
+    /// Files larger than this are served from disk
+    std::size_t cacheEntrySize = 1024 * 1024;
+    /// Cached files are checked for modifications at most this often
+    std::chrono::milliseconds cacheRevalidate{1000};
+
+    /// Gzip compressible cached files without a precompressed sibling
+    bool compress = true;
+
+    /// Send uncached files with sendfile(2) (Linux only)
+    bool sendfile = true;
+
+    /// Responses queued per HTTP connection before it stops reading pipelined
+    /// requests (1 answers one request at a time)
+    std::size_t httpPipeline = 8;
+
+    /// Limits of the write queue of each websocket session
+    std::size_t wsQueueMessages = 1024;
+    std::size_t wsQueueBytes = 16 * 1024 * 1024;
+    /// Default policy of the sessions whose queue is full
+    SlowConsumerPolicy slowConsumer = SlowConsumerPolicy::dropOldest;
+
+    /// Negotiate permessage-deflate with the websocket clients that offer it
+    bool wsDeflate = true;
+    /// Compression of outgoing messages: zlib level (0-9), LZ77 window of
+    /// the server (9-15 bits) and memory level of the hash chains (1-9)
+    int wsDeflateLevel = 6;
+    int wsDeflateWindowBits = 12;
+    int wsDeflateMemLevel = 4;
+    /// Keep the compression context between messages (off resets it after
+    /// each message, so every message can be inflated on its own)
+    bool wsDeflateTakeover = true;
+    /// zlib memory of every websocket session together. Sessions that would
+    /// exceed it are not compressed.
+    std::size_t wsDeflateMemory = 256 * 1024 * 1024;
+    /// Topics each websocket session may subscribe to at once
+    std::size_t wsTopics = 64;
+
+    /// Solver runs remembered by the REST API
+    std::size_t runLimit = 1024;
+    /// Iterations of residuals kept per run for the late subscribers
+    /// (0 disables the history)
+    std::size_t historyLength = 4096;
+    /// Memory of the histories of every run together
+    std::size_t historyMemory = 64 * 1024 * 1024;
+    /// Directory of the logs of every message of the runs (empty disables them)
+    std::string runLogDirectory;
+    /// Size of the segment files of the run logs
+    std::size_t runLogSegment = 64 * 1024 * 1024;
+
+    /// Directory of the meshes and case files uploaded with PUT or POST
+    /// (empty disables the uploads)
+    std::string uploadDirectory;
+    /// Largest upload of each kind, in bytes
+    std::size_t meshUploadLimit = std::size_t{4096} * 1024 * 1024;
+    std::size_t caseUploadLimit = 64 * 1024 * 1024;
+
+    /// Where the metrics are served in the Prometheus format (empty disables it)
+    std::string metricsPath = "/metrics";
+
+    /// Lowest level logged
+    LogLevel logLevel = LogLevel::info;
+    /// Keep one in every logSample records below warning
+    std::size_t logSample = 1;
+};
+
+/**
+ * Fill the configuration from the command line
+ * @details Expects <address> <port> <documentRoot> [threads] [--options]
+ * @return false and report on err if the arguments are invalid
+ */
+bool parseArguments(int argc, char** argv, ServerConfig& config, std::ostream& err);
+
+/// Print the command line usage
+void usage(std::ostream& out);
+
+#endif //CONFIG_H
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "net.hpp"
+#include "beast.hpp"
+#include "compression.hpp"
+
+/**
+ * Bounded LRU cache of static files, keyed by their local filesystem path
+ * @details Entries hold the file contents, a strong ETag and the prebuilt
+ * response header. Files larger than the per-entry limit are not kept in
+ * memory, but their metadata (and ETag) still is. An entry is revalidated
+ * against the file modification time and size at most once per revalidation
+ * interval, so repeated requests cost neither disk I/O nor a stat.
+ *
+ * Compressed representations are built at most once per version of a file:
+ * from a precompressed sibling (foo.js.br, foo.js.gz) when there is one, or by
+ * gzipping compressible contents on the fly. They are looked up on first use,
+ * so a sibling created after that is only picked up with the next version of
+ * the file.
+ * @note Thread-safe
+ */
+class FileCache
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    /// A compressed variant of a file
+    struct Representation
+    {
+        /// Null if the variant must be streamed from path
+        std::shared_ptr<std::string const> content;
+        std::string path;
+        std::string etag;
+        http::response_header<> header;
+    };
+
+    struct Entry
+    {
+        /// Null if the file is too large to be cached
+        std::shared_ptr<std::string const> content;
+        std::uint64_t size;
+        std::int64_t modified;  ///< Modification time (filesystem clock ticks)
+        std::string etag;       ///< Strong validator, quoted
+
+        /// Server, content type, ETag and content length
+        http::response_header<> header;
+
+        /// Compressed variants, indexed by ContentEncoding
+        mutable std::array<std::once_flag, 2> encodedOnce;
+        mutable std::array<std::shared_ptr<Representation const>, 2> encoded;
+    };
+
+    /// @param compress Gzip compressible files that have no precompressed sibling
+    FileCache(
+        std::size_t capacity,
+        std::size_t maxEntrySize,
+        clock::duration revalidateAfter,
+        bool compress);
+
+    /**
+     * Return the entry for a file, loading it on a miss or if it changed
+     * @param ec Set if the file cannot be stat'ed or read
+     */
+    std::shared_ptr<Entry const> get(std::string const& path, error_code& ec);
+
+    /**
+     * Return a compressed representation of a file or null if there is none
+     * @param entry The entry get returned for path
+     */
+    std::shared_ptr<Representation const> encoded(
+        std::string const& path,
+        std::shared_ptr<Entry const> const& entry,
+        ContentEncoding encoding);
+
+    /// Bytes currently held (contents plus bookkeeping)
+    std::size_t size() const;
+
+    /// Smaller files are not worth compressing on the fly
+    static constexpr std::size_t minCompressSize = 1024;
+
+private:
+    struct Node
+    {
+        std::string path;
+        std::shared_ptr<Entry const> entry;
+        clock::time_point validated;
+        std::size_t cost;
+    };
+    using Lru = std::list<Node>;
+
+    std::size_t capacity_;
+    std::size_t maxEntrySize_;
+    clock::duration revalidateAfter_;
+    bool compress_;
+
+    mutable std::mutex mutex_;
+    Lru lru_;                               ///< Most recently used first
+    std::unordered_map<std::string, Lru::iterator> index_;
+    std::size_t size_ = 0;
+
+    std::shared_ptr<Entry const> load(
+        std::string const& path,
+        std::uint64_t size,
+        std::int64_t modified,
+        error_code& ec) const;
+
+    std::shared_ptr<Representation const> makeEncoded(
+        std::string const& path,
+        Entry const& entry,
+        ContentEncoding encoding);
+
+    void insert(
+        std::string const& path,
+        std::shared_ptr<Entry const> entry,
+        clock::time_point now);
+    void erase(Lru::iterator node);
+};
+
+#endif //FILECACHE_H
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef HANDLERALLOCATOR_H
+#define HANDLERALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+#include "net.hpp"
+
+/**
+ * Recycled storage for the completion handlers of one object
+ * @details Holds a few blocks, each either free or used by one pending
+ * operation. A block grows to the largest handler it has held, so once the
+ * object has gone through each of its operations they no longer touch the
+ * heap. Requests that find every block in use fall back to operator new.
+ *
+ * Operations may start and complete on different threads (e.g. a broadcast
+ * posting to a session), which is why the blocks are claimed with atomic
+ * flags rather than relying on a strand.
+ * @note The memory must outlive the operations it backs. Asio releases the
+ * storage of an operation before invoking or destroying its handler, so it is
+ * enough for the handlers to keep their owner alive.
+ */
+class HandlerMemory
+{
+    struct Slot
+    {
+        std::atomic<bool> inUse{false};
+        std::atomic<void*> block{nullptr};
+        std::size_t size = 0;   ///< Only accessed by the thread that claimed it
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    std::size_t count_;
+
+public:
+    /// @param slots Operations that may be pending at the same time
+    explicit HandlerMemory(std::size_t slots = 4);
+    ~HandlerMemory();
+
+    HandlerMemory(HandlerMemory const&) = delete;
+    HandlerMemory& operator=(HandlerMemory const&) = delete;
+
+    void* allocate(std::size_t size);
+    void deallocate(void* pointer) noexcept;
+};
+
+/// Standard allocator drawing from a HandlerMemory
+template<class T>
+class HandlerAllocator
+{
+    template<class> friend class HandlerAllocator;
+
+    HandlerMemory* memory_;
+
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) noexcept
+        : memory_(&memory)
+    { }
+
+    template<class U>
+    HandlerAllocator(HandlerAllocator<U> const& other) noexcept
+        : memory_(other.memory_)
+    { }
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(memory_->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* pointer, std::size_t) noexcept
+    {
+        memory_->deallocate(pointer);
+    }
+
+    template<class U>
+    bool operator==(HandlerAllocator<U> const& other) const noexcept
+    { return memory_ == other.memory_; }
+
+    template<class U>
+    bool operator!=(HandlerAllocator<U> const& other) const noexcept
+    { return memory_ != other.memory_; }
+};
+
+/**
+ * Wraps a completion handler so that Asio and Beast allocate the state of
+ * the operation from a HandlerMemory, through the associated allocator
+ */
+template<class Handler>
+class RecyclingHandler
+{
+    HandlerMemory& memory_;
+    Handler handler_;
+
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    template<class H>
+    RecyclingHandler(HandlerMemory& memory, H&& handler)
+        : memory_(memory)
+        , handler_(std::forward<H>(handler))
+    { }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(memory_);
+    }
+
+    template<class... Args>
+    void operator()(Args&&... args)
+    {
+        handler_(std::forward<Args>(args)...);
+    }
+};
+
+/// Allocate the operation that completes with handler from memory
+template<class Handler>
+RecyclingHandler<std::decay_t<Handler>>
+recycle(HandlerMemory& memory, Handler&& handler)
+{
+    return RecyclingHandler<std::decay_t<Handler>>(
+        memory, std::forward<Handler>(handler));
+}
+
+#endif //HANDLERALLOCATOR_H
@@ -8,35 +8,193 @@
 #ifndef HTTPSESSION_H
 #define HTTPSESSION_H
 
+#include <chrono>
 #include <memory>
 #include <cstddef>
 #include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "net.hpp"
 #include "beast.hpp"
 #include "shared_state.hpp"
+#include "handler_allocator.hpp"
+#include "request_arena.hpp"
+#include "router.hpp"
+
+// Zero-copy file responses with sendfile(2)
+#if defined(__linux__)
+#define ADAPTIV_HAS_SENDFILE 1
+#else
+#define ADAPTIV_HAS_SENDFILE 0
+#endif
+
+/// Bodies of the requests and error responses, drawn from the arena
+using ArenaBody = http::basic_string_body<
+    char, std::char_traits<char>, ArenaAllocator<char>>;
 
 class HttpSession: public std::enable_shared_from_this<HttpSession>
 {
-    beast::tcp_stream stream_;
+    /**
+     * A response waiting for its turn to be written
+     * @details Responses leave in the order of their requests. A body held in
+     * memory comes out of the serializer in a single pass, so consecutive
+     * responses of that kind are gathered into one write.
+     */
+    class Work
+    {
+    public:
+        virtual ~Work() = default;
+
+        virtual bool needEof() const = 0;
+        /// Whether a single serializer pass produces the whole response
+        virtual bool gatherable() const = 0;
+        /// Append the buffers of the response and return their size in bytes
+        virtual std::size_t gather(std::vector<net::const_buffer>& buffers) = 0;
+        /// Mark bytes as written and return whether the response is complete
+        virtual bool consume(std::size_t bytes) = 0;
+        /// Write a response that cannot be gathered, on its own
+        virtual void write(HttpSession& session) = 0;
+    };
+
+    template<class Body, class Fields>
+    class WorkImpl;
+
+    /// Destroys a work in place, its memory belongs to an arena
+    struct WorkDeleter
+    {
+        void operator()(Work* work) const noexcept { work->~Work(); }
+    };
+    using WorkPtr = std::unique_ptr<Work, WorkDeleter>;
+
+    /// Storage of the pending read or write, and of the sendfile waits
+    HandlerMemory handlerMemory_;
+    ShardStream stream_;
 
     beast::flat_buffer buffer_;
     std::shared_ptr<SharedState> state_;
+    std::size_t shard_;
+
+    /**
+     * Back the requests and the responses, one arena per queued response
+     * @details Request i is parsed into arena i % queueLimit_, and its
+     * response is allocated there too. Reading stops while the queue is full,
+     * so an arena is free again by the time its turn comes back.
+     */
+    std::unique_ptr<RequestArena[]> arenas_;
+    std::size_t arena_ = 0; ///< Of the request being read
     // The parser is stored in an optional container so we can construct it
     // from scratch at the beginning of each new message
-    std::optional<http::request_parser<http::string_body>> parser_;
+    std::optional<http::request_parser<ArenaBody, ArenaAllocator<char>>> parser_;
+    // An upload takes the parser over once its header is read, and streams
+    // its body to a file instead of the arena
+    std::optional<http::request_parser<http::file_body, ArenaAllocator<char>>> upload_;
+    std::string uploadPath_;    ///< Where the upload goes once complete
+    std::string uploadTemp_;    ///< Where it is written meanwhile
+
+    // Responses not yet written, in the order of their requests
+    std::vector<WorkPtr> queue_;
+    std::size_t queueLimit_;
+    // Buffers of the write in progress, and bytes of each response they hold
+    std::vector<net::const_buffer> gather_;
+    std::vector<std::size_t> gathered_;
+
+    bool reading_ = false;
+    bool writing_ = false;
+    bool closing_ = false;      ///< A queued response closes the connection
+    bool peerClosed_ = false;   ///< The peer sent its last request
+    bool upgrading_ = false;    ///< A websocket upgrade waits for the queue
+    bool lingering_ = false;    ///< Unread request data follows the last one
+    std::uint64_t lingered_ = 0;    ///< Bytes discarded since the shutdown
 
     void fail(error_code ec, char const* what); ///< Report a failure
     void doRead();
+    void onReadHeader(error_code ec, std::size_t);
     void onRead(error_code, std::size_t);
-    void onWrite(error_code ec, std::size_t, bool close);
+    void upgrade();
+
+    /**
+     * Stream the body of a PUT or POST to a file of the upload directory
+     * @details The body is read chunk by chunk, whatever its transfer
+     * encoding, straight from the read buffer to a temporary file that
+     * replaces the target once complete. The timeout applies to each chunk,
+     * so a large upload only fails if the peer stalls. The file is written
+     * on the thread of the shard, as the static files are read; the writes
+     * land in the page cache and do not wait for the disk.
+     */
+    void startUpload(RouteMatch const& match);
+    void doReadUpload();
+    void onReadUpload(error_code ec, std::size_t bytes);
+    /**
+     * Refuse a request before reading its body, which ends the connection
+     * @details Once the response is out, the rest of the request is read and
+     * discarded, up to lingerLimit or lingerTimeout, before the socket is
+     * closed: closing it with unread data would reset the connection and the
+     * peer, still sending, might never see the response.
+     */
+    void reject(http::status status, beast::string_view why, unsigned version);
+    void doLinger();
+    void onLinger(error_code ec, std::size_t bytes);
+
+    /// Queue a response and start writing it if nothing else is
+    template<class Body, class Fields>
+    void enqueue(http::response<Body, Fields>&& response);
+    void doWrite();
+    void onWrite(error_code ec, std::size_t bytes);
+
+    /// Whether the queue has room for the response of another request
+    bool canRead() const noexcept
+    {
+        return !reading_ && !closing_ && !peerClosed_ && !upgrading_ &&
+               queue_.size() < queueLimit_;
+    }
+
+#if ADAPTIV_HAS_SENDFILE
+    // State of the file being transferred by sendFile, after its header
+    beast::file file_;
+    std::uint64_t fileOffset_ = 0;
+    std::uint64_t fileSize_ = 0;
+    std::uint64_t fileRemaining_ = 0;
+    // Aborts the transfer if the peer stops reading
+    net::steady_timer::rebind_executor<ShardExecutor>::other fileTimer_;
+    std::chrono::steady_clock::time_point fileProgress_;
+
+    /**
+     * Write the header with Beast, then hand the body to the kernel with
+     * sendfile(2) so the file contents never cross user space
+     * @param offset, size Of the bytes of the file to send, all of them or
+     * those of a single range
+     */
+    void sendFile(
+        http::response_header<>&& header,
+        beast::file&& file,
+        std::uint64_t offset,
+        std::uint64_t size);
+    void doSendFile();
+    /// Stop the timer and close the file, then carry on as after a write
+    void finishSendFile(error_code ec);
+    void onSendFileTimer(error_code ec);
+#endif
 
 public:
-    static const std::uint64_t maxBodySize = 10'000; ///< In bytes
+    /// Of the requests other than uploads, in bytes
+    static constexpr std::uint64_t maxBodySize = 10'000;
+    static constexpr std::chrono::seconds timeout{30};
+    /// Of the request data discarded after a rejection, at most
+    static constexpr std::uint64_t lingerLimit = 1 << 20;
+    static constexpr std::chrono::seconds lingerTimeout{5};
+    static constexpr std::size_t lingerChunk = 16 * 1024;
+    /// Most responses gathered into a single write
+    static constexpr std::size_t gatherLimit = 16;
 
+    /// @param shard The SharedState shard whose executor the socket uses
     HttpSession(
-        tcp::socket&& socket,
-        std::shared_ptr<SharedState> const& state);
+        ShardSocket&& socket,
+        std::shared_ptr<SharedState> const& state,
+        std::size_t shard);
+
+    ~HttpSession();
 
     void run();
 };
@@ -8,28 +8,51 @@
 #ifndef LISTENER_H
 #define LISTENER_H
 
+#include <chrono>
 #include <memory>
+#include <cstddef>
 
 #include "net.hpp"
-
-// Forward declaration
-class SharedState;
+#include "shared_state.hpp"
+#include "handler_allocator.hpp"
 
 /// Monitors the port, accepts incoming connections and launches the sessions
 class Listener: public std::enable_shared_from_this<Listener>
 {
+    HandlerMemory handlerMemory_{1};    ///< Of the pending accept or wait
     tcp::acceptor acceptor_;
-    tcp::socket socket_;
+    /// Delays the next accept while the process is out of descriptors
+    net::steady_timer timer_;
     std::shared_ptr<SharedState> state_;
 
+    // Shards of the SharedState the connections are spread over
+    std::size_t firstShard_;
+    std::size_t shardCount_;
+    std::size_t nextShard_ = 0;
+
     void fail(error_code ec, char const*what); ///< Report a failure
-    void onAccept(error_code ec);              ///< Handle a connection
+    void doAccept();
+    /// Handle a connection, or an error, which never stops the listener
+    void onAccept(error_code ec, ShardSocket socket, std::size_t shard);
 
 public:
+    /// Before accepting again once out of descriptors or memory
+    static constexpr std::chrono::milliseconds acceptRetry{100};
+
+    /**
+     * @param reusePort Bind with SO_REUSEPORT so that several listeners, each
+     * on its own io_context, can share the endpoint and let the kernel
+     * load-balance incoming connections between them
+     * @param firstShard,shardCount Accepted connections are assigned to the
+     * shards of state in this range, in turn
+     */
     Listener(
         net::io_context& ioc,
         tcp::endpoint endpoint,
-        std::shared_ptr<SharedState> const& state);
+        std::shared_ptr<SharedState> const& state,
+        bool reusePort,
+        std::size_t firstShard,
+        std::size_t shardCount);
 
     /**
      * Start accepting incoming connections
@@ -37,6 +60,9 @@ public:
      * @note run extends the lifetime of the Listener object
      */
     void run();
+
+    /// The address the acceptor is bound to
+    tcp::endpoint localEndpoint() const;
 };
 
 #endif //LISTENER
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "net.hpp"
+#include "beast.hpp"
+
+enum class LogLevel : std::uint8_t
+{
+    debug,
+    info,
+    warning,
+    error,
+    off
+};
+
+/**
+ * Asynchronous logger: the I/O threads only copy a binary record into a
+ * ring buffer of their own, a background thread formats and writes them
+ * @details Each thread that logs owns a single-producer single-consumer ring
+ * of fixed-size records, so logging takes no lock and makes no system call.
+ * Error codes are stored as a category and a value and only turned into text
+ * by the flusher. When a ring is full the record is dropped (and counted)
+ * rather than blocking the io_context. Texts longer than a record are
+ * truncated.
+ *
+ * Records below warning can be sampled: only one in every sampleEvery of
+ * them is kept, per thread. Nothing is recorded until the logger is started.
+ * @note Thread-safe
+ */
+class Logger
+{
+public:
+    /// Records each thread can hold before the flusher catches up
+    static constexpr std::size_t ringSize = 2048;
+
+    Logger() = default;
+    ~Logger();
+
+    Logger(Logger const&) = delete;
+    Logger& operator=(Logger const&) = delete;
+
+    /**
+     * Launch the flusher thread
+     * @param out Receives the records below warning
+     * @param err Receives warnings and errors
+     */
+    void start(
+        LogLevel level,
+        std::size_t sampleEvery,
+        std::ostream& out,
+        std::ostream& err);
+
+    /// Write what is left in the rings and join the flusher thread
+    void stop();
+
+    /// Change the lowest level recorded
+    void level(LogLevel level) noexcept
+    { level_.store(level, std::memory_order_relaxed); }
+
+    bool enabled(LogLevel level) const noexcept
+    {
+        return level >= level_.load(std::memory_order_relaxed) &&
+               running_.load(std::memory_order_relaxed);
+    }
+
+    /// Log "what: text"
+    void write(LogLevel level, char const* what, beast::string_view text) noexcept;
+
+    /// Log "what: message of the error code"
+    void write(LogLevel level, char const* what, error_code const& ec) noexcept;
+
+    /// Records lost because a ring was full
+    std::uint64_t dropped() const noexcept;
+
+private:
+    struct Record
+    {
+        std::int64_t time;          ///< System clock, in nanoseconds
+        char const* what;           ///< Static string
+        boost::system::error_category const* category;
+        int code;
+        std::uint32_t size;         ///< Of the text before truncation
+        LogLevel level;
+        std::uint8_t length;        ///< Of the text kept
+        char text[222];
+    };
+    static_assert(sizeof(Record) == 256, "Records fill four cache lines");
+
+    struct Ring
+    {
+        // Written by the thread
+        alignas(64) std::atomic<std::uint64_t> head{0};
+        std::atomic<std::uint64_t> dropped{0};
+        std::uint64_t sampled = 0;
+
+        // Written by the flusher
+        alignas(64) std::atomic<std::uint64_t> tail{0};
+        std::uint64_t reported = 0;     ///< Drops already reported
+
+        alignas(64) std::array<Record, ringSize> records;
+    };
+
+    std::atomic<LogLevel> level_{LogLevel::info};
+    std::atomic<bool> running_{false};
+    std::size_t sampleEvery_ = 1;
+    std::ostream* out_ = nullptr;
+    std::ostream* err_ = nullptr;
+
+    mutable std::mutex mutex_;      ///< Protects the list, not the rings
+    std::vector<std::unique_ptr<Ring>> rings_;
+    std::thread flusher_;
+
+    /// The ring of the calling thread, registered on first use
+    Ring& local();
+
+    /// Claim a record, null if the level is disabled, sampled out or full
+    Record* acquire(Ring& ring, LogLevel level, char const* what) noexcept;
+    /// Hand the record acquire returned over to the flusher
+    static void commit(Ring& ring) noexcept;
+
+    void flush();
+    /// Format and write every pending record, false if there were none
+    bool drain(std::string& out, std::string& err);
+};
+
+/// The process wide logger
+Logger& logger();
+
+#endif //LOGGER_H
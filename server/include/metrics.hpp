@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Latency histogram with logarithmic buckets, in the manner of HdrHistogram
+ * @details Values (in nanoseconds) are bucketed by their 5 most significant
+ * bits, which bounds the relative error of a quantile to about 3% over the
+ * whole 64-bit range. Each instance has a single writer, so recording is a
+ * pair of plain loads and stores; readers may run concurrently.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr std::size_t subBits = 5;
+    static constexpr std::size_t subBuckets = std::size_t{1} << subBits;
+    static constexpr std::size_t bucketCount =
+        (64 - subBits + 1) * (subBuckets / 2) + subBuckets / 2;
+
+    using Counts = std::array<std::uint64_t, bucketCount>;
+
+    static std::size_t bucket(std::uint64_t value) noexcept;
+
+    /// Smallest value that falls in a bucket
+    static std::uint64_t lowest(std::size_t bucket) noexcept;
+
+    /// Midpoint of the bucket holding a quantile (0 if there are no values)
+    static std::uint64_t quantile(Counts const& counts, double q) noexcept;
+
+    /// Record a value. Only the owner of the histogram may call it.
+    void record(std::uint64_t value) noexcept;
+
+    /// Add the counts of this histogram to a snapshot
+    void mergeInto(Counts& counts, std::uint64_t& sum) const noexcept;
+
+private:
+    std::array<std::atomic<std::uint64_t>, bucketCount> counts_{};
+    std::atomic<std::uint64_t> sum_{0};
+};
+
+/**
+ * Server counters, gauges and latency histograms, rendered in the Prometheus
+ * text exposition format
+ * @details Every thread records into its own cache-line aligned slot, so the
+ * hot paths never contend nor execute locked instructions; a scrape sums the
+ * slots of every thread. Gauges are kept as per-thread deltas, which is why a
+ * session may increment one on a thread and decrement it on another.
+ * @note Thread-safe
+ */
+class Metrics
+{
+public:
+    enum class Counter
+    {
+        accepts,            ///< Connections accepted
+        responseBytes,      ///< HTTP bytes written, headers included
+        websocketBytes,     ///< Websocket payload bytes written
+        coalescedMessages,  ///< Publications replaced within a rate limit
+        runLogBytes,        ///< Bytes appended to the run logs
+        uploadBytes,        ///< Request body bytes written to upload files
+        count
+    };
+
+    enum class Gauge
+    {
+        httpSessions,
+        websocketSessions,
+        queuedMessages,     ///< Messages waiting in websocket write queues
+        count
+    };
+
+    enum class Histogram
+    {
+        handler,            ///< Time spent producing an HTTP response
+        fanout,             ///< Time from a broadcast to its last enqueue
+        count
+    };
+
+    Metrics();
+
+    Metrics(Metrics const&) = delete;
+    Metrics& operator=(Metrics const&) = delete;
+
+    void add(Counter counter, std::uint64_t value = 1);
+    void add(Gauge gauge, std::int64_t delta);
+    void record(Histogram histogram, std::chrono::nanoseconds elapsed);
+
+    /// Count an HTTP response by status code
+    void countResponse(unsigned status);
+
+    /// Write every metric in the Prometheus text format
+    void write(std::ostream& out) const;
+
+private:
+    static constexpr unsigned minStatus = 100;
+    static constexpr unsigned maxStatus = 599;
+
+    struct alignas(64) Slot
+    {
+        std::thread::id owner;
+        std::array<std::atomic<std::uint64_t>,
+            static_cast<std::size_t>(Counter::count)> counters{};
+        std::array<std::atomic<std::int64_t>,
+            static_cast<std::size_t>(Gauge::count)> gauges{};
+        std::array<std::atomic<std::uint64_t>,
+            maxStatus - minStatus + 1> responses{};
+        std::array<LatencyHistogram,
+            static_cast<std::size_t>(Histogram::count)> histograms;
+    };
+
+    std::uint64_t const id_;    ///< Tells instances apart in the thread cache
+
+    mutable std::mutex mutex_;  ///< Protects the list, not the slots
+    std::vector<std::unique_ptr<Slot>> slots_;
+
+    /// The slot of the calling thread, registered on first use
+    Slot& local();
+};
+
+#endif //METRICS_H
@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef MIMETYPE_H
+#define MIMETYPE_H
+
+#include "beast.hpp"
+
+/// Return a reasonable mime type based on the extension of a file
+beast::string_view mimeType(beast::string_view path);
+
+/// Whether responses of a mime type are worth compressing (text formats)
+bool isCompressible(beast::string_view mime);
+
+#endif //MIMETYPE_H
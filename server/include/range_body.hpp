@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef RANGEBODY_H
+#define RANGEBODY_H
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include <boost/optional.hpp>
+
+#include "net.hpp"
+#include "beast.hpp"
+
+/**
+ * A response body made of byte ranges of a file, for 206 responses
+ * @details The ranges come from the cached contents when there are some, or
+ * are read from the open file otherwise. Each part may be preceded by a head,
+ * and the last one followed by a tail, which is how the multipart/byteranges
+ * boundaries are sent; a single range has neither. Only the writer half of
+ * the Body concept is provided.
+ */
+struct RangeBody
+{
+    struct Part
+    {
+        std::string head;       ///< Sent before the bytes, may be empty
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+
+    struct value_type
+    {
+        /// Null if the ranges are read from file
+        std::shared_ptr<std::string const> content;
+        beast::file file;
+        std::vector<Part> parts;
+        std::string tail;       ///< Sent after the last part, may be empty
+
+        /// A single range of cached contents comes out in one buffer
+        bool inMemory() const noexcept
+        {
+            return content && parts.size() == 1 &&
+                   parts.front().head.empty() && tail.empty();
+        }
+    };
+
+    static std::uint64_t size(value_type const& body)
+    {
+        std::uint64_t size = body.tail.size();
+        for (auto const& part : body.parts) {
+            size += part.head.size() + part.length;
+        }
+        return size;
+    }
+
+    class writer
+    {
+        value_type& body_;
+        std::size_t part_ = 0;
+        bool started_ = false;      ///< The head of the part was sent
+        std::uint64_t remain_ = 0;  ///< Bytes of the part not yet sent
+        bool done_ = false;
+        char buffer_[4096];
+
+    public:
+        using const_buffers_type = net::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(http::header<isRequest, Fields> const&, value_type& body)
+            : body_(body)
+        { }
+
+        void init(error_code& ec)
+        {
+            ec = {};
+        }
+
+        boost::optional<std::pair<const_buffers_type, bool>>
+        get(error_code& ec)
+        {
+            ec = {};
+            while (part_ < body_.parts.size()) {
+                auto const& part = body_.parts[part_];
+                if (!started_) {
+                    started_ = true;
+                    remain_ = part.length;
+                    if (!body_.content) {
+                        body_.file.seek(part.offset, ec);
+                        if (ec) {
+                            return boost::none;
+                        }
+                    }
+                    if (!part.head.empty()) {
+                        return {{net::buffer(part.head), true}};
+                    }
+                }
+                if (remain_ == 0) {
+                    ++part_;
+                    started_ = false;
+                    continue;
+                }
+
+                auto const last = part_ + 1 == body_.parts.size() &&
+                                  body_.tail.empty();
+                if (body_.content) {
+                    auto const* data = body_.content->data() +
+                        (part.offset + part.length - remain_);
+                    auto const size = static_cast<std::size_t>(remain_);
+                    remain_ = 0;
+                    return {{const_buffers_type(data, size), !last}};
+                }
+
+                auto const amount = static_cast<std::size_t>(
+                    std::min<std::uint64_t>(remain_, sizeof(buffer_)));
+                auto const read = body_.file.read(buffer_, amount, ec);
+                if (ec) {
+                    return boost::none;
+                }
+                if (read == 0) {
+                    ec = http::error::short_read;
+                    return boost::none;
+                }
+                remain_ -= read;
+                return {{const_buffers_type(buffer_, read), !last || remain_ > 0}};
+            }
+            if (!done_ && !body_.tail.empty()) {
+                done_ = true;
+                return {{net::buffer(body_.tail), false}};
+            }
+            return boost::none;
+        }
+    };
+};
+
+#endif //RANGEBODY_H
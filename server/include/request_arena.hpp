@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef REQUESTARENA_H
+#define REQUESTARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Monotonic storage for the request being handled by a connection
+ * @details Allocations bump a pointer through a list of blocks and
+ * deallocations are ignored, the memory is only reclaimed by reset(). When a
+ * request needed more than one block, reset() replaces them by a single block
+ * large enough for all of them, so a keep-alive connection settles on one
+ * block and stops touching the heap.
+ * @note Not thread-safe: a connection only uses its arena from its strand.
+ */
+class RequestArena
+{
+    struct Block
+    {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    std::size_t current_ = 0;   ///< Block being filled
+    std::size_t used_ = 0;      ///< Bytes taken from the current block
+    std::size_t initialSize_;
+
+public:
+    /// @param initialSize Bytes of the first block, allocated on first use
+    explicit RequestArena(std::size_t initialSize = 16 * 1024);
+
+    RequestArena(RequestArena const&) = delete;
+    RequestArena& operator=(RequestArena const&) = delete;
+
+    void* allocate(std::size_t size, std::size_t alignment);
+
+    /// Release every allocation at once
+    /// @warning Nothing allocated from the arena may still be alive
+    void reset();
+
+    /// Bytes held by the arena
+    std::size_t capacity() const noexcept;
+};
+
+/// Standard allocator drawing from a RequestArena
+template<class T>
+class ArenaAllocator
+{
+    template<class> friend class ArenaAllocator;
+
+    RequestArena* arena_;
+
+public:
+    using value_type = T;
+    // Containers moved or swapped keep drawing from the same arena
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit ArenaAllocator(RequestArena& arena) noexcept
+        : arena_(&arena)
+    { }
+
+    template<class U>
+    ArenaAllocator(ArenaAllocator<U> const& other) noexcept
+        : arena_(other.arena_)
+    { }
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(arena_->allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    void deallocate(T*, std::size_t) noexcept
+    { }
+
+    RequestArena& arena() const noexcept { return *arena_; }
+
+    template<class U>
+    bool operator==(ArenaAllocator<U> const& other) const noexcept
+    { return arena_ == other.arena_; }
+
+    template<class U>
+    bool operator!=(ArenaAllocator<U> const& other) const noexcept
+    { return arena_ != other.arena_; }
+};
+
+#endif //REQUESTARENA_H
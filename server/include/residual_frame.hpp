@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef RESIDUALFRAME_H
+#define RESIDUALFRAME_H
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include <boost/endian/conversion.hpp>
+
+/**
+ * Binary encoding of the residuals of one solver iteration
+ * @details A frame is sent as a websocket binary message with a fixed layout,
+ * every field little-endian:
+ *
+ *     offset  size  field
+ *          0     1  version (1)
+ *          1     1  encoding of the residuals (Encoding)
+ *          2     2  flags (Flags)
+ *          4     4  iteration
+ *          8     8  run id, 0 from the solver and set by the server
+ *         16  6x8   momentum x, y, z, energy, tke and tdr as float64, or
+ *         16  6x4   the same as float32
+ *
+ * The delta encoding stores the bits of each float64 XORed with those of the
+ * previous frame of the stream: the size does not change, but the leading
+ * bytes of residuals that converge are zero and deflate very well. Decoding
+ * it needs the previous frame, so only the solver to server link uses it.
+ *
+ * A snapshot of the history of a run has the same header, with encoding 3,
+ * the run's last iteration and its flags, followed by columns:
+ *
+ *         16     4  number of iterations n
+ *         20     4  zero
+ *         24   n*4  iterations
+ *    24 + n*4  6n*4 momentum x of every iteration as float32, then y, z,
+ *                   energy, tke and tdr
+ *
+ * A solver that writes faster than its link carries sends the frames that
+ * piled up during a write back to back in one message, all with the same
+ * encoding.
+ *
+ * The header is shared by the solver and the server, so it is header-only.
+ */
+namespace residual
+{
+
+inline constexpr std::uint8_t version = 1;
+
+enum class Encoding: std::uint8_t
+{
+    float64 = 0,
+    float32 = 1,
+    delta = 2,
+    snapshot = 3    ///< Not a frame, the history of a run
+};
+
+enum Flags: std::uint16_t
+{
+    finished = 1 << 0
+};
+
+inline constexpr std::size_t count = 6;
+inline constexpr std::size_t headerSize = 16;
+inline constexpr std::size_t maxFrameSize = headerSize + count * 8;
+
+struct Frame
+{
+    std::uint64_t run = 0;
+    std::uint32_t iteration = 0;
+    std::uint16_t flags = 0;
+    /// Momentum x, y and z, energy, tke and tdr
+    std::array<double, count> residuals{};
+    /// How the frame was decoded, which bounds the precision of the residuals
+    Encoding encoding = Encoding::float64;
+
+    bool finished() const noexcept { return (flags & Flags::finished) != 0; }
+};
+
+namespace detail
+{
+
+template<class T>
+void store(char* out, T value) noexcept
+{
+    boost::endian::native_to_little_inplace(value);
+    std::memcpy(out, &value, sizeof(T));
+}
+
+template<class T>
+T load(char const* in) noexcept
+{
+    T value;
+    std::memcpy(&value, in, sizeof(T));
+    return boost::endian::little_to_native(value);
+}
+
+inline std::uint64_t bits(double value) noexcept
+{
+    std::uint64_t result;
+    std::memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+inline double fromBits(std::uint64_t value) noexcept
+{
+    double result;
+    std::memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+inline std::uint32_t bits(float value) noexcept
+{
+    std::uint32_t result;
+    std::memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+inline float fromBits(std::uint32_t value) noexcept
+{
+    float result;
+    std::memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+} // namespace detail
+
+constexpr std::size_t frameSize(Encoding encoding) noexcept
+{
+    return headerSize + count * (encoding == Encoding::float32 ? 4 : 8);
+}
+
+/**
+ * Write a frame, returning its size
+ * @param out At least frameSize(encoding) bytes
+ * @param previous The previous frame of the stream, for the delta encoding
+ */
+inline std::size_t encode(
+    Frame const& frame,
+    Encoding encoding,
+    char* out,
+    Frame const& previous = Frame{}) noexcept
+{
+    using namespace detail;
+
+    out[0] = static_cast<char>(version);
+    out[1] = static_cast<char>(encoding);
+    store(out + 2, frame.flags);
+    store(out + 4, frame.iteration);
+    store(out + 8, frame.run);
+
+    auto* values = out + headerSize;
+    for (std::size_t i = 0; i < count; ++i) {
+        switch (encoding) {
+        case Encoding::float64:
+            store(values + 8 * i, bits(frame.residuals[i]));
+            break;
+        case Encoding::float32:
+            store(values + 4 * i, bits(static_cast<float>(frame.residuals[i])));
+            break;
+        case Encoding::delta:
+            store(values + 8 * i,
+                bits(frame.residuals[i]) ^ bits(previous.residuals[i]));
+            break;
+        case Encoding::snapshot:
+            break;
+        }
+    }
+    return frameSize(encoding);
+}
+
+/// Whether a message is a frame this version can decode
+inline bool isFrame(std::string_view message) noexcept
+{
+    if (message.size() < headerSize ||
+        static_cast<std::uint8_t>(message[0]) != version) {
+        return false;
+    }
+    auto const encoding = static_cast<Encoding>(message[1]);
+    return encoding <= Encoding::delta && message.size() == frameSize(encoding);
+}
+
+/// Number of frames back to back in a message, 0 if it is not frames
+inline std::size_t frameCount(std::string_view message) noexcept
+{
+    if (message.size() < headerSize) {
+        return 0;
+    }
+    auto const size = frameSize(static_cast<Encoding>(message[1]));
+    if (message.size() % size != 0) {
+        return 0;
+    }
+    for (std::size_t offset = 0; offset < message.size(); offset += size) {
+        if (!isFrame(message.substr(offset, size))) {
+            return 0;
+        }
+    }
+    return message.size() / size;
+}
+
+/**
+ * Read a frame
+ * @param previous The previous frame of the stream, for the delta encoding
+ * @return false if the message is not a frame this version can decode
+ */
+inline bool decode(
+    std::string_view message,
+    Frame& frame,
+    Frame const& previous = Frame{}) noexcept
+{
+    using namespace detail;
+
+    if (!isFrame(message)) {
+        return false;
+    }
+    auto const* in = message.data();
+    frame.encoding = static_cast<Encoding>(in[1]);
+    frame.flags = load<std::uint16_t>(in + 2);
+    frame.iteration = load<std::uint32_t>(in + 4);
+    frame.run = load<std::uint64_t>(in + 8);
+
+    auto const* values = in + headerSize;
+    for (std::size_t i = 0; i < count; ++i) {
+        switch (frame.encoding) {
+        case Encoding::float64:
+            frame.residuals[i] = fromBits(load<std::uint64_t>(values + 8 * i));
+            break;
+        case Encoding::float32:
+            frame.residuals[i] = fromBits(load<std::uint32_t>(values + 4 * i));
+            break;
+        case Encoding::delta:
+            frame.residuals[i] = fromBits(
+                load<std::uint64_t>(values + 8 * i) ^ bits(previous.residuals[i]));
+            break;
+        case Encoding::snapshot:
+            break;
+        }
+    }
+    return true;
+}
+
+/// Upper bound of the size of the JSON of a frame
+inline constexpr std::size_t maxJsonSize = 512;
+
+/**
+ * Write a frame as the JSON text messages of the legacy clients, returning
+ * its size
+ * @details Same layout as RANS::toJson: every value is a string and the
+ * residuals are nested under their equation. The doubles are written in
+ * their shortest form that reads back to the same value, at the precision
+ * of the frame.
+ * @param out At least maxJsonSize bytes
+ */
+inline std::size_t toJson(Frame const& frame, char* out) noexcept
+{
+    auto* first = out;
+    auto const append = [&out](std::string_view text)
+    {
+        std::memcpy(out, text.data(), text.size());
+        out += text.size();
+    };
+    auto const number = [&out](auto value)
+    {
+        *out++ = '"';
+        out = std::to_chars(out, out + 32, value).ptr;
+        *out++ = '"';
+    };
+
+    static constexpr std::string_view keys[count] = {
+        R"(,"residuals":{"momentum":{"x":)", R"(,"y":)", R"(,"z":)",
+        R"(},"energy":)", R"(,"tke":)", R"(,"tdr":)"};
+
+    append(frame.finished()
+        ? R"({"finished":"true","iteration":)"
+        : R"({"finished":"false","iteration":)");
+    number(frame.iteration);
+    for (std::size_t i = 0; i < count; ++i) {
+        append(keys[i]);
+        if (frame.encoding == Encoding::float32) {
+            number(static_cast<float>(frame.residuals[i]));
+        } else {
+            number(frame.residuals[i]);
+        }
+    }
+    append("}}");
+    return static_cast<std::size_t>(out - first);
+}
+
+} // namespace residual
+
+#endif //RESIDUALFRAME_H
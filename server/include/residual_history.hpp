@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef RESIDUALHISTORY_H
+#define RESIDUALHISTORY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "residual_frame.hpp"
+
+/**
+ * The residuals of the last iterations of a run, column by column
+ * @details One column of iteration numbers and one column of float32 per
+ * residual, 28 bytes an iteration. The columns grow up to the capacity, then
+ * the newest iteration overwrites the oldest. A snapshot is the columns
+ * themselves, oldest first, so it is written with a few copies. A snapshot
+ * with a budget of points is downsampled with Largest-Triangle-Three-Buckets
+ * on the logarithm of the residuals, which keeps the spikes and plateaus a
+ * convergence plot shows rather than every n-th iteration.
+ * @note Not thread-safe: the RunRegistry owning it holds the lock
+ */
+class ResidualHistory
+{
+public:
+    static constexpr std::size_t entrySize =
+        sizeof(std::uint32_t) + residual::count * sizeof(float);
+
+    /// @param capacity Iterations kept, 0 keeps none
+    explicit ResidualHistory(std::size_t capacity = 0);
+
+    void append(residual::Frame const& frame);
+
+    /// Forget every iteration and release the memory
+    void clear();
+
+    std::size_t size() const noexcept { return iterations_.size(); }
+    bool empty() const noexcept { return iterations_.empty(); }
+
+    /// Heap memory of the columns
+    std::size_t bytes() const noexcept
+    { return iterations_.capacity() * entrySize; }
+
+    /**
+     * Binary snapshot message, as described in residual_frame.hpp
+     * @param flags Of the run, such as Flags::finished
+     * @param points Iterations at most, 0 for all of them
+     */
+    std::string snapshot(
+        std::uint64_t run,
+        std::uint16_t flags,
+        std::size_t points = 0) const;
+
+    /**
+     * The same snapshot for the JSON subscribers:
+     * {"snapshot":{"run":1,"finished":"false","iterations":[...],
+     * "residuals":{"momentum":{"x":[...],"y":[...],"z":[...]},"energy":[...],
+     * "tke":[...],"tdr":[...]}}}
+     */
+    std::string json(std::uint64_t run, bool finished, std::size_t points = 0) const;
+
+    /**
+     * Indexes in the columns of the iterations of a snapshot, oldest first
+     * @details Every iteration, or the first, the last and the one of each
+     * bucket in between that makes the largest triangle with the one kept
+     * before it and the average of the next bucket
+     */
+    std::vector<std::size_t> select(std::size_t points) const;
+
+private:
+    std::size_t capacity_;
+    std::size_t first_ = 0;     ///< Oldest entry, once the columns are full
+    std::vector<std::uint32_t> iterations_;
+    std::array<std::vector<float>, residual::count> residuals_;
+
+    /// Index in the columns of the i-th oldest entry
+    std::size_t at(std::size_t i) const noexcept
+    {
+        auto const index = first_ + i;
+        return index < iterations_.size() ? index : index - iterations_.size();
+    }
+};
+
+#endif //RESIDUALHISTORY_H
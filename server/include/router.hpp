@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "beast.hpp"
+
+/// What serves a request target
+enum class Route
+{
+    file,           ///< Anything outside of the API: a static file
+    runs,           ///< GET /api/runs
+    run,            ///< GET /api/runs/{id}
+    residuals,      ///< GET /api/runs/{id}/residuals
+    history,        ///< GET /api/runs/{id}/history[?points=N]
+    log,            ///< GET /api/runs/{id}/log[?from=N][&to=N]
+    mesh,           ///< PUT or POST /api/meshes/{name}
+    caseFile,       ///< PUT or POST /api/cases/{name}
+    apiNotFound     ///< Under /api/ but not a known endpoint
+};
+
+/// A dispatched target and the values of its {id} or {name} segments
+struct RouteMatch
+{
+    Route route = Route::file;
+    std::array<std::uint64_t, 2> ids{};
+    std::string_view name;  ///< Of an upload, a plain file name
+};
+
+/**
+ * The API endpoints, known at compile time
+ * @details {id} matches a segment of decimal digits. Dispatch hashes the
+ * shape of the target (its segments, with the numeric ones standing for
+ * {id}) in a single pass, then looks the hash up in a table that is built at
+ * compile time and is collision free for these patterns.
+ */
+namespace routes
+{
+
+struct Entry
+{
+    std::string_view pattern;
+    Route route;
+};
+
+inline constexpr Entry table[] = {
+    {"/api/runs", Route::runs},
+    {"/api/runs/{id}", Route::run},
+    {"/api/runs/{id}/residuals", Route::residuals},
+    {"/api/runs/{id}/history", Route::history},
+    {"/api/runs/{id}/log", Route::log},
+};
+
+/// Uploads name their file in the last segment, so they match by prefix
+inline constexpr Entry uploads[] = {
+    {"/api/meshes/", Route::mesh},
+    {"/api/cases/", Route::caseFile},
+};
+
+/// Every target under it is answered by the API, never from the filesystem
+inline constexpr std::string_view prefix = "/api";
+inline constexpr std::string_view parameter = "{id}";
+
+// FNV-1a
+inline constexpr std::uint64_t hashSeed = 14695981039346656037ull;
+
+constexpr std::uint64_t hash(std::uint64_t h, std::string_view bytes) noexcept
+{
+    for (auto const c : bytes) {
+        h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return h;
+}
+
+constexpr std::uint64_t hash(std::string_view pattern) noexcept
+{
+    return hash(hashSeed, pattern);
+}
+
+/// Smallest table size where every pattern lands in its own slot
+constexpr std::size_t perfectSize() noexcept
+{
+    for (std::size_t size = std::size(table); size <= 64; ++size) {
+        bool distinct = true;
+        for (std::size_t i = 0; i < std::size(table); ++i) {
+            for (std::size_t j = 0; j < i; ++j) {
+                distinct = distinct &&
+                    hash(table[i].pattern) % size != hash(table[j].pattern) % size;
+            }
+        }
+        if (distinct) {
+            return size;
+        }
+    }
+    return 0;
+}
+
+inline constexpr std::size_t slotCount = perfectSize();
+static_assert(slotCount > 0, "no collision free table for the route patterns");
+
+struct Slot
+{
+    std::uint64_t hash = 0;
+    Entry const* entry = nullptr;
+};
+
+constexpr std::array<Slot, slotCount> slots() noexcept
+{
+    std::array<Slot, slotCount> result{};
+    for (auto const& entry : table) {
+        auto const h = hash(entry.pattern);
+        result[h % slotCount] = Slot{h, &entry};
+    }
+    return result;
+}
+
+inline constexpr auto slotTable = slots();
+
+} // namespace routes
+
+/// Find the route of a request target (the query string is ignored)
+RouteMatch route(beast::string_view target) noexcept;
+
+#endif //ROUTER_H
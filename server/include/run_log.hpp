@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef RUNLOG_H
+#define RUNLOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+#include "net.hpp"
+#include "beast.hpp"
+
+/**
+ * Append-only log of every message of one run, in memory-mapped segments
+ * @details Each message is one line of JSON, so the files are newline
+ * delimited JSON any tool reads: the binary frames as the JSON the legacy
+ * subscribers get, and the JSON messages with their line breaks turned into
+ * spaces; binary messages that are not frames are left out. The lines are
+ * appended to segment files of a bounded size, each mapped once for the
+ * readers; a line that does not fit starts the next segment. The files only
+ * grow as lines are written, so a server that stops at any point leaves
+ * whole lines behind, and a torn one at worst.
+ *
+ * The first line of each segment and every indexStride-th line go into a
+ * sparse index of iterations, so a range of iterations is found with a
+ * binary search and a scan of at most indexStride lines at each end, then
+ * served straight from the mapped pages.
+ * @note append() and close() are called by the publishing session only,
+ * read() from any thread.
+ */
+class RunLog
+{
+public:
+    static constexpr std::size_t indexStride = 64;
+
+    /// A mapped segment file, unmapped once nothing refers to it
+    struct Segment;
+
+    /// The lines of a range of iterations, keeping their segments mapped
+    struct Range
+    {
+        std::vector<std::shared_ptr<Segment const>> segments;
+        std::vector<net::const_buffer> buffers;
+        std::uint64_t size = 0;
+    };
+
+    /**
+     * No file is created before the first line
+     * @param path Of the segments, which get .<n>.ndjson appended
+     */
+    RunLog(std::string path, std::size_t segmentSize);
+    ~RunLog();
+
+    RunLog(RunLog const&) = delete;
+    RunLog& operator=(RunLog const&) = delete;
+
+    /**
+     * Append a message as a line
+     * @return The bytes of the line, 0 if it was not written: the message is
+     * binary, or the log failed; the first failure is logged and the log
+     * stops there
+     */
+    std::size_t append(std::string_view message);
+
+    /// The publishing session is done: nothing more is appended
+    void close();
+
+    /// The lines of the iterations first to last included
+    Range read(
+        std::uint32_t first,
+        std::uint32_t last = std::numeric_limits<std::uint32_t>::max()) const;
+
+    /// Bytes appended
+    std::uint64_t size() const noexcept
+    { return size_.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry
+    {
+        std::uint32_t iteration;
+        std::size_t segment;
+        std::size_t offset;
+    };
+
+    std::string path_;
+    std::size_t segmentSize_;
+
+    // Only the writer changes them; it holds the mutex to do so, and the
+    // readers to look at them
+    mutable std::mutex mutex_;
+    std::vector<std::shared_ptr<Segment>> segments_;
+    std::vector<Entry> index_;
+
+    // The writer's own
+    std::uint32_t iteration_ = 0;   ///< Of the last line
+    std::size_t lines_ = 0;
+    std::string line_;      ///< The line being written
+    bool failed_ = false;
+    bool closed_ = false;
+
+    std::atomic<std::uint64_t> size_{0};
+
+    bool rotate(std::size_t lineSize);
+};
+
+/**
+ * A response body streaming a range of a RunLog from its mapped pages
+ * @details Same pattern as SharedStringBody: writer only, no copy.
+ */
+struct RunLogBody
+{
+    using value_type = RunLog::Range;
+
+    static std::uint64_t size(value_type const& body)
+    {
+        return body.size;
+    }
+
+    class writer
+    {
+        value_type const& body_;
+
+    public:
+        using const_buffers_type = std::vector<net::const_buffer>;
+
+        template<bool isRequest, class Fields>
+        writer(http::header<isRequest, Fields> const&, value_type const& body)
+            : body_(body)
+        { }
+
+        void init(error_code& ec)
+        {
+            ec = {};
+        }
+
+        boost::optional<std::pair<const_buffers_type, bool>>
+        get(error_code& ec)
+        {
+            ec = {};
+            if (body_.size == 0) {
+                return boost::none;
+            }
+            return {{body_.buffers, false}};
+        }
+    };
+};
+
+#endif //RUNLOG_H
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef RUNREGISTRY_H
+#define RUNREGISTRY_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "residual_frame.hpp"
+#include "residual_history.hpp"
+#include "run_log.hpp"
+
+/**
+ * The solver runs streaming their residuals to the server
+ * @details A run is opened by the first message a websocket client publishes
+ * and follows that session. Each run keeps its latest residual update, so the
+ * REST API answers from memory, and the history of its binary residual
+ * frames, so a late subscriber catches up with a snapshot. The oldest runs
+ * are forgotten beyond the limit, finished or disconnected ones first, and
+ * the histories of the oldest runs are dropped the same way beyond their
+ * memory budget. Runs may also log every message to files, which outlive
+ * them.
+ * @note Thread-safe
+ */
+class RunRegistry
+{
+public:
+    struct Run
+    {
+        std::uint64_t id;
+        std::chrono::system_clock::time_point started;
+        std::uint64_t messages = 0;
+        bool finished = false;  ///< The solver reported its last iteration
+        bool live = true;       ///< The publishing session is connected
+        std::shared_ptr<std::string const> latest;
+        ResidualHistory history;
+        std::shared_ptr<RunLog> log;    ///< Null if the runs are not logged
+    };
+
+    /**
+     * @param historyLength Iterations kept per run
+     * @param historyMemory Memory of the histories of every run together
+     * @param logDirectory Where the runs are logged, empty for nowhere
+     */
+    RunRegistry(
+        std::size_t limit,
+        std::size_t historyLength = 0,
+        std::size_t historyMemory = 0,
+        std::string logDirectory = {},
+        std::size_t logSegment = 64 * 1024 * 1024);
+
+    /// Open a new run and return its id
+    std::uint64_t open();
+
+    /**
+     * Record a residual update of a run
+     * @param frame Its residuals, appended to the history, if it came as a
+     * binary frame
+     */
+    void record(
+        std::uint64_t id,
+        std::shared_ptr<std::string const> message,
+        residual::Frame const* frame = nullptr);
+
+    /**
+     * Snapshot of the history of a run, binary or JSON
+     * @details The history is copied under the lock and formatted outside it.
+     * @param points Iterations at most, downsampled, 0 for all of them
+     * @return empty if there is no such run or it has no history
+     */
+    std::string snapshot(std::uint64_t id, bool binary, std::size_t points = 0) const;
+
+    /// Memory held by the histories
+    std::size_t historyBytes() const;
+
+    /// The log of a run, null if there is no such run or it is not logged
+    std::shared_ptr<RunLog> log(std::uint64_t id) const;
+
+    /// The publishing session of a run went away
+    void close(std::uint64_t id);
+
+    /// Call f with every run, oldest first, while holding the lock
+    template<class F>
+    void forEach(F&& f) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto const& run : runs_) {
+            f(run);
+        }
+    }
+
+    /**
+     * Call f with a run while holding the lock
+     * @return false if there is no such run
+     */
+    template<class F>
+    bool visit(std::uint64_t id, F&& f) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const run = find(id);
+        if (!run) {
+            return false;
+        }
+        f(*run);
+        return true;
+    }
+
+    std::size_t size() const;
+
+private:
+    std::size_t limit_;
+    std::size_t historyLength_;
+    std::size_t historyMemory_;
+    std::string logDirectory_;
+    std::size_t logSegment_;
+    mutable std::mutex mutex_;
+    std::deque<Run> runs_;  ///< By increasing id
+    std::uint64_t nextId_ = 1;
+    std::size_t historyBytes_ = 0;
+
+    /// Drop the oldest histories but that of keep until they fit the budget
+    void trimHistories(Run const& keep);
+
+    Run const* find(std::uint64_t id) const;
+    Run* find(std::uint64_t id);
+};
+
+#endif //RUNREGISTRY_H
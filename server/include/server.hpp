@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "net.hpp"
+#include "config.hpp"
+
+// Forward declarations
+class Listener;
+class SharedState;
+
+/**
+ * Owns the I/O contexts, the threads running them and the listeners
+ * @details Each thread backs one SharedState shard. In the default mode a
+ * single io_context is shared by a pool of threads and each shard is a strand
+ * of it. In sharded mode (ServerConfig::reusePort) each thread runs its own
+ * io_context with its own SO_REUSEPORT listener, so a session never leaves
+ * the thread that accepted it.
+ */
+class Server
+{
+    ServerConfig config_;
+    std::shared_ptr<SharedState> state_;
+    std::vector<std::unique_ptr<net::io_context>> contexts_;
+    std::vector<std::shared_ptr<Listener>> listeners_;
+    std::vector<std::thread> threads_;
+
+    void runThread(std::size_t index);
+
+public:
+    Server(ServerConfig config, std::shared_ptr<SharedState> const& state);
+
+    /// Stops and joins the threads if the caller did not
+    ~Server();
+
+    Server(Server const&) = delete;
+    Server& operator=(Server const&) = delete;
+
+    /// The first context (e.g. to install signal handlers)
+    net::io_context& ioContext() noexcept { return *contexts_.front(); }
+
+    /// The address the listeners are bound to (useful when binding to port 0)
+    tcp::endpoint localEndpoint() const;
+
+    /// Start accepting connections and launch the threads
+    void start();
+
+    /// Stop every I/O context. Safe to call from any thread
+    void stop();
+
+    /// Wait for every thread to return
+    void join();
+};
+
+#endif //SERVER_H
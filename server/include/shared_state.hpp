@@ -8,37 +8,284 @@
 #ifndef SHAREDSTATE_H
 #define SHAREDSTATE_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
 #include <string>
-#include <unordered_set>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <utility>
 #include <mutex>
 
+#include "net.hpp"
+#include "beast.hpp"
+#include "config.hpp"
+#include "file_cache.hpp"
+#include "metrics.hpp"
+#include "handler_allocator.hpp"
+#include "run_registry.hpp"
+
 // Forward declaration
 class WebSocketSession;
 
+/**
+ * Executor of the sessions of a shard: a strand over an io_context of the server
+ * @details Sockets and streams name it rather than net::any_io_executor, whose
+ * type erasure allocates a copy of the strand every time an operation tracks
+ * outstanding work.
+ */
+using ShardExecutor = net::strand<net::io_context::executor_type>;
+using ShardSocket = tcp::socket::rebind_executor<ShardExecutor>::other;
+using ShardStream = beast::basic_stream<tcp, ShardExecutor>;
+
+/// Time between the start of a broadcast and its last session enqueue
+struct FanoutStats
+{
+    std::uint64_t count = 0;       ///< Broadcasts measured
+    std::chrono::nanoseconds last{0};
+    std::chrono::nanoseconds max{0};
+    std::chrono::nanoseconds mean{0};
+};
+
+/// Write queue counters, aggregated over every websocket session
+struct QueueStats
+{
+    std::uint64_t drops = 0;       ///< Messages discarded by the policy
+    std::uint64_t disconnects = 0; ///< Sessions closed by the policy
+    std::size_t peakDepth = 0;     ///< Largest queue of any session
+};
+
+/// permessage-deflate accounting, over every websocket session
+struct DeflateStats
+{
+    std::size_t memory = 0;        ///< zlib memory reserved
+    std::size_t sessions = 0;      ///< Sessions holding a reservation
+    std::uint64_t refused = 0;     ///< Sessions left uncompressed by the cap
+};
+
 /**
  * Represents the shared server state - information that every object in the
  * system needs to have access to
  */
 class SharedState
 {
+    ServerConfig config_;
+
     /// Also an http server that serves html files, etc
-    std::string documentRoot_;
+    FileCache fileCache_;
+    RunRegistry runs_;
+
+    /// Shared with the broadcast jobs, which may outlive the state
+    std::shared_ptr<Metrics> metrics_;
+
+    using SessionList = std::vector<
+        std::pair<WebSocketSession*, std::weak_ptr<WebSocketSession>>>;
+
+    /**
+     * Subscribers of the topics of a shard, published like the session list
+     * @details Wildcard topics end with '*' and match every topic that starts
+     * with what precedes it. They are meant for a few admin views, so they
+     * are scanned rather than indexed. The lists are shared between
+     * snapshots: a subscription only copies the list of its own topic.
+     */
+    struct Topics
+    {
+        using List = std::shared_ptr<SessionList const>;
+
+        std::unordered_map<std::string, List> exact;
+        std::vector<std::pair<std::string, List>> prefixes;
+
+        /// Call f with each list of subscribers of a published topic
+        template<class F>
+        void forEach(std::string const& topic, F&& f) const
+        {
+            if (auto found = exact.find(topic); found != exact.end()) {
+                f(*found->second);
+            }
+            for (auto const& [prefix, list] : prefixes) {
+                if (topic.compare(0, prefix.size(), prefix) == 0) {
+                    f(*list);
+                }
+            }
+        }
+
+        /// The list of a topic or wildcard, empty if it has no subscriber
+        List& at(std::string_view topic);
+        /// Forget the topics or wildcards left without subscribers
+        void prune();
+    };
 
     /**
-     * This method of tracking sessions only works with an implicit strand
-     * (i.e. a single-threaded server)
+     * A partition of the websocket sessions, all running on the same
+     * executor. A broadcast posts a single job per shard, which then
+     * enqueues the message on each session of the shard directly.
+     *
+     * Each shard is a read-copy-update registry: join and leave publish a new
+     * immutable list (serialised by mutex) while send only takes an atomic
+     * snapshot, so broadcasts never wait on a lock. Sessions are held weakly
+     * because a snapshot may outlive a session that has already left.
      */
-    std::unordered_set<WebSocketSession*> sessions_;
+    struct Shard
+    {
+        ShardExecutor executor;
+        std::shared_ptr<SessionList const> sessions;
+        std::shared_ptr<Topics const> topics;
+        std::mutex mutex;
+        /// Of the jobs posted to the shard, kept alive by each of them
+        std::shared_ptr<HandlerMemory> postMemory =
+            std::make_shared<HandlerMemory>(16);
+
+        explicit Shard(ShardExecutor executor)
+            : executor(std::move(executor))
+        { }
+    };
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    struct Fanout
+    {
+        std::atomic<std::uint64_t> count{0};
+        std::atomic<std::uint64_t> lastNs{0};
+        std::atomic<std::uint64_t> maxNs{0};
+        std::atomic<std::uint64_t> totalNs{0};
+        /// Of the counters of the shards a message is pending on
+        HandlerMemory pending{16};
+
+        void record(std::chrono::steady_clock::duration elapsed);
+    };
+    std::shared_ptr<Fanout> fanout_;
+
+    /// Records the fan-out latency once the last shard is done with a message
+    struct FanoutDone
+    {
+        // Declared first so that it outlives the counter drawn from it
+        std::shared_ptr<Fanout> fanout;
+        std::shared_ptr<Metrics> metrics;
+        std::shared_ptr<std::atomic<std::size_t>> pending;
+        std::chrono::steady_clock::time_point start;
+
+        void operator()() const;
+    };
+    FanoutDone fanoutDone() const;
+
+    /// Tells publications apart, so a session matched twice gets one copy
+    std::atomic<std::uint64_t> publications_{0};
+
+    struct Queues
+    {
+        std::atomic<std::uint64_t> drops{0};
+        std::atomic<std::uint64_t> disconnects{0};
+        std::atomic<std::size_t> peakDepth{0};
+    } queues_;
+
+    struct Deflate
+    {
+        std::atomic<std::size_t> memory{0};
+        std::atomic<std::size_t> sessions{0};
+        std::atomic<std::uint64_t> refused{0};
+    } deflate_;
 
 public:
-    explicit SharedState(std::string documentRoot);
+    explicit SharedState(ServerConfig config);
+
+    ServerConfig const& config() const noexcept
+    { return config_; }
 
     std::string const& documentRoot() const noexcept
-    { return documentRoot_; }
+    { return config_.documentRoot; }
+
+    FileCache& fileCache() noexcept
+    { return fileCache_; }
+
+    RunRegistry& runs() noexcept
+    { return runs_; }
+
+    Metrics& metrics() noexcept
+    { return *metrics_; }
+
+    /// Write the metrics and the aggregated statistics for a scrape
+    void writeMetrics(std::ostream& out) const;
+
+    /**
+     * Register the executor of a new shard and return its index
+     * @note Not thread-safe: every shard must be added before the server runs
+     */
+    std::size_t addShard(ShardExecutor executor);
 
-    void join  (WebSocketSession* session);
+    /**
+     * Forget every shard
+     * @note Must be called once the threads running the shards have returned
+     * and before their io_contexts are destroyed, since the executors may
+     * refer to them
+     */
+    void removeShards();
+
+    std::size_t shardCount() const noexcept
+    { return shards_.size(); }
+
+    /// Sessions of a shard must run on this executor
+    ShardExecutor const& shardExecutor(std::size_t shard) const
+    { return shards_[shard]->executor; }
+
+    // All three are thread-safe
+    void join  (std::shared_ptr<WebSocketSession> const& session);
     void leave (WebSocketSession* session);
     void send  (std::string message); ///< To all websocket client sessions
+    void send  (std::shared_ptr<std::string const> messageSPtr);
+
+    /**
+     * Subscribe a session to a topic, or to the topics starting with a prefix
+     * when it ends with '*' ("*" alone matches every topic)
+     * @note Thread-safe, like the three below
+     */
+    void subscribe(
+        std::shared_ptr<WebSocketSession> const& session,
+        std::string_view topic);
+    void unsubscribe(WebSocketSession* session, std::string_view topic);
+
+    /**
+     * Send a message to the subscribers of a topic only
+     * @param binarySPtr The same message as a residual frame, if it is one,
+     * for the sessions that asked for the binary format
+     */
+    void publish(
+        std::string_view topic,
+        std::shared_ptr<std::string const> messageSPtr,
+        std::shared_ptr<std::string const> binarySPtr = nullptr);
+
+    /// Whether a topic or wildcard may be subscribed to
+    static bool validTopic(std::string_view topic) noexcept;
+    static constexpr std::size_t maxTopicSize = 128;
+
+    /// Number of websocket sessions currently joined
+    std::size_t size() const;
+
+    /// Number of topic subscriptions, over every session
+    std::size_t subscriptions() const;
+
+    /// Broadcast fan-out latency, from send to the last session enqueued
+    FanoutStats fanoutStats() const;
+
+    // Write queue accounting, called by the sessions
+    void countDrops(std::uint64_t drops);
+    void countDisconnect();
+    void countDepth(std::size_t depth);
+
+    QueueStats queueStats() const;
+
+    /**
+     * Reserve the zlib memory of a session's compression contexts
+     * @return false if that would exceed ServerConfig::wsDeflateMemory
+     * @note Thread-safe
+     */
+    bool reserveDeflate(std::size_t bytes);
+
+    /// Return memory obtained from reserveDeflate
+    void releaseDeflate(std::size_t bytes);
+
+    DeflateStats deflateStats() const;
 };
 
 
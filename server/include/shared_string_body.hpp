@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) Nuno Alves de Sousa 2019
+ *
+ * Use, modification and distribution is subject to the Boost Software License,
+ * Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+#ifndef SHAREDSTRINGBODY_H
+#define SHAREDSTRINGBODY_H
+
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <utility>
+
+#include <boost/optional.hpp>
+
+#include "net.hpp"
+#include "beast.hpp"
+
+/**
+ * A response body referring to immutable, reference counted contents
+ * @details Lets many responses (possibly on different threads) serialize the
+ * same cached buffer without copying it. Only the writer half of the Body
+ * concept is provided: it cannot be used to parse requests.
+ */
+struct SharedStringBody
+{
+    using value_type = std::shared_ptr<std::string const>;
+
+    static std::uint64_t size(value_type const& body)
+    {
+        return body ? body->size() : 0;
+    }
+
+    class writer
+    {
+        value_type const& body_;
+
+    public:
+        using const_buffers_type = net::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(http::header<isRequest, Fields> const&, value_type const& body)
+            : body_(body)
+        { }
+
+        void init(error_code& ec)
+        {
+            ec = {};
+        }
+
+        boost::optional<std::pair<const_buffers_type, bool>>
+        get(error_code& ec)
+        {
+            ec = {};
+            if (!body_ || body_->empty()) {
+                return boost::none;
+            }
+            return {{const_buffers_type(body_->data(), body_->size()), false}};
+        }
+    };
+};
+
+#endif //SHAREDSTRINGBODY_H
@@ -8,21 +8,97 @@
 #ifndef WEBSOCKETSESSION_H
 #define WEBSOCKETSESSION_H
 
+#include <chrono>
 #include <cstdlib>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include <boost/circular_buffer.hpp>
+
 #include "net.hpp"
 #include "beast.hpp"
 #include "shared_state.hpp"
+#include "handler_allocator.hpp"
+#include "residual_frame.hpp"
 
 class WebSocketSession: public std::enable_shared_from_this<WebSocketSession>
 {
+    using clock = std::chrono::steady_clock;
+
+    /// The rate limit of one topic
+    struct Throttle
+    {
+        std::string topic;
+        clock::time_point next;     ///< When the topic may be sent again
+        /// The latest publication held back, which replaces the earlier ones
+        std::shared_ptr<std::string const> pending;
+        bool pendingBinary = false;
+    };
+
+    /// A message to write, sent as a binary message or as text
+    struct Outgoing
+    {
+        std::shared_ptr<std::string const> message;
+        bool binary = false;
+    };
+
+    /// Storage of the pending read, write and posted sends
+    HandlerMemory handlerMemory_;
     beast::flat_buffer buffer_;
-    websocket::stream<beast::tcp_stream> websocket_;
+    websocket::stream<ShardStream> websocket_;
     std::shared_ptr<SharedState> state_;
-    std::vector<std::shared_ptr<std::string const>> queue_;
+    std::size_t shard_;
+
+    /// The message being written, if any
+    Outgoing writing_;
+
+    /**
+     * Messages waiting for the current write to complete. The ring only
+     * allocates what it holds, up to the limit on messages, but keeps room
+     * for reservedMessages so that the usual shallow queue never reallocates
+     * as it fills and drains; queuedBytes_ enforces the limit on bytes.
+     */
+    static constexpr std::size_t reservedMessages = 16;
+    boost::circular_buffer_space_optimized<Outgoing> queue_;
+    std::size_t queuedBytes_ = 0;
+    std::size_t maxQueuedMessages_;
+    std::size_t maxQueuedBytes_;
+    SlowConsumerPolicy policy_;
+    std::uint64_t drops_ = 0;
+    std::size_t peakDepth_ = 0;
+    bool closing_ = false;
+
+    /// The run this session publishes, 0 until its first message
+    std::uint64_t runId_ = 0;
+    /// Where its messages are logged, if anywhere
+    std::shared_ptr<RunLog> log_;
+
+    /// Topics and wildcards subscribed to, at most ServerConfig::wsTopics
+    std::vector<std::string> topics_;
+    /// The last publication delivered, which wildcards may match again
+    std::uint64_t publication_ = 0;
+    /// Receive residual frames as binary messages rather than JSON text
+    bool binary_ = false;
+    /// The last frame published, which delta encoded frames refer to
+    residual::Frame frame_;
+
+    /// Shortest time between two publications of a topic, zero for no limit
+    clock::duration interval_{};
+    /// Least rate limit, in publications per second: one a day
+    static constexpr double minRate = 1.0 / 86400;
+    /// Iterations in the history snapshots, 0 for all of them
+    std::size_t points_ = 0;
+    /// Topics published to recently, while rate limited
+    std::vector<Throttle> throttles_;
+    /// Sends the publications held back when their topic is due
+    net::steady_timer::rebind_executor<ShardExecutor>::other timer_;
+    bool timerArmed_ = false;
+
+    /// zlib memory reserved in the SharedState budget, if compressing
+    std::size_t deflateMemory_ = 0;
 
     void fail(error_code ec, char const* what);
     void onAccept(error_code ec);
@@ -30,13 +106,53 @@ class WebSocketSession: public std::enable_shared_from_this<WebSocketSession>
     void onRead(error_code ec, std::size_t bytesTransferred);
     void doWrite();
     void onWrite(error_code ec, std::size_t bytesTransferred);
+    /// The connection is gone: drop the queue and the held publications,
+    /// and take no more, so only the pending operations keep the session
+    void stop();
 
-    void onSend(std::shared_ptr<std::string const> const& messageSPtr);
+    /// Write a message, or queue it behind the current write
+    void onSend(
+        std::shared_ptr<std::string const> const& messageSPtr,
+        bool binary = false);
+    /// Handle {"subscribe":"topic"}, {"unsubscribe":"topic"},
+    /// {"format":"json|binary"}, {"rate":"hz"} and {"points":"N"}
+    bool control(std::string_view message);
+    /// Send the history of the run of a topic runs/<id>, if it has one
+    void sendSnapshot(std::string_view topic);
+    /// Publish the residual frames of a message, false if it has none
+    bool publishFrames(std::string_view message);
+    /// Publish a residual frame, and its JSON for the legacy clients
+    void publishFrame(std::string_view message);
+    /// Publish a message of the run of this session, and record it with the
+    /// frame it came from, if any
+    void publish(
+        std::shared_ptr<std::string const> messageSPtr,
+        std::shared_ptr<std::string const> binarySPtr = nullptr,
+        residual::Frame const* frame = nullptr);
+    /// Apply the policy if the queue is full, false if the session must close
+    bool makeRoom(std::size_t bytes);
+
+    /// Send a publication now, or keep it as the latest of its topic until
+    /// the rate limit allows it
+    void throttle(
+        std::string_view topic,
+        std::shared_ptr<std::string const> const& message,
+        bool binary);
+    /// Wake up at a deadline, unless already due earlier
+    void schedule(clock::time_point deadline);
+    void onTimer(error_code ec);
+    /// Send the publications that are due and forget the idle topics
+    void flushThrottles(bool all);
+
+    /// Enable permessage-deflate if the client offers it and the budget allows
+    void negotiateDeflate(beast::string_view extensions);
 
 public:
+    /// @param shard The SharedState shard whose executor the socket uses
     WebSocketSession(
-        tcp::socket&& socket,
-        std::shared_ptr<SharedState> const& state);
+        ShardSocket&& socket,
+        std::shared_ptr<SharedState> const& state,
+        std::size_t shard);
 
     ~WebSocketSession();
 
@@ -44,8 +160,32 @@ public:
     void
     run(http::request<Body, http::basic_fields<Allocator>> request);
 
+    std::size_t shard() const noexcept { return shard_; }
+
+    /// Change what happens when the write queue is full
+    void policy(SlowConsumerPolicy policy) noexcept { policy_ = policy; }
+
+    /// Messages discarded because the write queue was full
+    std::uint64_t drops() const noexcept { return drops_; }
+
+    /// Largest number of messages ever queued
+    std::size_t peakDepth() const noexcept { return peakDepth_; }
+
     // Send a message (to all sessions>
     void send(std::shared_ptr<std::string const> const& messageSPtr);
+
+    /// Enqueue a message. Must be called on the executor of the session.
+    void deliver(std::shared_ptr<std::string const> const& messageSPtr);
+    /// Enqueue a publication of a topic in the format of this session,
+    /// unless it already got it, within the rate limit of the session
+    void deliver(
+        std::string_view topic,
+        std::shared_ptr<std::string const> const& messageSPtr,
+        std::shared_ptr<std::string const> const& binarySPtr,
+        std::uint64_t publication);
+
+    /// What the session subscribed to. Must be called on its executor.
+    std::vector<std::string> const& topics() const noexcept { return topics_; }
 };
 
 template<class Body, class Allocator>
@@ -65,13 +205,15 @@ void WebSocketSession::run(
                 std::string(BOOST_BEAST_VERSION_STRING) + " adaptive-server");
         }));
 
+    negotiateDeflate(request[http::field::sec_websocket_extensions]);
+
     // Accept the WebSocket handshake
     websocket_.async_accept(
         request,
-        [self = shared_from_this()](error_code const& ec)
+        recycle(handlerMemory_, [self = shared_from_this()](error_code const& ec)
         {
             self->onAccept(ec);
-        });
+        }));
 }
 
 #endif //WEBSOCKETSESSION
@@ -0,0 +1,111 @@
+#include <cstdint>
+#include <cstdlib>
+
+#include <boost/crc.hpp>
+
+#include "net.hpp"
+#include "compression.hpp"
+
+beast::string_view encodingName(ContentEncoding encoding)
+{
+    switch (encoding) {
+    case ContentEncoding::brotli: return "br";
+    case ContentEncoding::gzip:   return "gzip";
+    }
+    return {};
+}
+
+beast::string_view encodingExtension(ContentEncoding encoding)
+{
+    switch (encoding) {
+    case ContentEncoding::brotli: return ".br";
+    case ContentEncoding::gzip:   return ".gz";
+    }
+    return {};
+}
+
+bool acceptsEncoding(beast::string_view acceptEncoding, ContentEncoding encoding)
+{
+    auto const trim = [](beast::string_view s)
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+            s.remove_suffix(1);
+        }
+        return s;
+    };
+
+    // An exact match takes precedence over "*", wherever either appears
+    auto const name = encodingName(encoding);
+    double exact = -1;
+    double wildcard = -1;
+    while (!acceptEncoding.empty()) {
+        auto const end = acceptEncoding.find(',');
+        auto item = acceptEncoding.substr(0, end);
+        acceptEncoding = end == beast::string_view::npos
+            ? beast::string_view{} : acceptEncoding.substr(end + 1);
+
+        // Split coding and parameters (only q is defined)
+        auto const semicolon = item.find(';');
+        auto const coding = trim(item.substr(0, semicolon));
+        auto const isName = beast::iequals(coding, name);
+        if (!isName && coding != "*") {
+            continue;
+        }
+        double q = 1;
+        if (semicolon != beast::string_view::npos) {
+            auto const parameter = trim(item.substr(semicolon + 1));
+            if (parameter.size() >= 2 &&
+                beast::iequals(parameter.substr(0, 2), "q=")) {
+                auto const value = parameter.substr(2).to_string();
+                q = std::strtod(value.c_str(), nullptr);
+            }
+        }
+        (isName ? exact : wildcard) = q;
+    }
+    return (exact >= 0 ? exact : wildcard) > 0;
+}
+
+std::string gzip(beast::string_view data, int level)
+{
+    namespace zlib = beast::zlib;
+
+    zlib::deflate_stream deflate;
+    deflate.reset(level, 15, 8, zlib::Strategy::normal);
+
+    // Header: magic, deflate, no flags, no mtime, no extra flags, Unix
+    std::string result = {'\x1f', '\x8b', '\x08', 0, 0, 0, 0, 0, 0, '\x03'};
+    auto const header = result.size();
+    result.resize(header + deflate.upper_bound(data.size()));
+
+    zlib::z_params zs;
+    zs.next_in = data.data();
+    zs.avail_in = data.size();
+    zs.next_out = &result[header];
+    zs.avail_out = result.size() - header;
+
+    // A complete stream ends with end_of_stream; anything else, even no
+    // error at all, means the output was cut short
+    error_code ec;
+    deflate.write(zs, zlib::Flush::finish, ec);
+    if (ec != zlib::error::end_of_stream) {
+        return {};
+    }
+    result.resize(header + zs.total_out);
+
+    // Trailer: CRC-32 and size of the input, little endian
+    boost::crc_32_type crc;
+    crc.process_bytes(data.data(), data.size());
+    auto const append32 = [&result](std::uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i) {
+            result.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+    };
+    append32(crc.checksum());
+    append32(static_cast<std::uint32_t>(data.size()));
+
+    return result;
+}
@@ -0,0 +1,289 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <algorithm>
+
+#include "config.hpp"
+
+namespace
+{
+
+// Parse an integer no smaller than minimum, scaled by a unit
+bool parseCount(
+    std::string const& value,
+    std::size_t& result,
+    long minimum = 1,
+    std::size_t unit = 1)
+{
+    char* end = nullptr;
+    auto const count = std::strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || count < minimum) {
+        return false;
+    }
+    result = static_cast<std::size_t>(count) * unit;
+    return true;
+}
+
+// Parse on/off
+bool parseSwitch(std::string const& value, bool& result)
+{
+    if (value == "on" || value.empty()) {
+        result = true;
+    } else if (value == "off") {
+        result = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parse an integer in [minimum, maximum]
+bool parseRange(std::string const& value, int& result, int minimum, int maximum)
+{
+    char* end = nullptr;
+    auto const number = std::strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || number < minimum || number > maximum) {
+        return false;
+    }
+    result = static_cast<int>(number);
+    return true;
+}
+
+bool parseLevel(std::string const& value, LogLevel& result)
+{
+    if (value == "debug") {
+        result = LogLevel::debug;
+    } else if (value == "info") {
+        result = LogLevel::info;
+    } else if (value == "warning") {
+        result = LogLevel::warning;
+    } else if (value == "error") {
+        result = LogLevel::error;
+    } else if (value == "off") {
+        result = LogLevel::off;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parsePolicy(std::string const& value, SlowConsumerPolicy& result)
+{
+    if (value == "drop-oldest") {
+        result = SlowConsumerPolicy::dropOldest;
+    } else if (value == "keep-latest") {
+        result = SlowConsumerPolicy::keepLatest;
+    } else if (value == "disconnect") {
+        result = SlowConsumerPolicy::disconnect;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parse a comma separated list of CPU indices (e.g. 0,2,4)
+bool parseCpuList(std::string const& value, std::vector<int>& cpus)
+{
+    std::size_t begin = 0;
+    while (begin <= value.size()) {
+        auto end = value.find(',', begin);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+        auto const item = value.substr(begin, end - begin);
+        char* last = nullptr;
+        auto const cpu = std::strtol(item.c_str(), &last, 10);
+        if (item.empty() || *last != '\0' || cpu < 0) {
+            return false;
+        }
+        cpus.push_back(static_cast<int>(cpu));
+        begin = end + 1;
+    }
+    return true;
+}
+
+} // namespace
+
+void usage(std::ostream& out)
+{
+    out <<
+        "  Usage: server <address> <port> <documentRoot> [threads] [options]\n"
+        "Options:\n"
+        "  --reuseport           one listener, io_context and thread per shard\n"
+        "                        (threads is the number of shards, defaults to\n"
+        "                        the number of cores)\n"
+        "  --affinity[=cpus]     pin thread i to cpus[i % n] (e.g. 0,2,4);\n"
+        "                        defaults to one core per thread\n"
+        "  --cache=MiB           static file cache budget (default 64, 0 disables)\n"
+        "  --cache-entry=KiB     largest file kept in the cache (default 1024)\n"
+        "  --cache-revalidate=ms interval between modification checks\n"
+        "                        of a cached file (default 1000)\n"
+        "  --compress=on|off     gzip text files that have no precompressed\n"
+        "                        .gz/.br sibling (default on)\n"
+        "  --sendfile=on|off     zero-copy transfer of uncached files\n"
+        "                        (Linux only, default on)\n"
+        "  --http-pipeline=N     pipelined requests answered ahead per HTTP\n"
+        "                        connection (default 8)\n"
+        "  --ws-queue=N          max messages queued per websocket (default 1024)\n"
+        "  --ws-queue-bytes=KiB  max bytes queued per websocket (default 16384)\n"
+        "  --slow-consumer=drop-oldest|keep-latest|disconnect\n"
+        "                        what to do when a websocket queue is full\n"
+        "  --ws-deflate=on|off   permessage-deflate for the websocket clients\n"
+        "                        that offer it (default on)\n"
+        "  --ws-deflate-level=N  zlib compression level, 0-9 (default 6)\n"
+        "  --ws-deflate-window=N server LZ77 window bits, 9-15 (default 12)\n"
+        "  --ws-deflate-mem=N    zlib memory level, 1-9 (default 4)\n"
+        "  --ws-deflate-takeover=on|off\n"
+        "                        keep the compression context between\n"
+        "                        messages (default on)\n"
+        "  --ws-deflate-memory=MiB\n"
+        "                        zlib memory of all websockets together; the\n"
+        "                        sessions over it are not compressed (default 256)\n"
+        "  --ws-topics=N         topics a websocket may subscribe to (default 64)\n"
+        "  --runs=N              solver runs remembered by the REST API\n"
+        "                        (default 1024)\n"
+        "  --history=N           iterations of residuals kept per run (default\n"
+        "                        4096, 0 disables it)\n"
+        "  --history-memory=MiB  memory of the histories of every run (default 64)\n"
+        "  --run-log=dir         log every message of the runs in this directory\n"
+        "                        (default: no log)\n"
+        "  --run-log-segment=MiB size of the run log files (default 64)\n"
+        "  --uploads=dir         store the meshes and case files uploaded with\n"
+        "                        PUT or POST in this directory (default: off)\n"
+        "  --mesh-limit=MiB      largest mesh upload (default 4096)\n"
+        "  --case-limit=MiB      largest case file upload (default 64)\n"
+        "  --metrics=path|off    where the Prometheus metrics are served\n"
+        "                        (default /metrics)\n"
+        "  --log=debug|info|warning|error|off\n"
+        "                        lowest level logged (default info)\n"
+        "  --log-sample=N        log one in N requests and broadcasts (default 1)\n"
+        "Example:\n"
+        "         server 127.0.0.1 8080 . 4 --reuseport --affinity\n";
+}
+
+bool parseArguments(int argc, char** argv, ServerConfig& config, std::ostream& err)
+{
+    if (argc < 4) {
+        usage(err);
+        return false;
+    }
+
+    error_code ec;
+    config.address = net::ip::make_address(argv[1], ec);
+    if (ec) {
+        err << "error: invalid address '" << argv[1] << "'\n";
+        return false;
+    }
+    config.port = static_cast<unsigned short>(std::atoi(argv[2]));
+    config.documentRoot = argv[3];
+
+    bool hasThreads = false;
+    bool pinThreads = false;
+    for (int i = 4; i < argc; ++i) {
+        std::string const argument = argv[i];
+
+        // Positional thread count
+        if (argument.compare(0, 2, "--") != 0) {
+            if (hasThreads || !parseCount(argument, config.threads)) {
+                err << "error: invalid argument '" << argument << "'\n";
+                return false;
+            }
+            hasThreads = true;
+            continue;
+        }
+
+        // Options are either --name or --name=value
+        auto const equal = argument.find('=');
+        auto const name = argument.substr(2, equal - 2);
+        auto const value =
+            equal == std::string::npos ? std::string{} : argument.substr(equal + 1);
+
+        bool valid = true;
+        if (name == "reuseport") {
+            config.reusePort = true;
+        } else if (name == "affinity") {
+            pinThreads = true;
+            valid = value.empty() || parseCpuList(value, config.affinity);
+        } else if (name == "cache") {
+            valid = parseCount(value, config.cacheSize, 0, 1024 * 1024);
+        } else if (name == "cache-entry") {
+            valid = parseCount(value, config.cacheEntrySize, 1, 1024);
+        } else if (name == "cache-revalidate") {
+            std::size_t milliseconds = 0;
+            valid = parseCount(value, milliseconds, 0);
+            config.cacheRevalidate = std::chrono::milliseconds(milliseconds);
+        } else if (name == "compress") {
+            valid = parseSwitch(value, config.compress);
+        } else if (name == "sendfile") {
+            valid = parseSwitch(value, config.sendfile);
+        } else if (name == "http-pipeline") {
+            valid = parseCount(value, config.httpPipeline);
+        } else if (name == "ws-queue") {
+            valid = parseCount(value, config.wsQueueMessages);
+        } else if (name == "ws-queue-bytes") {
+            valid = parseCount(value, config.wsQueueBytes, 1, 1024);
+        } else if (name == "slow-consumer") {
+            valid = parsePolicy(value, config.slowConsumer);
+        } else if (name == "ws-deflate") {
+            valid = parseSwitch(value, config.wsDeflate);
+        } else if (name == "ws-deflate-level") {
+            valid = parseRange(value, config.wsDeflateLevel, 0, 9);
+        } else if (name == "ws-deflate-window") {
+            valid = parseRange(value, config.wsDeflateWindowBits, 9, 15);
+        } else if (name == "ws-deflate-mem") {
+            valid = parseRange(value, config.wsDeflateMemLevel, 1, 9);
+        } else if (name == "ws-deflate-takeover") {
+            valid = parseSwitch(value, config.wsDeflateTakeover);
+        } else if (name == "ws-deflate-memory") {
+            valid = parseCount(value, config.wsDeflateMemory, 0, 1024 * 1024);
+        } else if (name == "ws-topics") {
+            valid = parseCount(value, config.wsTopics);
+        } else if (name == "runs") {
+            valid = parseCount(value, config.runLimit);
+        } else if (name == "history") {
+            valid = parseCount(value, config.historyLength, 0);
+        } else if (name == "history-memory") {
+            valid = parseCount(value, config.historyMemory, 1, 1024 * 1024);
+        } else if (name == "run-log") {
+            valid = !value.empty();
+            config.runLogDirectory = value;
+        } else if (name == "run-log-segment") {
+            valid = parseCount(value, config.runLogSegment, 1, 1024 * 1024);
+        } else if (name == "uploads") {
+            valid = !value.empty();
+            config.uploadDirectory = value;
+        } else if (name == "mesh-limit") {
+            valid = parseCount(value, config.meshUploadLimit, 1, 1024 * 1024);
+        } else if (name == "case-limit") {
+            valid = parseCount(value, config.caseUploadLimit, 1, 1024 * 1024);
+        } else if (name == "log") {
+            valid = parseLevel(value, config.logLevel);
+        } else if (name == "log-sample") {
+            valid = parseCount(value, config.logSample);
+        } else if (name == "metrics") {
+            valid = value == "off" || (!value.empty() && value[0] == '/');
+            config.metricsPath = value == "off" ? std::string{} : value;
+        } else {
+            err << "error: unknown option '" << argument << "'\n";
+            return false;
+        }
+
+        if (!valid) {
+            err << "error: invalid value for option '" << argument << "'\n";
+            return false;
+        }
+    }
+
+    auto const cores = std::max(1u, std::thread::hardware_concurrency());
+    if (config.reusePort && !hasThreads) {
+        config.threads = cores;
+    }
+    if (pinThreads && config.affinity.empty()) {
+        for (unsigned cpu = 0; cpu < cores; ++cpu) {
+            config.affinity.push_back(static_cast<int>(cpu));
+        }
+    }
+
+    return true;
+}
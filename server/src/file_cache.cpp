@@ -0,0 +1,284 @@
+#include <filesystem>
+#include <system_error>
+#include <utility>
+
+#include "file_cache.hpp"
+#include "mime_type.hpp"
+
+namespace
+{
+
+// FNV-1a, good enough to tell versions of the same file apart
+std::uint64_t hash(std::string const& content)
+{
+    std::uint64_t result = 14695981039346656037ull;
+    for (unsigned char c : content) {
+        result ^= c;
+        result *= 1099511628211ull;
+    }
+    return result;
+}
+
+std::string toHex(std::uint64_t value)
+{
+    static char constexpr digits[] = "0123456789abcdef";
+    std::string result;
+    do {
+        result.insert(result.begin(), digits[value & 0xf]);
+        value >>= 4;
+    } while (value != 0);
+    return result;
+}
+
+// Fixed cost of an entry besides its contents and path
+std::size_t constexpr overhead = 512;
+
+} // namespace
+
+FileCache::FileCache(
+    std::size_t capacity,
+    std::size_t maxEntrySize,
+    clock::duration revalidateAfter,
+    bool compress)
+    : capacity_(capacity)
+    , maxEntrySize_(maxEntrySize)
+    , revalidateAfter_(revalidateAfter)
+    , compress_(compress)
+{ }
+
+std::shared_ptr<FileCache::Entry const>
+FileCache::get(std::string const& path, error_code& ec)
+{
+    ec = {};
+    auto const now = clock::now();
+
+    // Fresh hit
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const found = index_.find(path);
+        if (found != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, found->second);
+            if (now - found->second->validated < revalidateAfter_) {
+                return found->second->entry;
+            }
+        }
+    }
+
+    // Stale or missing: check the file outside the lock
+    std::error_code stdEc;
+    auto const size = std::filesystem::file_size(path, stdEc);
+    std::int64_t modified = 0;
+    if (!stdEc) {
+        modified = static_cast<std::int64_t>(std::filesystem::last_write_time(
+            path, stdEc).time_since_epoch().count());
+    }
+    if (stdEc) {
+        ec = error_code(stdEc.value(), boost::system::system_category());
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const found = index_.find(path);
+        if (found != index_.end()) {
+            erase(found->second);
+        }
+        return nullptr;
+    }
+
+    // Unchanged since the last validation
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const found = index_.find(path);
+        if (found != index_.end()) {
+            auto const& entry = found->second->entry;
+            if (entry->size == size && entry->modified == modified) {
+                found->second->validated = now;
+                return entry;
+            }
+        }
+    }
+
+    auto entry = load(path, size, modified, ec);
+    if (ec) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert(path, entry, now);
+    return entry;
+}
+
+std::shared_ptr<FileCache::Representation const> FileCache::encoded(
+    std::string const& path,
+    std::shared_ptr<Entry const> const& entry,
+    ContentEncoding encoding)
+{
+    // Files that are not cached look for a precompressed sibling every time
+    if (!entry->content) {
+        return makeEncoded(path, *entry, encoding);
+    }
+
+    auto const index = static_cast<std::size_t>(encoding);
+    std::call_once(entry->encodedOnce[index], [&]
+    {
+        auto representation = makeEncoded(path, *entry, encoding);
+        entry->encoded[index] = representation;
+        // A sibling's contents are charged to the sibling's own entry
+        if (!representation || !representation->content ||
+            representation->path != path) {
+            return;
+        }
+
+        // Charge the variant to the entry, if it is still cached
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const found = index_.find(path);
+        if (found != index_.end() && found->second->entry == entry) {
+            auto const cost = representation->content->size();
+            found->second->cost += cost;
+            size_ += cost;
+            while (size_ > capacity_) {
+                erase(std::prev(lru_.end()));
+            }
+        }
+    });
+    return entry->encoded[index];
+}
+
+std::shared_ptr<FileCache::Representation const> FileCache::makeEncoded(
+    std::string const& path,
+    Entry const& entry,
+    ContentEncoding encoding)
+{
+    auto representation = std::make_shared<Representation>();
+    auto& header = representation->header;
+    header = entry.header;
+    header.set(http::field::content_encoding, encodingName(encoding));
+
+    // A precompressed sibling, unless it is older than the file itself
+    error_code ec;
+    auto const siblingPath = path + encodingExtension(encoding).to_string();
+    auto const sibling = get(siblingPath, ec);
+    if (!ec && sibling->modified >= entry.modified) {
+        representation->content = sibling->content;
+        representation->path = siblingPath;
+        representation->etag = sibling->etag;
+        header.set(http::field::etag, sibling->etag);
+        header.set(http::field::content_length, std::to_string(sibling->size));
+        return representation;
+    }
+
+    // Otherwise gzip the cached contents of compressible files
+    auto const mime = entry.header[http::field::content_type];
+    if (!compress_ ||
+        encoding != ContentEncoding::gzip ||
+        !entry.content ||
+        entry.content->size() < minCompressSize ||
+        !isCompressible(mime) ||
+        beast::string_view(path).ends_with(".svgz")) {
+        return nullptr;
+    }
+
+    auto compressed = gzip(*entry.content);
+    if (compressed.empty() || compressed.size() >= entry.content->size()) {
+        return nullptr;
+    }
+
+    // Strong validators must differ between representations
+    representation->etag = entry.etag;
+    representation->etag.insert(representation->etag.size() - 1, "-gzip");
+    representation->path = path;
+    header.set(http::field::etag, representation->etag);
+    header.set(http::field::content_length, std::to_string(compressed.size()));
+    representation->content =
+        std::make_shared<std::string const>(std::move(compressed));
+
+    return representation;
+}
+
+std::size_t FileCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
+
+std::shared_ptr<FileCache::Entry const> FileCache::load(
+    std::string const& path,
+    std::uint64_t size,
+    std::int64_t modified,
+    error_code& ec) const
+{
+    auto entry = std::make_shared<Entry>();
+    entry->size = size;
+    entry->modified = modified;
+
+    if (capacity_ > 0 && size <= maxEntrySize_) {
+        // Small enough: read the whole file, the ETag is a content hash
+        beast::file file;
+        file.open(path.c_str(), beast::file_mode::scan, ec);
+        if (ec) {
+            return nullptr;
+        }
+        std::string content(file.size(ec), '\0');
+        std::size_t read = 0;
+        while (!ec && read < content.size()) {
+            auto const n = file.read(&content[read], content.size() - read, ec);
+            if (n == 0) {
+                break;
+            }
+            read += n;
+        }
+        if (ec) {
+            return nullptr;
+        }
+        content.resize(read);
+
+        entry->size = content.size();
+        entry->etag = '"' + toHex(entry->size) + '-' + toHex(hash(content)) + '"';
+        entry->content = std::make_shared<std::string const>(std::move(content));
+    } else {
+        // Too large: the ETag is derived from the size and modification time
+        entry->etag = '"' + toHex(size) + '-' +
+            toHex(static_cast<std::uint64_t>(modified)) + '"';
+    }
+
+    auto& header = entry->header;
+    header.result(http::status::ok);
+    header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    header.set(http::field::content_type, mimeType(path));
+    header.set(http::field::etag, entry->etag);
+    header.set(http::field::content_length, std::to_string(entry->size));
+    header.set(http::field::vary, "Accept-Encoding");
+    header.set(http::field::accept_ranges, "bytes");
+
+    return entry;
+}
+
+void FileCache::insert(
+    std::string const& path,
+    std::shared_ptr<Entry const> entry,
+    clock::time_point now)
+{
+    auto const found = index_.find(path);
+    if (found != index_.end()) {
+        erase(found->second);
+    }
+
+    auto const cost = overhead + path.size() +
+        (entry->content ? entry->content->size() : 0);
+    if (cost > capacity_) {
+        return;
+    }
+
+    lru_.push_front(Node{path, std::move(entry), now, cost});
+    index_.emplace(path, lru_.begin());
+    size_ += cost;
+
+    // Evict the least recently used entries
+    while (size_ > capacity_) {
+        erase(std::prev(lru_.end()));
+    }
+}
+
+void FileCache::erase(Lru::iterator node)
+{
+    size_ -= node->cost;
+    index_.erase(node->path);
+    lru_.erase(node);
+}
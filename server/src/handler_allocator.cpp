@@ -0,0 +1,57 @@
+#include <new>
+
+#include "handler_allocator.hpp"
+
+HandlerMemory::HandlerMemory(std::size_t slots)
+    : slots_(std::make_unique<Slot[]>(slots))
+    , count_(slots)
+{ }
+
+HandlerMemory::~HandlerMemory()
+{
+    for (std::size_t i = 0; i < count_; ++i) {
+        ::operator delete(slots_[i].block.load(std::memory_order_relaxed));
+    }
+}
+
+void* HandlerMemory::allocate(std::size_t size)
+{
+    // Prefer a free block that is already large enough
+    for (std::size_t i = 0; i < count_; ++i) {
+        auto& slot = slots_[i];
+        if (!slot.inUse.load(std::memory_order_relaxed) &&
+            !slot.inUse.exchange(true, std::memory_order_acquire)) {
+            if (slot.size >= size) {
+                return slot.block.load(std::memory_order_relaxed);
+            }
+            slot.inUse.store(false, std::memory_order_release);
+        }
+    }
+
+    // Otherwise grow the first free one
+    for (std::size_t i = 0; i < count_; ++i) {
+        auto& slot = slots_[i];
+        if (!slot.inUse.exchange(true, std::memory_order_acquire)) {
+            ::operator delete(slot.block.load(std::memory_order_relaxed));
+            slot.block.store(nullptr, std::memory_order_relaxed);
+            auto const block = ::operator new(size);
+            slot.block.store(block, std::memory_order_relaxed);
+            slot.size = size;
+            return block;
+        }
+    }
+
+    return ::operator new(size);
+}
+
+void HandlerMemory::deallocate(void* pointer) noexcept
+{
+    for (std::size_t i = 0; i < count_; ++i) {
+        auto& slot = slots_[i];
+        if (slot.block.load(std::memory_order_relaxed) == pointer) {
+            slot.inUse.store(false, std::memory_order_release);
+            return;
+        }
+    }
+    ::operator delete(pointer);
+}
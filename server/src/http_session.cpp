@@ -1,51 +1,38 @@
-#include <iostream>
+#include <sstream>
+#include <atomic>
 #include <chrono>
 #include <string>
 #include <memory>
 #include <utility>
+#include <tuple>
+#include <algorithm>
+#include <type_traits>
 #include <cstddef>
+#include <cerrno>
+#include <charconv>
+#include <filesystem>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <random>
+#include <new>
+#include <vector>
+
+#include <boost/core/ignore_unused.hpp>
 
 #include "http_session.hpp"
 #include "websocket_session.hpp"
+#include "shared_string_body.hpp"
+#include "range_body.hpp"
+#include "compression.hpp"
+#include "logger.hpp"
+#include "router.hpp"
 
-// HTTP helpers ----------------------------------------------------------------
+#if ADAPTIV_HAS_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
-// Return a reasonable mim type based on the extension of a file
-beast::string_view mimeType(beast::string_view path)
-{
-    using boost::beast::iequals;
-    auto const extension = [&path]
-    {
-        auto const pos = path.rfind(".");
-        if (pos == beast::string_view::npos) {
-            return beast::string_view{};
-        }
-        return path.substr(pos);
-    }();
-
-    if(iequals(extension, ".htm"))  return "text/html";
-    if(iequals(extension, ".html")) return "text/html";
-    if(iequals(extension, ".php"))  return "text/html";
-    if(iequals(extension, ".css"))  return "text/css";
-    if(iequals(extension, ".txt"))  return "text/plain";
-    if(iequals(extension, ".js"))   return "application/javascript";
-    if(iequals(extension, ".json")) return "application/json";
-    if(iequals(extension, ".xml"))  return "application/xml";
-    if(iequals(extension, ".swf"))  return "application/x-shockwave-flash";
-    if(iequals(extension, ".flv"))  return "video/x-flv";
-    if(iequals(extension, ".png"))  return "image/png";
-    if(iequals(extension, ".jpe"))  return "image/jpeg";
-    if(iequals(extension, ".jpeg")) return "image/jpeg";
-    if(iequals(extension, ".jpg"))  return "image/jpeg";
-    if(iequals(extension, ".gif"))  return "image/gif";
-    if(iequals(extension, ".bmp"))  return "image/bmp";
-    if(iequals(extension, ".ico"))  return "image/vnd.microsoft.icon";
-    if(iequals(extension, ".tiff")) return "image/tiff";
-    if(iequals(extension, ".tif"))  return "image/tiff";
-    if(iequals(extension, ".svg"))  return "image/svg+xml";
-    if(iequals(extension, ".svgz")) return "image/svg+xml";
-    return "application/text";
-}
+// HTTP helpers ----------------------------------------------------------------
 
 // Append an HTTP rel-path to a local filesystem path.
 std::string pathConcatenate(beast::string_view base, beast::string_view path)
@@ -53,7 +40,10 @@ std::string pathConcatenate(beast::string_view base, beast::string_view path)
     if (base.empty()) {
         return path.to_string();
     }
-    std::string result = base.to_string();
+    // Room for the index.html appended to directories
+    std::string result;
+    result.reserve(base.size() + path.size() + 10);
+    result.append(base.data(), base.size());
 
     // Platform separator
 #if BOOST_MSVC
@@ -78,6 +68,227 @@ std::string pathConcatenate(beast::string_view base, beast::string_view path)
     return result;
 }
 
+// Whether an If-None-Match list (e.g. "a", W/"b") matches an entity tag.
+// Uses the weak comparison function, as required for If-None-Match.
+bool etagMatches(beast::string_view ifNoneMatch, beast::string_view etag)
+{
+    auto const isSpace = [](char c){ return c == ' ' || c == '\t' || c == ','; };
+    while (!ifNoneMatch.empty()) {
+        // Skip separators
+        if (isSpace(ifNoneMatch.front())) {
+            ifNoneMatch.remove_prefix(1);
+            continue;
+        }
+        if (ifNoneMatch.front() == '*') {
+            return true;
+        }
+        if (ifNoneMatch.starts_with("W/")) {
+            ifNoneMatch.remove_prefix(2);
+        }
+
+        auto const end = ifNoneMatch.find(',');
+        auto tag = ifNoneMatch.substr(0, end);
+        while (!tag.empty() && isSpace(tag.back())) {
+            tag.remove_suffix(1);
+        }
+        if (tag == etag) {
+            return true;
+        }
+        if (end == beast::string_view::npos) {
+            break;
+        }
+        ifNoneMatch.remove_prefix(end + 1);
+    }
+    return false;
+}
+
+// A byte range of a representation, last byte included
+struct ByteRange
+{
+    std::uint64_t first;
+    std::uint64_t last;
+};
+
+// More ranges than that are answered with the whole representation
+std::size_t constexpr maxRanges = 64;
+
+/**
+ * Parse a Range header (e.g. bytes=0-99,200-,-50) against a representation of
+ * size bytes
+ * @return Nothing if the header must be ignored (absent, malformed, another
+ * unit or too many ranges); otherwise the satisfiable ranges, sorted and
+ * with the overlapping or adjacent ones merged, none if no range is
+ */
+std::optional<std::vector<ByteRange>>
+parseRange(beast::string_view range, std::uint64_t size)
+{
+    auto const isSpace = [](char c){ return c == ' ' || c == '\t'; };
+    auto const trim = [&isSpace](beast::string_view text)
+    {
+        while (!text.empty() && isSpace(text.front())) {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && isSpace(text.back())) {
+            text.remove_suffix(1);
+        }
+        return text;
+    };
+    auto const number = [](beast::string_view text, std::uint64_t& value)
+    {
+        auto const [end, ec] =
+            std::from_chars(text.data(), text.data() + text.size(), value);
+        return !text.empty() && ec == std::errc{} &&
+               end == text.data() + text.size();
+    };
+
+    constexpr beast::string_view unit = "bytes=";
+    range = trim(range);
+    if (range.size() < unit.size() ||
+        !beast::iequals(range.substr(0, unit.size()), unit)) {
+        return std::nullopt;
+    }
+    range.remove_prefix(unit.size());
+
+    std::vector<ByteRange> ranges;
+    std::size_t specs = 0;
+    while (!range.empty()) {
+        auto const end = std::min(range.find(','), range.size());
+        auto const spec = trim(range.substr(0, end));
+        range = range.substr(std::min(end + 1, range.size()));
+        if (spec.empty()) {
+            continue;
+        }
+        if (++specs > maxRanges) {
+            return std::nullopt;
+        }
+
+        auto const dash = spec.find('-');
+        if (dash == beast::string_view::npos) {
+            return std::nullopt;
+        }
+        auto const from = trim(spec.substr(0, dash));
+        auto const to = trim(spec.substr(dash + 1));
+        std::uint64_t first = 0;
+        std::uint64_t last = 0;
+        if (from.empty()) {
+            // The last bytes
+            if (!number(to, last)) {
+                return std::nullopt;
+            }
+            if (last > 0 && size > 0) {
+                ranges.push_back({size - std::min(last, size), size - 1});
+            }
+            continue;
+        }
+        if (!number(from, first) ||
+            (!to.empty() && (!number(to, last) || last < first))) {
+            return std::nullopt;
+        }
+        if (first < size) {
+            ranges.push_back({first, to.empty() ? size - 1 : std::min(last, size - 1)});
+        }
+    }
+    if (specs == 0) {
+        return std::nullopt;
+    }
+
+    std::sort(ranges.begin(), ranges.end(),
+        [](ByteRange const& a, ByteRange const& b){ return a.first < b.first; });
+    std::size_t kept = 0;
+    for (std::size_t i = 1; i < ranges.size(); ++i) {
+        if (ranges[i].first <= ranges[kept].last + 1) {
+            ranges[kept].last = std::max(ranges[kept].last, ranges[i].last);
+        } else {
+            ranges[++kept] = ranges[i];
+        }
+    }
+    ranges.resize(ranges.empty() ? 0 : kept + 1);
+    return ranges;
+}
+
+// The Content-Range of a range of a representation
+std::string contentRange(ByteRange const& range, std::uint64_t size)
+{
+    return "bytes " + std::to_string(range.first) + '-' +
+           std::to_string(range.last) + '/' + std::to_string(size);
+}
+
+// A multipart/byteranges boundary that is unlikely to appear in the parts
+std::string multipartBoundary()
+{
+    thread_local std::mt19937_64 engine{std::random_device{}()};
+    char digits[17];
+    auto const end = std::to_chars(
+        std::begin(digits), std::end(digits), engine(), 16).ptr;
+    return "adaptiv-" + std::string(std::begin(digits), end);
+}
+
+// Copy a cached header into fields drawing from the given allocator
+template<class Allocator>
+http::response_header<http::basic_fields<Allocator>>
+copyHeader(http::response_header<> const& header, Allocator const& allocator)
+{
+    http::response_header<http::basic_fields<Allocator>> copy{allocator};
+    copy.result(header.result());
+    copy.version(header.version());
+    for (auto const& field : header) {
+        copy.insert(field.name(), field.name_string(), field.value());
+    }
+    return copy;
+}
+
+// Append the JSON description of a run
+template<class String>
+void appendRun(String& out, RunRegistry::Run const& run)
+{
+    char digits[24];
+    auto const append = [&out, &digits](std::uint64_t value)
+    {
+        auto const end =
+            std::to_chars(std::begin(digits), std::end(digits), value).ptr;
+        out.append(std::begin(digits), end);
+    };
+    auto const started = std::chrono::duration_cast<std::chrono::milliseconds>(
+        run.started.time_since_epoch()).count();
+
+    out.append("{\"id\":");
+    append(run.id);
+    out.append(",\"started\":");
+    append(static_cast<std::uint64_t>(started));
+    out.append(",\"messages\":");
+    append(run.messages);
+    out.append(",\"finished\":").append(run.finished ? "true" : "false");
+    out.append(",\"live\":").append(run.live ? "true" : "false");
+    out.push_back('}');
+}
+
+// The value of a numeric query parameter, fallback if absent or not a number
+std::size_t queryCount(
+    beast::string_view target,
+    beast::string_view name,
+    std::size_t fallback = 0)
+{
+    auto const query = target.find('?');
+    if (query == beast::string_view::npos) {
+        return fallback;
+    }
+    auto parameters = target.substr(query + 1);
+    while (!parameters.empty()) {
+        auto const end = std::min(parameters.find('&'), parameters.size());
+        auto const parameter = parameters.substr(0, end);
+        parameters = parameters.substr(std::min(end + 1, parameters.size()));
+        if (parameter.size() > name.size() &&
+            parameter.starts_with(name) && parameter[name.size()] == '=') {
+            std::size_t value = 0;
+            auto const [end, ec] = std::from_chars(
+                parameter.data() + name.size() + 1,
+                parameter.data() + parameter.size(), value);
+            return ec == std::errc{} ? value : fallback;
+        }
+    }
+    return fallback;
+}
+
 /**
  * Produce an HTTP response for the given request. The type of the response
  * object depends on the contents of the request, so the interface requires the
@@ -86,49 +297,65 @@ std::string pathConcatenate(beast::string_view base, beast::string_view path)
 template<class Body, class Allocator, class Send>
 void
 handleRequest(
-    beast::string_view documentRoot,
+    SharedState& state,
     http::request<Body, http::basic_fields<Allocator>>&& request,
     Send&& send)
 {
-    // Return a bad request response
-    auto const badRequest =
-        [&request](beast::string_view why)
+    // Responses built here draw from the allocator of the request
+    using StringBody = http::basic_string_body<
+        char, std::char_traits<char>, Allocator>;
+    using StringResponse =
+        http::response<StringBody, http::basic_fields<Allocator>>;
+
+    auto const stringResponse =
+        [&request](http::status status, beast::string_view contentType)
         {
-            http::response<http::string_body>
-                response{http::status::bad_request, request.version()};
+            auto const allocator = request.get_allocator();
+            StringResponse response{
+                status, request.version(), allocator, allocator};
             response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            response.set(http::field::content_type, "text/html");
+            response.set(http::field::content_type, contentType);
             response.keep_alive(request.keep_alive());
-            response.body() = why.to_string();
+            return response;
+        };
+    auto const errorResponse =
+        [&stringResponse](http::status status)
+        {
+            return stringResponse(status, "text/html");
+        };
+
+    // Return a bad request response
+    auto const badRequest =
+        [&errorResponse](beast::string_view why)
+        {
+            auto response = errorResponse(http::status::bad_request);
+            response.body().append(why.data(), why.size());
             response.prepare_payload();
             return response;
         };
 
     // Return a not found response
     auto const notFound =
-        [&request](beast::string_view target)
+        [&errorResponse](beast::string_view target)
         {
-            http::response<http::string_body>
-                response{http::status::not_found, request.version()};
-            response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            response.set(http::field::content_type, "text/html");
-            response.keep_alive(request.keep_alive());
-            response.body() =
-                "The resource '" + target.to_string() + "' was not found";
+            auto response = errorResponse(http::status::not_found);
+            response.body()
+                .append("The resource '")
+                .append(target.data(), target.size())
+                .append("' was not found");
             response.prepare_payload();
             return response;
         };
 
     // Return a server error response
     auto const serverError =
-        [&request](beast::string_view what)
+        [&errorResponse](beast::string_view what)
         {
-            http::response<http::string_body>
-                response{http::status::internal_server_error, request.version()};
-            response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            response.set(http::field::content_type, "text/html");
-            response.keep_alive(request.keep_alive());
-            response.body() = "An error occured: " + what.to_string() + "'";
+            auto response = errorResponse(http::status::internal_server_error);
+            response.body()
+                .append("An error occured: ")
+                .append(what.data(), what.size())
+                .append("'");
             response.prepare_payload();
             return response;
         };
@@ -139,6 +366,116 @@ handleRequest(
         return send(badRequest("Unknown HTTP-method"));
     }
 
+    // Reserved path: the server metrics
+    auto const& metricsPath = state.config().metricsPath;
+    if (!metricsPath.empty() && request.target() == metricsPath) {
+        std::ostringstream metrics;
+        state.writeMetrics(metrics);
+
+        http::response<http::string_body>
+            response{http::status::ok, request.version()};
+        response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        response.set(http::field::content_type, "text/plain; version=0.0.4");
+        response.set(http::field::cache_control, "no-store");
+        response.keep_alive(request.keep_alive());
+        response.body() = metrics.str();
+        response.prepare_payload();
+        if (request.method() == http::verb::head) {
+            return send(http::response<http::empty_body>{response.base()});
+        }
+        return send(std::move(response));
+    }
+
+    // Dynamic endpoints answer from memory
+    auto const match = route(request.target());
+    if (match.route == Route::log) {
+        auto const log = state.runs().log(match.ids[0]);
+        if (!log) {
+            return send(notFound(request.target()));
+        }
+
+        // Served from the mapped segments as they are
+        constexpr std::size_t last = std::numeric_limits<std::uint32_t>::max();
+        http::response<RunLogBody> response{http::status::ok, request.version()};
+        response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        response.set(http::field::content_type, "application/x-ndjson");
+        response.set(http::field::cache_control, "no-store");
+        response.keep_alive(request.keep_alive());
+        response.body() = log->read(
+            static_cast<std::uint32_t>(
+                std::min(queryCount(request.target(), "from"), last)),
+            static_cast<std::uint32_t>(
+                std::min(queryCount(request.target(), "to", last), last)));
+        response.prepare_payload();
+        if (request.method() == http::verb::head) {
+            return send(http::response<http::empty_body>{response.base()});
+        }
+        return send(std::move(response));
+    }
+    if (match.route != Route::file) {
+        auto response = stringResponse(http::status::ok, "application/json");
+        response.set(http::field::cache_control, "no-store");
+        auto& body = response.body();
+
+        bool found = false;
+        switch (match.route) {
+        case Route::runs:
+            body.append("{\"runs\":[");
+            state.runs().forEach([&body](RunRegistry::Run const& run)
+            {
+                if (body.back() != '[') {
+                    body.push_back(',');
+                }
+                appendRun(body, run);
+            });
+            body.append("]}");
+            found = true;
+            break;
+        case Route::run:
+            found = state.runs().visit(match.ids[0],
+                [&body](RunRegistry::Run const& run)
+                {
+                    appendRun(body, run);
+                });
+            break;
+        case Route::residuals:
+            found = state.runs().visit(match.ids[0],
+                [&body](RunRegistry::Run const& run)
+                {
+                    if (run.latest) {
+                        body.append(*run.latest);
+                    } else {
+                        body.append("null");
+                    }
+                });
+            break;
+        case Route::history:
+            // The snapshot a late websocket subscriber gets, as JSON,
+            // downsampled to ?points=N
+            body = state.runs().snapshot(match.ids[0], false,
+                queryCount(request.target(), "points"));
+            found = !body.empty() ||
+                state.runs().visit(match.ids[0], [&body](RunRegistry::Run const&)
+                {
+                    body.append("null");
+                });
+            break;
+        default:
+            break;
+        }
+        if (!found) {
+            return send(notFound(request.target()));
+        }
+
+        response.prepare_payload();
+        if (request.method() == http::verb::head) {
+            return send(
+                http::response<http::empty_body, http::basic_fields<Allocator>>{
+                    std::move(response.base())});
+        }
+        return send(std::move(response));
+    }
+
     // Request path must be absolute and not contain ".."
     if (request.target().empty() ||
         request.target()[0] != '/' ||
@@ -147,15 +484,14 @@ handleRequest(
     }
 
     // Build the path to the requested file
-    std::string path = pathConcatenate(documentRoot, request.target());
+    std::string path = pathConcatenate(state.documentRoot(), request.target());
     if (request.target().back() == '/') {
         path.append("index.html");
     }
 
-    // Attempt to open the file
+    // Look the file up in the cache, loading it on a miss
     boost::beast::error_code ec;
-    http::file_body::value_type body;
-    body.open(path.c_str(), beast::file_mode::scan, ec);
+    auto const entry = state.fileCache().get(path, ec);
 
     // Handle the case where the file doesn't exist
     if (ec == boost::system::errc::no_such_file_or_directory) {
@@ -167,31 +503,161 @@ handleRequest(
         return send(serverError(ec.message()));
     }
 
-    // Cache the size since we need it after the move
-    auto const size = body.size();
+    // Prefer a compressed representation if the client accepts one. Ranges
+    // are served from the file as it is, so that the parts of a multipart
+    // response need no encoding of their own.
+    std::shared_ptr<FileCache::Representation const> encoded;
+    auto const acceptEncoding = request[http::field::accept_encoding];
+    auto const ranged = request.method() == http::verb::get &&
+                        request.count(http::field::range) > 0;
+    for (auto encoding : {ContentEncoding::brotli, ContentEncoding::gzip}) {
+        if (!ranged && acceptsEncoding(acceptEncoding, encoding)) {
+            encoded = state.fileCache().encoded(path, entry, encoding);
+            if (encoded) {
+                break;
+            }
+        }
+    }
+    auto const& etag = encoded ? encoded->etag : entry->etag;
+    auto const& header = encoded ? encoded->header : entry->header;
+    auto const& content = encoded ? encoded->content : entry->content;
+    if (encoded) {
+        path = encoded->path;
+    }
+
+    // The client already holds this version of the file
+    if (etagMatches(request[http::field::if_none_match], etag)) {
+        http::response<http::empty_body, http::basic_fields<Allocator>>
+            response{std::piecewise_construct,
+                     std::make_tuple(),
+                     std::make_tuple(request.get_allocator())};
+        response.result(http::status::not_modified);
+        response.version(request.version());
+        response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        response.set(http::field::etag, etag);
+        response.set(http::field::vary, "Accept-Encoding");
+        response.keep_alive(request.keep_alive());
+        return send(std::move(response));
+    }
 
     // Respond to HEAD request
     if (request.method() == http::verb::head) {
-        http::response<http::empty_body>
-            response{http::status::ok, request.version()};
-        response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        response.set(http::field::content_type, mimeType(path));
-        response.content_length(size);
+        http::response<http::empty_body, http::basic_fields<Allocator>>
+            response{copyHeader(header, request.get_allocator())};
+        response.version(request.version());
+        response.keep_alive(request.keep_alive());
+        return send(std::move(response));
+    }
+
+    // Files too large to be cached are streamed from disk
+    beast::file file;
+    std::uint64_t size = 0;
+    if (content) {
+        size = content->size();
+    } else {
+        file.open(path.c_str(), beast::file_mode::scan, ec);
+        if (ec == boost::system::errc::no_such_file_or_directory) {
+            return send(notFound(request.target()));
+        }
+        if (!ec) {
+            size = file.size(ec);
+        }
+        if (ec) {
+            return send(serverError(ec.message()));
+        }
+    }
+
+    // Ranges of the file, unless it changed since the client got the rest of
+    // it. If-Range only validates with the current strong ETag: no
+    // Last-Modified is sent, so a date never matches.
+    std::optional<std::vector<ByteRange>> ranges;
+    auto const ifRange = request[http::field::if_range];
+    if (ranged && (ifRange.empty() || ifRange == etag)) {
+        ranges = parseRange(request[http::field::range], size);
+    }
+
+    if (ranges && ranges->empty()) {
+        auto response = errorResponse(http::status::range_not_satisfiable);
+        response.set(http::field::content_range, "bytes */" + std::to_string(size));
+        response.prepare_payload();
+        return send(std::move(response));
+    }
+
+    // Respond with the ranges, a multipart/byteranges body for several
+    auto const partialContent = [&](auto base, RangeBody::value_type&& body)
+    {
+        using Fields = typename decltype(base)::fields_type;
+        base.result(http::status::partial_content);
+        base.version(request.version());
+        if (ranges->size() == 1) {
+            auto const& range = ranges->front();
+            base.set(http::field::content_range, contentRange(range, size));
+            body.parts.push_back(
+                {{}, range.first, range.last - range.first + 1});
+        } else {
+            auto const boundary = multipartBoundary();
+            auto const type = std::string(base[http::field::content_type]);
+            for (auto const& range : *ranges) {
+                body.parts.push_back({
+                    "\r\n--" + boundary +
+                    "\r\nContent-Type: " + type +
+                    "\r\nContent-Range: " + contentRange(range, size) +
+                    "\r\n\r\n",
+                    range.first,
+                    range.last - range.first + 1});
+            }
+            body.tail = "\r\n--" + boundary + "--\r\n";
+            base.set(http::field::content_type,
+                "multipart/byteranges; boundary=" + boundary);
+        }
+        http::response<RangeBody, Fields> response{
+            std::move(base), std::move(body)};
+        response.keep_alive(request.keep_alive());
+        response.prepare_payload();
+
+        logger().write(LogLevel::info, "sent ranges", request.target());
+        return response;
+    };
+
+    // Respond to GET request from memory
+    if (content) {
+        if (ranges) {
+            RangeBody::value_type body;
+            body.content = content;
+            return send(partialContent(
+                copyHeader(header, request.get_allocator()), std::move(body)));
+        }
+
+        http::response<SharedStringBody, http::basic_fields<Allocator>>
+            response{copyHeader(header, request.get_allocator()), content};
+        response.version(request.version());
         response.keep_alive(request.keep_alive());
+
+        logger().write(LogLevel::info, "sent", request.target());
+
         return send(std::move(response));
     }
 
+    // Ranges of a file on disk go out through sendfile when there is one
+    if (ranges) {
+        RangeBody::value_type body;
+        body.file = std::move(file);
+        return send(partialContent(header, std::move(body)));
+    }
+
+    http::file_body::value_type body;
+    body.reset(std::move(file), ec);
+    if (ec) {
+        return send(serverError(ec.message()));
+    }
+
     // Respond to GET request
-    http::response<http::file_body>
-        response{std::piecewise_construct,
-                 std::make_tuple(std::move(body)),
-                 std::make_tuple(http::status::ok, request.version())};
-    response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    response.set(http::field::content_type, mimeType(path));
-    response.content_length(size);
+    http::response<http::file_body> response{header, std::move(body)};
+    response.version(request.version());
+    response.content_length(response.body().size());
     response.keep_alive(request.keep_alive());
 
-    std::cout << "[sent] " << request.target() << '\n';
+    logger().write(LogLevel::info, "sent", request.target());
 
     return send(std::move(response));
 }
@@ -199,15 +665,44 @@ handleRequest(
 // HTTP helpers ----------------------------------------------------------------
 
 HttpSession::HttpSession(
-    tcp::socket&& socket,
-    std::shared_ptr<SharedState> const& state)
+    ShardSocket&& socket,
+    std::shared_ptr<SharedState> const& state,
+    std::size_t shard)
     : stream_(std::move(socket))
     , state_(state)
-{ }
+    , shard_(shard)
+    , arenas_(std::make_unique<RequestArena[]>(state->config().httpPipeline))
+    , queueLimit_(state->config().httpPipeline)
+#if ADAPTIV_HAS_SENDFILE
+    , fileTimer_(stream_.get_executor())
+#endif
+{
+    // Pipelined responses are coalesced by the gathered writes, so Nagle's
+    // algorithm would only hold the last one back until the peer acks
+    error_code ec;
+    stream_.socket().set_option(tcp::no_delay(true), ec);
+
+    queue_.reserve(queueLimit_);
+    gathered_.reserve(gatherLimit);
+    state_->metrics().add(Metrics::Gauge::httpSessions, 1);
+}
+
+HttpSession::~HttpSession()
+{
+    state_->metrics().add(Metrics::Gauge::httpSessions, -1);
+}
 
 void HttpSession::run()
 {
-    doRead();
+    // We need to be executing within the strand to perform async operations
+    // on the I/O objects in this session. Although not strictly necessary
+    // for single-threaded contexts, this code is written to be thread-safe.
+    net::dispatch(
+        stream_.get_executor(),
+        [self = shared_from_this()]()
+        {
+            self->doRead();
+        });
 }
 
 void HttpSession::fail(error_code ec, char const* what)
@@ -216,92 +711,638 @@ void HttpSession::fail(error_code ec, char const* what)
     if (ec == net::error::operation_aborted) {
         return;
     }
-    std::cerr << what << ": " << ec.message() << '\n';
+    logger().write(LogLevel::error, what, ec);
 }
 
+// Response queue --------------------------------------------------------------
+
+template<class Body, class Fields>
+class HttpSession::WorkImpl: public HttpSession::Work
+{
+    http::response<Body, Fields> response_;
+    http::response_serializer<Body, Fields> serializer_;
+    // Known up front: sendFile moves the header out of the response
+    bool needEof_;
+
+public:
+    explicit WorkImpl(http::response<Body, Fields>&& response)
+        : response_(std::move(response))
+        , serializer_(response_)
+        , needEof_(response_.need_eof())
+    { }
+
+    bool needEof() const override
+    {
+        return needEof_;
+    }
+
+    bool gatherable() const override
+    {
+        // Files are read (or sent) in chunks
+        if constexpr (std::is_same_v<Body, RangeBody>) {
+            return response_.body().inMemory();
+        }
+        return !std::is_same_v<Body, http::file_body>;
+    }
+
+    std::size_t gather(std::vector<net::const_buffer>& buffers) override
+    {
+        std::size_t bytes = 0;
+        error_code ec;
+        serializer_.next(ec,
+            [&](error_code&, auto const& sequence)
+            {
+                for (auto const buffer : beast::buffers_range_ref(sequence)) {
+                    buffers.push_back(buffer);
+                    bytes += buffer.size();
+                }
+            });
+        // Bodies in memory cannot fail to serialize
+        BOOST_ASSERT(!ec);
+        return bytes;
+    }
+
+    bool consume(std::size_t bytes) override
+    {
+        serializer_.consume(bytes);
+        return serializer_.is_done();
+    }
+
+    void write(HttpSession& session) override
+    {
+#if ADAPTIV_HAS_SENDFILE
+        // Bodies read from disk bypass the serializer
+        if constexpr (std::is_same_v<Body, http::file_body> &&
+                      std::is_same_v<Fields, http::fields>) {
+            if (session.state_->config().sendfile) {
+                auto const size = response_.body().size();
+                return session.sendFile(std::move(response_.base()),
+                    std::move(response_.body().file()), 0, size);
+            }
+        }
+        if constexpr (std::is_same_v<Body, RangeBody> &&
+                      std::is_same_v<Fields, http::fields>) {
+            auto& body = response_.body();
+            if (session.state_->config().sendfile && body.parts.size() == 1 &&
+                body.parts.front().head.empty() && body.tail.empty()) {
+                auto const part = body.parts.front();
+                return session.sendFile(std::move(response_.base()),
+                    std::move(body.file), part.offset, part.length);
+            }
+        }
+#endif
+        session.stream_.expires_after(HttpSession::timeout);
+        http::async_write(session.stream_, serializer_,
+            recycle(session.handlerMemory_,
+                [self = session.shared_from_this()](
+                    error_code ec, std::size_t bytes)
+                {
+                    self->onWrite(ec, bytes);
+                }));
+    }
+};
+
+template<class Body, class Fields>
+void HttpSession::enqueue(http::response<Body, Fields>&& response)
+{
+    // The response lives next to its request
+    using Impl = WorkImpl<Body, Fields>;
+    ArenaAllocator<Impl> allocator(arenas_[arena_]);
+    auto const work = new (allocator.allocate(1)) Impl(std::move(response));
+
+    closing_ = closing_ || work->needEof();
+    queue_.emplace_back(work);
+    doWrite();
+}
+
+// HTTP session ----------------------------------------------------------------
+
 void HttpSession::doRead()
 {
-    // Construct a new parser for each message
-    parser_.emplace();
+    // Construct a new parser for each message. While no response is queued
+    // every arena is free, and the first one is the warmest.
+    parser_.reset();
+    arena_ = queue_.empty() ? 0 : (arena_ + 1) % queueLimit_;
+    auto& arena = arenas_[arena_];
+    arena.reset();
+    ArenaAllocator<char> const allocator(arena);
+    parser_.emplace(
+        std::piecewise_construct,
+        std::make_tuple(allocator),
+        std::make_tuple(allocator));
 
-    // Apply a reasonable limit to the allowed size of the body in bytes
-    // to prevent abuse
-    parser_->body_limit(HttpSession::maxBodySize);
+    // The limit of the body depends on the route, known with the header.
+    // Not none: Beast 1.74 compares a content length with it as less than
+    // any value.
+    parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
 
     // Set timeout
-    stream_.expires_after(std::chrono::seconds(30));
+    stream_.expires_after(HttpSession::timeout);
 
-    // Read a request
-    http::async_read(
+    // Read the header of a request
+    reading_ = true;
+    http::async_read_header(
         stream_,
         buffer_,
-        parser_->get(),
-        [self = shared_from_this()](error_code ec, std::size_t bytes)
-        {
-            self->onRead(ec, bytes);
-        });
+        *parser_,
+        recycle(handlerMemory_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                self->onReadHeader(ec, bytes);
+            }));
 }
 
-void HttpSession::onRead(error_code ec, std::size_t)
+void HttpSession::onReadHeader(error_code ec, std::size_t)
 {
-    // This means they close the connection
+    // This means they close the connection, once the pending responses are out
     if (ec == http::error::end_of_stream) {
-        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        reading_ = false;
+        peerClosed_ = true;
+        if (!writing_) {
+            stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        }
         return;
     }
+    if (ec) {
+        return onRead(ec, 0);
+    }
+
+    auto const match = route(parser_->get().target());
+    if (match.route == Route::mesh || match.route == Route::caseFile) {
+        return startUpload(match);
+    }
+
+    // Apply a reasonable limit to the allowed size of the body in bytes
+    // to prevent abuse
+    auto const length = parser_->content_length();
+    if (length && *length > HttpSession::maxBodySize) {
+        return reject(http::status::payload_too_large, "Request body too large",
+            parser_->get().version());
+    }
+    parser_->body_limit(HttpSession::maxBodySize);
+
+    // Most requests have no body and are complete already
+    if (parser_->is_done()) {
+        return onRead(ec, 0);
+    }
+    http::async_read(
+        stream_,
+        buffer_,
+        *parser_,
+        recycle(handlerMemory_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                self->onRead(ec, bytes);
+            }));
+}
+
+void HttpSession::onRead(error_code ec, std::size_t)
+{
+    reading_ = false;
 
-    // Handle the error, if any
+    // Handle the error, if any. The queued responses still go out.
     if (ec) {
+        peerClosed_ = true;
         return fail(ec, "read");
     }
 
     // --- WebSocket (check if it is an upgrade)
     if (websocket::is_upgrade(parser_->get())) {
-        // Create a WebSocket session by transferring ownership of both the
-        // socket and request using release*() which also performs a move().
-        std::make_shared<WebSocketSession>(
-            stream_.release_socket(),
-            state_)->run(parser_->release());
+        // The socket changes hands once the queued responses are written
+        upgrading_ = true;
+        if (!writing_) {
+            upgrade();
+        }
         return;
     }
 
     // --- HTTP response
+    auto const start = std::chrono::steady_clock::now();
     handleRequest(
-        state_->documentRoot(),
+        *state_,
         std::move(parser_->get()),
-        [this](auto&& response)
+        [this, start](auto&& response)
         {
-            // The lifetime of the message has to extend for the duration of
-            // the async operation so we use a shared_ptr to manage it.
-            using response_type = typename std::decay_t<decltype(response)>;
-            auto responseSPtr = std::make_shared<response_type>
-                (std::forward<decltype(response)>(response));
-
-            // Write the response
-            // Note: declaring self inside the capture causes an ICE in gcc 7.3
-            auto self = shared_from_this();
-            http::async_write(stream_, *responseSPtr,
-            [self, responseSPtr](error_code ec, std::size_t bytes)
-            {
-                self->onWrite(ec, bytes, responseSPtr->need_eof());
-            });
+            auto& metrics = state_->metrics();
+            metrics.record(Metrics::Histogram::handler,
+                std::chrono::steady_clock::now() - start);
+            metrics.countResponse(response.result_int());
+
+            enqueue(std::forward<decltype(response)>(response));
         });
+
+    // Pipelining: read the next request while the responses are written
+    if (canRead()) {
+        doRead();
+    }
+}
+
+void HttpSession::startUpload(RouteMatch const& match)
+{
+    auto const& config = state_->config();
+    auto const version = parser_->get().version();
+    if (config.uploadDirectory.empty()) {
+        return reject(http::status::not_found, "Uploads are disabled", version);
+    }
+    auto const method = parser_->get().method();
+    if (method != http::verb::put && method != http::verb::post) {
+        return reject(http::status::method_not_allowed, "Upload with PUT or POST",
+            version);
+    }
+    auto const limit = match.route == Route::mesh ? config.meshUploadLimit
+                                                  : config.caseUploadLimit;
+    auto const length = parser_->content_length();
+    if (length && *length > limit) {
+        return reject(http::status::payload_too_large, "Upload too large", version);
+    }
+
+    // Concurrent uploads of the same file each get their own temporary file,
+    // and the last one to complete wins. Uploaded names never start with a
+    // dot, so the temporary files cannot be overwritten by an upload.
+    static std::atomic<std::uint64_t> uploads{0};
+    std::filesystem::path directory(config.uploadDirectory);
+    directory /= match.route == Route::mesh ? "meshes" : "cases";
+    uploadPath_ = (directory / std::string(match.name)).string();
+    uploadTemp_ = (directory /
+        ('.' + std::string(match.name) + '.' +
+         std::to_string(uploads.fetch_add(1, std::memory_order_relaxed)) +
+         ".part")).string();
+
+    // A failure shows when the file is opened
+    std::error_code ignored;
+    std::filesystem::create_directories(directory, ignored);
+    upload_.emplace(std::move(*parser_));
+    upload_->body_limit(limit);
+    error_code ec;
+    upload_->get().body().open(uploadTemp_.c_str(), beast::file_mode::write, ec);
+    if (ec) {
+        logger().write(LogLevel::error, "upload", ec);
+        upload_.reset();
+        return reject(http::status::internal_server_error, "Cannot store the upload",
+            version);
+    }
+
+    // Clients waiting to be told to send the body are told so, unless
+    // responses are on their way: the body then follows after a while
+    auto const& request = upload_->get();
+    if (beast::iequals(request[http::field::expect], "100-continue") &&
+        !writing_ && queue_.empty() && !upload_->is_done()) {
+        static constexpr beast::string_view proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+        stream_.expires_after(HttpSession::timeout);
+        net::async_write(stream_, net::buffer(proceed.data(), proceed.size()),
+            recycle(handlerMemory_,
+                [self = shared_from_this()](error_code ec, std::size_t bytes)
+                {
+                    self->state_->metrics().add(Metrics::Counter::responseBytes, bytes);
+                    if (ec) {
+                        return self->onReadUpload(ec, 0);
+                    }
+                    self->doReadUpload();
+                }));
+        return;
+    }
+    doReadUpload();
+}
+
+void HttpSession::doReadUpload()
+{
+    if (upload_->is_done()) {
+        return onReadUpload({}, 0);
+    }
+    stream_.expires_after(HttpSession::timeout);
+    http::async_read_some(
+        stream_,
+        buffer_,
+        *upload_,
+        recycle(handlerMemory_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                self->onReadUpload(ec, bytes);
+            }));
+}
+
+void HttpSession::onReadUpload(error_code ec, std::size_t bytes)
+{
+    state_->metrics().add(Metrics::Counter::uploadBytes, bytes);
+    if (!ec && !upload_->is_done()) {
+        return doReadUpload();
+    }
+
+    auto& request = upload_->get();
+    auto const keepAlive = request.keep_alive();
+    auto const version = request.version();
+    auto const target = std::string(request.target());
+    request.body().close();
+    upload_.reset();
+
+    std::error_code ignored;
+    if (ec) {
+        std::filesystem::remove(uploadTemp_, ignored);
+        if (ec == http::error::body_limit) {
+            return reject(http::status::payload_too_large, "Upload too large",
+                version);
+        }
+        reading_ = false;
+        peerClosed_ = true;
+        return fail(ec, "upload");
+    }
+
+    auto const created = !std::filesystem::exists(uploadPath_, ignored);
+    std::error_code renamed;
+    std::filesystem::rename(uploadTemp_, uploadPath_, renamed);
+    if (renamed) {
+        std::filesystem::remove(uploadTemp_, ignored);
+        logger().write(LogLevel::error, "upload", renamed.message());
+        return reject(http::status::internal_server_error, "Cannot store the upload",
+            version);
+    }
+    auto const size = std::filesystem::file_size(uploadPath_, ignored);
+    logger().write(LogLevel::info, "uploaded", target);
+
+    http::response<http::string_body> response{
+        created ? http::status::created : http::status::ok, version};
+    response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    response.set(http::field::content_type, "application/json");
+    response.set(http::field::cache_control, "no-store");
+    if (created) {
+        response.set(http::field::location, target);
+    }
+    auto const name = std::filesystem::path(uploadPath_).filename().string();
+    response.body() = "{\"name\":\"" + name + "\",\"bytes\":" +
+                      std::to_string(size) + '}';
+    response.keep_alive(keepAlive);
+    response.prepare_payload();
+    state_->metrics().countResponse(response.result_int());
+
+    reading_ = false;
+    enqueue(std::move(response));
+    if (canRead()) {
+        doRead();
+    }
+}
+
+void HttpSession::reject(
+    http::status status,
+    beast::string_view why,
+    unsigned version)
+{
+    // The body was not read, so the next request cannot be found
+    reading_ = false;
+    peerClosed_ = true;
+    lingering_ = true;
+
+    http::response<http::string_body> response{status, version};
+    response.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    response.set(http::field::content_type, "text/html");
+    if (status == http::status::method_not_allowed) {
+        response.set(http::field::allow, "PUT, POST");
+    }
+    response.body().assign(why.data(), why.size());
+    response.keep_alive(false);
+    response.prepare_payload();
+    state_->metrics().countResponse(response.result_int());
+    enqueue(std::move(response));
+}
+
+void HttpSession::upgrade()
+{
+    // Create a WebSocket session by transferring ownership of both the
+    // socket and request using release*() which also performs a move().
+    std::make_shared<WebSocketSession>(
+        stream_.release_socket(),
+        state_,
+        shard_)->run(parser_->release());
+}
+
+void HttpSession::doWrite()
+{
+    if (writing_ || queue_.empty()) {
+        return;
+    }
+    writing_ = true;
+    gather_.clear();
+    gathered_.clear();
+
+    if (!queue_.front()->gatherable()) {
+        return queue_.front()->write(*this);
+    }
+
+    // Gather the consecutive responses that are ready to go
+    for (auto const& work : queue_) {
+        if (!work->gatherable() || gathered_.size() == gatherLimit) {
+            break;
+        }
+        gathered_.push_back(work->gather(gather_));
+        if (work->needEof()) {
+            break;
+        }
+    }
+
+    stream_.expires_after(HttpSession::timeout);
+    net::async_write(
+        stream_,
+        beast::span<net::const_buffer const>(gather_.data(), gather_.size()),
+        recycle(handlerMemory_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                self->onWrite(ec, bytes);
+            }));
 }
 
-void HttpSession::onWrite(error_code ec, std::size_t, bool close)
+void HttpSession::onWrite(error_code ec, std::size_t bytes)
 {
+    state_->metrics().add(Metrics::Counter::responseBytes, bytes);
+    writing_ = false;
+
     // Handle error, if any
     if (ec) {
         return fail(ec, "write");
     }
 
-    if (close) {
+    // Retire the responses that went out (a lone one is always complete)
+    auto const written = std::max<std::size_t>(gathered_.size(), 1);
+    bool close = false;
+    for (std::size_t i = 0; i < written; ++i) {
+        if (!gathered_.empty()) {
+            auto const complete = queue_[i]->consume(gathered_[i]);
+            BOOST_ASSERT(complete);
+            boost::ignore_unused(complete);
+        }
+        close = close || queue_[i]->needEof();
+    }
+    queue_.erase(queue_.begin(), queue_.begin() + written);
+
+    if (close || (peerClosed_ && queue_.empty())) {
         // This means we should close the connection, usually because the
         // response indicated the "Connection: close" semantic.
         stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        if (lingering_) {
+            lingered_ = 0;
+            stream_.expires_after(HttpSession::lingerTimeout);
+            doLinger();
+        }
+        return;
+    }
+    if (upgrading_ && queue_.empty()) {
+        return upgrade();
+    }
+
+    // Resume reading if the queue was full
+    if (canRead()) {
+        doRead();
+    }
+    doWrite();
+}
+
+void HttpSession::doLinger()
+{
+    buffer_.clear();
+    stream_.async_read_some(
+        buffer_.prepare(lingerChunk),
+        recycle(handlerMemory_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                self->onLinger(ec, bytes);
+            }));
+}
+
+void HttpSession::onLinger(error_code ec, std::size_t bytes)
+{
+    // Until the peer is done sending, there is too much of it, or the time
+    // is up: closing with unread data would reset the connection, and the
+    // peer could lose the response before reading it
+    lingered_ += bytes;
+    if (ec || lingered_ >= HttpSession::lingerLimit) {
+        stream_.socket().close(ec);
+        return;
+    }
+    doLinger();
+}
+
+#if ADAPTIV_HAS_SENDFILE
+void HttpSession::sendFile(
+    http::response_header<>&& header,
+    beast::file&& file,
+    std::uint64_t offset,
+    std::uint64_t size)
+{
+    fileOffset_ = offset;
+    fileSize_ = size;
+    fileRemaining_ = size;
+    file_ = std::move(file);
+
+    // The serializer only writes the header: the content length is already
+    // set, and the body follows through sendfile
+    auto headerSPtr = std::make_shared<http::response<http::empty_body>>(
+        std::move(header));
+
+    auto self = shared_from_this();
+    stream_.expires_after(HttpSession::timeout);
+    http::async_write(stream_, *headerSPtr, recycle(handlerMemory_,
+    [self, headerSPtr](error_code ec, std::size_t bytes)
+    {
+        self->state_->metrics().add(Metrics::Counter::responseBytes, bytes);
+        if (ec) {
+            return self->finishSendFile(ec);
+        }
+
+        // Watch the progress of the transfer
+        self->fileProgress_ = std::chrono::steady_clock::now();
+        self->fileTimer_.expires_after(HttpSession::timeout);
+        self->fileTimer_.async_wait(recycle(self->handlerMemory_,
+            [self](error_code ec)
+            {
+                self->onSendFileTimer(ec);
+            }));
+
+        self->doSendFile();
+    }));
+}
+
+void HttpSession::doSendFile()
+{
+    // Never transfer more than sendfile accepts in a single call
+    std::uint64_t constexpr maxChunk = 0x7ffff000;
+
+    auto& socket = stream_.socket();
+    error_code ec;
+    socket.native_non_blocking(true, ec);
+
+    while (!ec && fileRemaining_ > 0) {
+        auto offset = static_cast<off_t>(fileOffset_);
+        auto const n = ::sendfile(
+            socket.native_handle(),
+            file_.native_handle(),
+            &offset,
+            static_cast<std::size_t>(std::min(fileRemaining_, maxChunk)));
+
+        if (n > 0) {
+            fileOffset_ += static_cast<std::uint64_t>(n);
+            fileRemaining_ -= static_cast<std::uint64_t>(n);
+            fileProgress_ = std::chrono::steady_clock::now();
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // The socket buffer is full: wait until the peer reads some more
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            socket.async_wait(
+                tcp::socket::wait_write,
+                recycle(handlerMemory_,
+                    [self = shared_from_this()](error_code ec)
+                    {
+                        if (ec) {
+                            return self->finishSendFile(ec);
+                        }
+                        self->doSendFile();
+                    }));
+            return;
+        }
+
+        // The file was truncated or the connection is gone
+        ec = n == 0 ? error_code(net::error::eof)
+                    : error_code(errno, boost::system::system_category());
+    }
+    finishSendFile(ec);
+}
+
+void HttpSession::finishSendFile(error_code ec)
+{
+    // Whichever way the transfer ends, the timer must not keep the session
+    fileTimer_.cancel();
+    error_code closed;
+    file_.close(closed);
+
+    if (ec) {
+        return fail(ec, "sendfile");
+    }
+
+    onWrite(ec, static_cast<std::size_t>(fileSize_));
+}
+
+void HttpSession::onSendFileTimer(error_code ec)
+{
+    // The transfer completed
+    if (ec == net::error::operation_aborted || fileRemaining_ == 0) {
         return;
     }
 
-    // Read another request
-    doRead();
+    // Give up on peers that have not read anything for a whole timeout,
+    // which completes the pending wait with operation_aborted
+    auto const deadline = fileProgress_ + HttpSession::timeout;
+    if (std::chrono::steady_clock::now() >= deadline) {
+        fail(beast::error::timeout, "sendfile");
+        stream_.socket().cancel(ec);
+        return;
+    }
+
+    fileTimer_.expires_at(deadline);
+    fileTimer_.async_wait(recycle(handlerMemory_,
+        [self = shared_from_this()](error_code ec)
+        {
+            self->onSendFileTimer(ec);
+        }));
 }
+#endif
@@ -1,18 +1,51 @@
-#include <iostream>
 #include <memory>
 
 #include "listener.hpp"
 #include "http_session.hpp"
+#include "logger.hpp"
 
 class HttpSession;
 
+#ifdef SO_REUSEPORT
+namespace
+{
+
+/// SO_REUSEPORT, which Asio has no public option for, as a SettableSocketOption
+class ReusePort
+{
+    int value_;
+
+public:
+    explicit ReusePort(bool enabled) noexcept : value_(enabled ? 1 : 0) { }
+
+    template<class Protocol>
+    int level(Protocol const&) const noexcept { return SOL_SOCKET; }
+
+    template<class Protocol>
+    int name(Protocol const&) const noexcept { return SO_REUSEPORT; }
+
+    template<class Protocol>
+    void const* data(Protocol const&) const noexcept { return &value_; }
+
+    template<class Protocol>
+    std::size_t size(Protocol const&) const noexcept { return sizeof(value_); }
+};
+
+} // namespace
+#endif
+
 Listener::Listener(
     net::io_context& ioc,
     tcp::endpoint endpoint,
-    std::shared_ptr<SharedState> const& state)
+    std::shared_ptr<SharedState> const& state,
+    bool reusePort,
+    std::size_t firstShard,
+    std::size_t shardCount)
     : acceptor_(ioc)
-    , socket_(ioc)
+    , timer_(ioc)
     , state_(state)
+    , firstShard_(firstShard)
+    , shardCount_(shardCount)
 {
     error_code ec;
 
@@ -30,6 +63,19 @@ Listener::Listener(
         return;
     }
 
+    // Allow other listeners to bind to the same port
+    if (reusePort) {
+#ifdef SO_REUSEPORT
+        acceptor_.set_option(ReusePort(true), ec);
+#else
+        ec = net::error::operation_not_supported;
+#endif
+        if (ec) {
+            fail(ec, "set_option");
+            return;
+        }
+    }
+
     // Bind to the server address
     acceptor_.bind(endpoint, ec);
     if (ec) {
@@ -48,12 +94,13 @@ Listener::Listener(
 void Listener::run()
 {
     // Start accepting a connection
-    acceptor_.async_accept(
-        socket_,
-        [self = shared_from_this()](error_code ec)
-        {
-            self->onAccept(ec);
-        });
+    doAccept();
+}
+
+tcp::endpoint Listener::localEndpoint() const
+{
+    error_code ec;
+    return acceptor_.local_endpoint(ec);
 }
 
 void Listener::fail(error_code ec, char const* what)
@@ -62,25 +109,62 @@ void Listener::fail(error_code ec, char const* what)
     if (ec == net::error::operation_aborted) {
         return;
     }
-    std::cerr << what <<": " << ec.message() << '\n';
+    logger().write(LogLevel::error, what, ec);
+}
+
+void Listener::doAccept()
+{
+    // Connections are spread over the shards in turn. The socket is bound to
+    // the executor of its shard (a strand, alone on its context with reuseport) so
+    // the handlers of a session never run concurrently.
+    auto const shard = firstShard_ + nextShard_;
+    nextShard_ = (nextShard_ + 1) % shardCount_;
+
+    acceptor_.async_accept(
+        state_->shardExecutor(shard),
+        recycle(handlerMemory_,
+            [self = shared_from_this(), shard](error_code ec, ShardSocket socket)
+            {
+                self->onAccept(ec, std::move(socket), shard);
+            }));
 }
 
-void Listener::onAccept(error_code ec)
+void Listener::onAccept(error_code ec, ShardSocket socket, std::size_t shard)
 {
+    if (ec == net::error::operation_aborted) {
+        return;
+    }
     if (ec) {
-        return fail(ec, "accept");
+        fail(ec, "accept");
+
+        // The connection is lost, but not the listener. Running out of
+        // descriptors or memory lasts until sessions end, so there is no
+        // point in trying again at once.
+        if (ec == net::error::no_descriptors ||
+            ec == boost::system::errc::too_many_files_open_in_system ||
+            ec == net::error::no_buffer_space ||
+            ec == net::error::no_memory) {
+            timer_.expires_after(Listener::acceptRetry);
+            timer_.async_wait(recycle(handlerMemory_,
+                [self = shared_from_this()](error_code ec)
+                {
+                    if (!ec) {
+                        self->doAccept();
+                    }
+                }));
+            return;
+        }
+        return doAccept();
     }
 
+    state_->metrics().add(Metrics::Counter::accepts);
+
     // Lauch a new session for this connection
     std::make_shared<HttpSession>(
-        std::move(socket_),
-        state_)->run();
+        std::move(socket),
+        state_,
+        shard)->run();
 
     // Accept another connection
-    acceptor_.async_accept(
-        socket_,
-        [self = shared_from_this()](error_code ec)
-        {
-            self->onAccept(ec);
-        });
+    doAccept();
 }
\ No newline at end of file
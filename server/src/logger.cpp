@@ -0,0 +1,242 @@
+#include <ostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+#include "logger.hpp"
+
+namespace
+{
+
+char const* levelName(LogLevel level)
+{
+    switch (level) {
+    case LogLevel::debug:   return "debug";
+    case LogLevel::info:    return "info";
+    case LogLevel::warning: return "warning";
+    case LogLevel::error:   return "error";
+    case LogLevel::off:     break;
+    }
+    return "";
+}
+
+std::int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// [2019-05-01 12:00:00.000000] (UTC)
+void appendTime(std::string& out, std::int64_t time)
+{
+    auto const seconds = static_cast<std::time_t>(time / 1'000'000'000);
+    auto const micros = static_cast<int>(time % 1'000'000'000 / 1000);
+
+    // Only the flusher thread formats dates, so gmtime is safe
+    char buffer[40];
+    auto n = std::strftime(
+        buffer, sizeof(buffer), "[%Y-%m-%d %H:%M:%S", std::gmtime(&seconds));
+    n += static_cast<std::size_t>(
+        std::snprintf(buffer + n, sizeof(buffer) - n, ".%06d] ", micros));
+    out.append(buffer, n);
+}
+
+} // namespace
+
+Logger& logger()
+{
+    static Logger instance;
+    return instance;
+}
+
+Logger::~Logger()
+{
+    stop();
+}
+
+void Logger::start(
+    LogLevel level,
+    std::size_t sampleEvery,
+    std::ostream& out,
+    std::ostream& err)
+{
+    if (running_) {
+        return;
+    }
+    level_ = level;
+    sampleEvery_ = std::max<std::size_t>(sampleEvery, 1);
+    out_ = &out;
+    err_ = &err;
+    running_ = true;
+    flusher_ = std::thread([this]{ flush(); });
+}
+
+void Logger::stop()
+{
+    if (!running_.exchange(false)) {
+        return;
+    }
+    flusher_.join();
+}
+
+void Logger::write(
+    LogLevel level,
+    char const* what,
+    beast::string_view text) noexcept
+{
+    if (!enabled(level)) {
+        return;
+    }
+    auto& ring = local();
+    auto* record = acquire(ring, level, what);
+    if (!record) {
+        return;
+    }
+    record->category = nullptr;
+    record->size = static_cast<std::uint32_t>(text.size());
+    record->length = static_cast<std::uint8_t>(
+        std::min(text.size(), sizeof(record->text)));
+    std::memcpy(record->text, text.data(), record->length);
+    commit(ring);
+}
+
+void Logger::write(
+    LogLevel level,
+    char const* what,
+    error_code const& ec) noexcept
+{
+    if (!enabled(level)) {
+        return;
+    }
+    auto& ring = local();
+    auto* record = acquire(ring, level, what);
+    if (!record) {
+        return;
+    }
+    record->category = &ec.category();
+    record->code = ec.value();
+    record->size = 0;
+    record->length = 0;
+    commit(ring);
+}
+
+std::uint64_t Logger::dropped() const noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::uint64_t result = 0;
+    for (auto const& ring : rings_) {
+        result += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+Logger::Ring& Logger::local()
+{
+    thread_local Ring* ring = nullptr;
+    if (!ring) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(std::make_unique<Ring>());
+        ring = rings_.back().get();
+    }
+    return *ring;
+}
+
+Logger::Record* Logger::acquire(
+    Ring& ring,
+    LogLevel level,
+    char const* what) noexcept
+{
+    if (level < LogLevel::warning && sampleEvery_ > 1 &&
+        ring.sampled++ % sampleEvery_ != 0) {
+        return nullptr;
+    }
+
+    auto const head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) == ringSize) {
+        ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    auto& record = ring.records[head % ringSize];
+    record.time = now();
+    record.what = what;
+    record.level = level;
+    return &record;
+}
+
+void Logger::commit(Ring& ring) noexcept
+{
+    ring.head.store(ring.head.load(std::memory_order_relaxed) + 1,
+        std::memory_order_release);
+}
+
+void Logger::flush()
+{
+    std::string out;
+    std::string err;
+    while (running_) {
+        if (!drain(out, err)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+
+    // Records written before stop was called
+    while (drain(out, err)) { }
+}
+
+bool Logger::drain(std::string& out, std::string& err)
+{
+    bool pending = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto const& ring : rings_) {
+            auto tail = ring->tail.load(std::memory_order_relaxed);
+            auto const head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail) {
+                auto const& record = ring->records[tail % ringSize];
+                auto& text = record.level >= LogLevel::warning ? err : out;
+
+                appendTime(text, record.time);
+                text.append(levelName(record.level)).append(" ");
+                text.append(record.what).append(": ");
+                if (record.category) {
+                    text.append(record.category->message(record.code));
+                } else {
+                    text.append(record.text, record.length);
+                    if (record.size > record.length) {
+                        text.append("... (")
+                            .append(std::to_string(record.size))
+                            .append(" bytes)");
+                    }
+                }
+                text.push_back('\n');
+                pending = true;
+            }
+            ring->tail.store(tail, std::memory_order_release);
+
+            auto const dropped = ring->dropped.load(std::memory_order_relaxed);
+            if (dropped != ring->reported) {
+                appendTime(err, now());
+                err.append("warning log: ")
+                    .append(std::to_string(dropped - ring->reported))
+                    .append(" records dropped\n");
+                ring->reported = dropped;
+                pending = true;
+            }
+        }
+    }
+
+    if (!out.empty()) {
+        out_->write(out.data(), static_cast<std::streamsize>(out.size()));
+        out_->flush();
+        out.clear();
+    }
+    if (!err.empty()) {
+        err_->write(err.data(), static_cast<std::streamsize>(err.size()));
+        err_->flush();
+        err.clear();
+    }
+    return pending;
+}
@@ -4,47 +4,42 @@
 
 #include <boost/asio/signal_set.hpp>
 
-#include "listener.hpp"
+#include "config.hpp"
+#include "server.hpp"
 #include "shared_state.hpp"
+#include "logger.hpp"
 
 int main(int argc, char** argv)
 {
     // Check command line arguments
-    if (argc != 4) {
-        std::cerr <<
-            "  Usage: server <address> <port> <documentRoot>\n" <<
-            "Example:\n" <<
-            "         server 127.0.0.1 8080 .\n";
+    ServerConfig config;
+    if (!parseArguments(argc, argv, config, std::cerr)) {
         return EXIT_FAILURE;
     }
-    auto address = net::ip::make_address(argv[1]);
-    auto port = static_cast<unsigned short>(std::atoi(argv[2]));
-    auto documentRoot = argv[3];
 
-    // The I/O context is required for all I/O
-    net::io_context ioc;
+    // Records are formatted and written by a background thread
+    logger().start(config.logLevel, config.logSample, std::cout, std::cerr);
 
-    // Create and launch a listening port
-    std::make_shared<Listener>(
-        ioc,
-        tcp::endpoint{address, port},
-        std::make_shared<SharedState>(documentRoot))->run();
+    // Create the listening ports and the threads running the I/O
+    Server server(config, std::make_shared<SharedState>(config));
 
     // Capture SIGINT and SIGTERM to perform a clean shutdown
-    net::signal_set signals(ioc, SIGINT, SIGTERM);
+    net::signal_set signals(server.ioContext(), SIGINT, SIGTERM);
     signals.async_wait(
-        [&ioc](error_code const& ec, int)
+        [&server](error_code const& ec, int)
         {
-            // Stop the io_context. This will cause run() to return
-            // immediately, eventually destroying the io_context and any
-            // remaining handlers in it.
-            ioc.stop();
+            // Stop every io_context. This will cause run() to return
+            // immediately on every thread, eventually destroying the
+            // io_contexts and any remaining handlers in them.
+            server.stop();
         });
 
     // Run the I/O service
-    ioc.run();
+    server.start();
+    server.join();
 
     // If we get here, it means we got a SIGINT or SIGTERM
+    logger().stop();
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,222 @@
+#include <ostream>
+#include <algorithm>
+#include <iterator>
+
+#include "metrics.hpp"
+
+namespace
+{
+
+// The single writer of a slot does not need a locked read-modify-write
+template<class T>
+void bump(std::atomic<T>& value, T delta) noexcept
+{
+    value.store(value.load(std::memory_order_relaxed) + delta,
+        std::memory_order_relaxed);
+}
+
+std::atomic<std::uint64_t> nextId{1};
+
+struct Description
+{
+    char const* name;
+    char const* help;
+};
+
+Description constexpr counters[] = {
+    {"adaptiv_accepts_total", "Connections accepted."},
+    {"adaptiv_http_response_bytes_total", "HTTP bytes written, headers included."},
+    {"adaptiv_websocket_sent_bytes_total", "Websocket payload bytes written."},
+    {"adaptiv_websocket_coalesced_messages_total",
+        "Publications replaced by a newer one within a subscriber's rate limit."},
+    {"adaptiv_run_log_bytes_total", "Bytes appended to the run logs."},
+    {"adaptiv_upload_bytes_total", "Bytes of uploaded files written to disk."},
+};
+
+Description constexpr gauges[] = {
+    {"adaptiv_http_sessions", "Open HTTP connections."},
+    {"adaptiv_websocket_sessions", "Open websocket connections."},
+    {"adaptiv_websocket_queued_messages",
+        "Messages waiting in the websocket write queues."},
+};
+
+Description constexpr histograms[] = {
+    {"adaptiv_http_handler_seconds", "Time spent producing an HTTP response."},
+    {"adaptiv_broadcast_fanout_seconds",
+        "Time from a broadcast to the last session enqueue."},
+};
+
+void header(std::ostream& out, Description const& metric, char const* type)
+{
+    out << "# HELP " << metric.name << ' ' << metric.help << '\n'
+        << "# TYPE " << metric.name << ' ' << type << '\n';
+}
+
+} // namespace
+
+std::size_t LatencyHistogram::bucket(std::uint64_t value) noexcept
+{
+    if (value < subBuckets) {
+        return static_cast<std::size_t>(value);
+    }
+    auto const msb = 63 - static_cast<std::size_t>(__builtin_clzll(value));
+    auto const shift = msb - (subBits - 1);
+    return shift * (subBuckets / 2) + static_cast<std::size_t>(value >> shift);
+}
+
+std::uint64_t LatencyHistogram::lowest(std::size_t bucket) noexcept
+{
+    if (bucket < subBuckets) {
+        return bucket;
+    }
+    auto const shift = bucket / (subBuckets / 2) - 1;
+    auto const mantissa = bucket - shift * (subBuckets / 2);
+    return static_cast<std::uint64_t>(mantissa) << shift;
+}
+
+std::uint64_t LatencyHistogram::quantile(Counts const& counts, double q) noexcept
+{
+    std::uint64_t total = 0;
+    for (auto count : counts) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    auto const rank = std::max<std::uint64_t>(
+        1, static_cast<std::uint64_t>(q * static_cast<double>(total) + 0.5));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            auto const low = lowest(i);
+            auto const high = i + 1 < counts.size() ? lowest(i + 1) : low + 1;
+            return low + (high - 1 - low) / 2;
+        }
+    }
+    return 0;
+}
+
+void LatencyHistogram::record(std::uint64_t value) noexcept
+{
+    bump(counts_[bucket(value)], std::uint64_t{1});
+    bump(sum_, value);
+}
+
+void LatencyHistogram::mergeInto(Counts& counts, std::uint64_t& sum) const noexcept
+{
+    for (std::size_t i = 0; i < bucketCount; ++i) {
+        counts[i] += counts_[i].load(std::memory_order_relaxed);
+    }
+    sum += sum_.load(std::memory_order_relaxed);
+}
+
+Metrics::Metrics()
+    : id_(nextId.fetch_add(1, std::memory_order_relaxed))
+{ }
+
+void Metrics::add(Counter counter, std::uint64_t value)
+{
+    bump(local().counters[static_cast<std::size_t>(counter)], value);
+}
+
+void Metrics::add(Gauge gauge, std::int64_t delta)
+{
+    bump(local().gauges[static_cast<std::size_t>(gauge)], delta);
+}
+
+void Metrics::record(Histogram histogram, std::chrono::nanoseconds elapsed)
+{
+    local().histograms[static_cast<std::size_t>(histogram)].record(
+        static_cast<std::uint64_t>(std::max<std::int64_t>(elapsed.count(), 0)));
+}
+
+void Metrics::countResponse(unsigned status)
+{
+    status = std::min(std::max(status, minStatus), maxStatus);
+    bump(local().responses[status - minStatus], std::uint64_t{1});
+}
+
+Metrics::Slot& Metrics::local()
+{
+    // Most threads only ever record into a single instance
+    thread_local std::uint64_t cachedId = 0;
+    thread_local Slot* cachedSlot = nullptr;
+    if (cachedId == id_) {
+        return *cachedSlot;
+    }
+
+    auto const thread = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = std::find_if(slots_.begin(), slots_.end(),
+        [thread](auto const& slot){ return slot->owner == thread; });
+    if (found == slots_.end()) {
+        slots_.push_back(std::make_unique<Slot>());
+        slots_.back()->owner = thread;
+        found = std::prev(slots_.end());
+    }
+
+    cachedId = id_;
+    cachedSlot = found->get();
+    return *cachedSlot;
+}
+
+void Metrics::write(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (std::size_t i = 0; i < std::size(counters); ++i) {
+        std::uint64_t total = 0;
+        for (auto const& slot : slots_) {
+            total += slot->counters[i].load(std::memory_order_relaxed);
+        }
+        header(out, counters[i], "counter");
+        out << counters[i].name << ' ' << total << '\n';
+    }
+
+    header(out, {"adaptiv_http_responses_total", "HTTP responses by status."},
+        "counter");
+    for (unsigned status = minStatus; status <= maxStatus; ++status) {
+        std::uint64_t total = 0;
+        for (auto const& slot : slots_) {
+            total += slot->responses[status - minStatus].load(
+                std::memory_order_relaxed);
+        }
+        if (total > 0) {
+            out << "adaptiv_http_responses_total{code=\"" << status << "\"} "
+                << total << '\n';
+        }
+    }
+
+    for (std::size_t i = 0; i < std::size(gauges); ++i) {
+        std::int64_t total = 0;
+        for (auto const& slot : slots_) {
+            total += slot->gauges[i].load(std::memory_order_relaxed);
+        }
+        header(out, gauges[i], "gauge");
+        out << gauges[i].name << ' ' << total << '\n';
+    }
+
+    for (std::size_t i = 0; i < std::size(histograms); ++i) {
+        LatencyHistogram::Counts counts{};
+        std::uint64_t sum = 0;
+        for (auto const& slot : slots_) {
+            slot->histograms[i].mergeInto(counts, sum);
+        }
+        std::uint64_t total = 0;
+        for (auto count : counts) {
+            total += count;
+        }
+
+        auto const name = histograms[i].name;
+        header(out, histograms[i], "summary");
+        for (auto q : {0.5, 0.99, 0.999}) {
+            out << name << "{quantile=\"" << q << "\"} "
+                << static_cast<double>(LatencyHistogram::quantile(counts, q)) / 1e9
+                << '\n';
+        }
+        out << name << "_sum " << static_cast<double>(sum) / 1e9 << '\n'
+            << name << "_count " << total << '\n';
+    }
+}
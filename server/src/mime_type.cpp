@@ -0,0 +1,77 @@
+#include <cstdint>
+
+#include "mime_type.hpp"
+
+namespace
+{
+
+// Pack an extension (dot included) of up to 8 characters into an integer,
+// lowercased, so the lookup is a switch over constants. Longer ones pack to 0.
+constexpr std::uint64_t pack(char const* extension, std::size_t size) noexcept
+{
+    if (size > 8) {
+        return 0;
+    }
+    std::uint64_t result = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        auto c = extension[i];
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+        result = (result << 8) | static_cast<unsigned char>(c);
+    }
+    return result;
+}
+
+constexpr std::uint64_t operator""_ext(char const* extension, std::size_t size)
+{
+    return pack(extension, size);
+}
+
+} // namespace
+
+beast::string_view mimeType(beast::string_view path)
+{
+    auto const extension = [&path]
+    {
+        auto const pos = path.rfind(".");
+        if (pos == beast::string_view::npos) {
+            return beast::string_view{};
+        }
+        return path.substr(pos);
+    }();
+
+    switch (pack(extension.data(), extension.size())) {
+    case ".htm"_ext:  return "text/html";
+    case ".html"_ext: return "text/html";
+    case ".php"_ext:  return "text/html";
+    case ".css"_ext:  return "text/css";
+    case ".txt"_ext:  return "text/plain";
+    case ".js"_ext:   return "application/javascript";
+    case ".json"_ext: return "application/json";
+    case ".xml"_ext:  return "application/xml";
+    case ".swf"_ext:  return "application/x-shockwave-flash";
+    case ".flv"_ext:  return "video/x-flv";
+    case ".png"_ext:  return "image/png";
+    case ".jpe"_ext:  return "image/jpeg";
+    case ".jpeg"_ext: return "image/jpeg";
+    case ".jpg"_ext:  return "image/jpeg";
+    case ".gif"_ext:  return "image/gif";
+    case ".bmp"_ext:  return "image/bmp";
+    case ".ico"_ext:  return "image/vnd.microsoft.icon";
+    case ".tiff"_ext: return "image/tiff";
+    case ".tif"_ext:  return "image/tiff";
+    case ".svg"_ext:  return "image/svg+xml";
+    case ".svgz"_ext: return "image/svg+xml";
+    default:          return "application/text";
+    }
+}
+
+bool isCompressible(beast::string_view mime)
+{
+    return mime.starts_with("text/") ||
+           mime == "application/javascript" ||
+           mime == "application/json" ||
+           mime == "application/xml" ||
+           mime == "image/svg+xml";
+}
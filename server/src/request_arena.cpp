@@ -0,0 +1,51 @@
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+
+#include "request_arena.hpp"
+
+RequestArena::RequestArena(std::size_t initialSize)
+    : initialSize_(initialSize)
+{ }
+
+void* RequestArena::allocate(std::size_t size, std::size_t alignment)
+{
+    while (current_ < blocks_.size()) {
+        auto& block = blocks_[current_];
+        auto const address = reinterpret_cast<std::uintptr_t>(block.data.get());
+        auto const offset = (address + used_ + alignment - 1) / alignment *
+                            alignment - address;
+        if (offset + size <= block.size) {
+            used_ = offset + size;
+            return block.data.get() + offset;
+        }
+        ++current_;
+        used_ = 0;
+    }
+
+    // Every block is full: each new one at least doubles the capacity
+    auto const blockSize = std::max(
+        {initialSize_, capacity(), size + alignment});
+    blocks_.push_back(
+        {std::unique_ptr<std::byte[]>(new std::byte[blockSize]), blockSize});
+    current_ = blocks_.size() - 1;
+    used_ = 0;
+    return allocate(size, alignment);
+}
+
+void RequestArena::reset()
+{
+    if (blocks_.size() > 1) {
+        auto const size = capacity();
+        blocks_.clear();
+        blocks_.push_back({std::unique_ptr<std::byte[]>(new std::byte[size]), size});
+    }
+    current_ = 0;
+    used_ = 0;
+}
+
+std::size_t RequestArena::capacity() const noexcept
+{
+    return std::accumulate(blocks_.begin(), blocks_.end(), std::size_t{0},
+        [](std::size_t sum, Block const& block) { return sum + block.size; });
+}
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <string_view>
+
+#include "residual_history.hpp"
+
+namespace
+{
+
+// The columns start small, so that short runs stay cheap
+constexpr std::size_t initialEntries = 64;
+
+} // namespace
+
+ResidualHistory::ResidualHistory(std::size_t capacity)
+    : capacity_(capacity)
+{ }
+
+void ResidualHistory::append(residual::Frame const& frame)
+{
+    if (capacity_ == 0) {
+        return;
+    }
+
+    if (iterations_.size() == capacity_) {
+        iterations_[first_] = frame.iteration;
+        for (std::size_t i = 0; i < residual::count; ++i) {
+            residuals_[i][first_] = static_cast<float>(frame.residuals[i]);
+        }
+        first_ = first_ + 1 == capacity_ ? 0 : first_ + 1;
+        return;
+    }
+
+    // Grow by hand: doubling past the capacity would waste up to half of it
+    if (iterations_.size() == iterations_.capacity()) {
+        auto const entries = std::min(
+            capacity_, std::max(initialEntries, 2 * iterations_.size()));
+        iterations_.reserve(entries);
+        for (auto& column : residuals_) {
+            column.reserve(entries);
+        }
+    }
+    iterations_.push_back(frame.iteration);
+    for (std::size_t i = 0; i < residual::count; ++i) {
+        residuals_[i].push_back(static_cast<float>(frame.residuals[i]));
+    }
+}
+
+void ResidualHistory::clear()
+{
+    first_ = 0;
+    std::vector<std::uint32_t>().swap(iterations_);
+    for (auto& column : residuals_) {
+        std::vector<float>().swap(column);
+    }
+}
+
+std::vector<std::size_t> ResidualHistory::select(std::size_t points) const
+{
+    auto const n = size();
+    std::vector<std::size_t> result;
+    if (points == 0 || points >= n) {
+        result.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            result.push_back(at(i));
+        }
+        return result;
+    }
+    if (points < 3) {
+        // No bucket in between: the first if there is room for it, then
+        // the latest
+        if (points == 2) {
+            result.push_back(at(0));
+        }
+        result.push_back(at(n - 1));
+        return result;
+    }
+
+    // Residuals span orders of magnitude, so they are compared as plotted,
+    // oldest first
+    std::vector<float> logs(residual::count * n);
+    for (std::size_t c = 0; c < residual::count; ++c) {
+        for (std::size_t i = 0; i < n; ++i) {
+            logs[c * n + i] = std::log10(std::max(residuals_[c][at(i)], 1e-30f));
+        }
+    }
+    auto const y = [&logs, n](std::size_t column, std::size_t i)
+    {
+        return static_cast<double>(logs[column * n + i]);
+    };
+    auto const x = [this](std::size_t i)
+    {
+        return static_cast<double>(iterations_[at(i)]);
+    };
+
+    // Buckets of the iterations between the first and the last, at least
+    // one iteration wide
+    auto const bucket = [n, points](std::size_t b)
+    {
+        return b * (n - 2) / (points - 2) + 1;
+    };
+
+    result.reserve(points);
+    result.push_back(at(0));
+    std::size_t kept = 0;
+    for (std::size_t b = 0; b + 2 < points; ++b) {
+        // The average of the next bucket, the last point for the last one
+        auto const next = bucket(b + 1);
+        auto const last = next < n - 1 ? bucket(b + 2) : n;
+        std::array<double, residual::count> average{};
+        double averageX = 0;
+        for (auto i = next; i < last; ++i) {
+            averageX += x(i);
+            for (std::size_t c = 0; c < residual::count; ++c) {
+                average[c] += y(c, i);
+            }
+        }
+        auto const count = static_cast<double>(last - next);
+        averageX /= count;
+        for (auto& value : average) {
+            value /= count;
+        }
+
+        // The point of this bucket making the largest triangle, summed over
+        // the residuals
+        auto best = bucket(b);
+        double largest = -1;
+        for (auto i = bucket(b); i < next; ++i) {
+            double area = 0;
+            for (std::size_t c = 0; c < residual::count; ++c) {
+                area += std::abs(
+                    (x(kept) - averageX) * (y(c, i) - y(c, kept)) -
+                    (x(kept) - x(i)) * (average[c] - y(c, kept)));
+            }
+            if (area > largest) {
+                largest = area;
+                best = i;
+            }
+        }
+        result.push_back(at(best));
+        kept = best;
+    }
+    result.push_back(at(n - 1));
+    return result;
+}
+
+std::string ResidualHistory::snapshot(
+    std::uint64_t run,
+    std::uint16_t flags,
+    std::size_t points) const
+{
+    using namespace residual::detail;
+
+    auto const selected = select(points);
+    auto const n = selected.size();
+    std::string message(residual::headerSize + 8 + n * entrySize, '\0');
+    auto* out = message.data();
+
+    out[0] = static_cast<char>(residual::version);
+    out[1] = static_cast<char>(residual::Encoding::snapshot);
+    store(out + 2, flags);
+    store(out + 4, n > 0 ? iterations_[selected.back()] : std::uint32_t{0});
+    store(out + 8, run);
+    store(out + 16, static_cast<std::uint32_t>(n));
+    out += residual::headerSize + 8;
+
+    for (auto const i : selected) {
+        store(out, iterations_[i]);
+        out += 4;
+    }
+    for (auto const& column : residuals_) {
+        for (auto const i : selected) {
+            store(out, bits(column[i]));
+            out += 4;
+        }
+    }
+    return message;
+}
+
+std::string ResidualHistory::json(
+    std::uint64_t run,
+    bool finished,
+    std::size_t points) const
+{
+    auto const selected = select(points);
+    std::string message;
+    message.reserve(256 + selected.size() * (12 + residual::count * 16));
+
+    auto const number = [&message](auto value)
+    {
+        char text[32];
+        auto const end = std::to_chars(text, text + sizeof(text), value).ptr;
+        message.append(text, static_cast<std::size_t>(end - text));
+    };
+    auto const array = [&](auto const& column)
+    {
+        message += '[';
+        for (auto const i : selected) {
+            if (i != selected.front()) {
+                message += ',';
+            }
+            number(column[i]);
+        }
+        message += ']';
+    };
+
+    static constexpr std::string_view keys[residual::count] = {
+        R"(,"residuals":{"momentum":{"x":)", R"(,"y":)", R"(,"z":)",
+        R"(},"energy":)", R"(,"tke":)", R"(,"tdr":)"};
+
+    message += R"({"snapshot":{"run":)";
+    number(run);
+    // A string, as in the frames and in the messages of the client solver
+    message += finished ? R"(,"finished":"true")" : R"(,"finished":"false")";
+    message += R"(,"iterations":)";
+    array(iterations_);
+    for (std::size_t i = 0; i < residual::count; ++i) {
+        message += keys[i];
+        array(residuals_[i]);
+    }
+    message += "}}}";
+    return message;
+}
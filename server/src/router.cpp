@@ -0,0 +1,121 @@
+#include "router.hpp"
+
+namespace
+{
+
+bool isDigits(std::string_view segment) noexcept
+{
+    if (segment.empty() || segment.size() > 19) {
+        return false;
+    }
+    for (auto const c : segment) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::uint64_t toNumber(std::string_view digits) noexcept
+{
+    std::uint64_t value = 0;
+    for (auto const c : digits) {
+        value = value * 10 + static_cast<std::uint64_t>(c - '0');
+    }
+    return value;
+}
+
+// Whether the path has the segments of the pattern, {id} matching digits.
+// Guards against targets whose shape merely collides with a pattern.
+bool matches(std::string_view pattern, std::string_view path) noexcept
+{
+    while (!pattern.empty() && !path.empty()) {
+        if (pattern.substr(0, routes::parameter.size()) == routes::parameter) {
+            auto const end = path.find('/');
+            if (!isDigits(path.substr(0, end))) {
+                return false;
+            }
+            pattern.remove_prefix(routes::parameter.size());
+            path.remove_prefix(end == std::string_view::npos ? path.size() : end);
+            continue;
+        }
+        if (pattern.front() != path.front()) {
+            return false;
+        }
+        pattern.remove_prefix(1);
+        path.remove_prefix(1);
+    }
+    return pattern.empty() && path.empty();
+}
+
+// Whether a segment is usable as a file name as it is: no separator, no
+// hidden or temporary file, nothing a shell or URL would need to escape
+bool isFileName(std::string_view segment) noexcept
+{
+    if (segment.empty() || segment.size() > 255 || segment.front() == '.') {
+        return false;
+    }
+    for (auto const c : segment) {
+        auto const valid = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                           (c >= 'A' && c <= 'Z') || c == '.' || c == '-' ||
+                           c == '_';
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+RouteMatch route(beast::string_view target) noexcept
+{
+    RouteMatch match;
+    std::string_view path(target.data(), target.size());
+    path = path.substr(0, path.find('?'));
+    auto const api = path.substr(0, routes::prefix.size()) == routes::prefix &&
+        (path.size() == routes::prefix.size() || path[routes::prefix.size()] == '/');
+    if (!api) {
+        return match;
+    }
+
+    for (auto const& upload : routes::uploads) {
+        if (path.substr(0, upload.pattern.size()) == upload.pattern) {
+            auto const name = path.substr(upload.pattern.size());
+            match.route = Route::apiNotFound;
+            if (isFileName(name)) {
+                match.route = upload.route;
+                match.name = name;
+            }
+            return match;
+        }
+    }
+
+    // Hash the shape of the path, segment by segment
+    auto h = routes::hashSeed;
+    std::size_t ids = 0;
+    for (std::size_t begin = 0; begin < path.size();) {
+        auto end = path.find('/', begin + 1);
+        if (end == std::string_view::npos) {
+            end = path.size();
+        }
+        // Segments keep their leading slash
+        auto const segment = path.substr(begin + 1, end - begin - 1);
+        h = routes::hash(h, "/");
+        if (isDigits(segment) && ids < match.ids.size()) {
+            match.ids[ids++] = toNumber(segment);
+            h = routes::hash(h, routes::parameter);
+        } else {
+            h = routes::hash(h, segment);
+        }
+        begin = end;
+    }
+
+    auto const& slot = routes::slotTable[h % routes::slotCount];
+    if (slot.entry && slot.hash == h && matches(slot.entry->pattern, path)) {
+        match.route = slot.entry->route;
+    } else {
+        match.route = Route::apiNotFound;
+    }
+    return match;
+}
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "run_log.hpp"
+#include "logger.hpp"
+
+struct RunLog::Segment
+{
+    int fd = -1;
+    char* data = nullptr;
+    std::size_t capacity = 0;
+    /// Bytes of complete lines, published by the writer
+    std::atomic<std::size_t> size{0};
+
+    ~Segment()
+    {
+        if (data) {
+            ::munmap(data, capacity);
+        }
+        release();
+    }
+
+    /// Nothing more is written to the file; its lines stay mapped
+    void release() noexcept
+    {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
+
+namespace
+{
+
+error_code lastError()
+{
+    return error_code(errno, boost::system::system_category());
+}
+
+// The iteration of a line, or fallback if it has none
+std::uint32_t lineIteration(std::string_view line, std::uint32_t fallback)
+{
+    // Numbers or strings of digits, as RANS::toJson writes them
+    constexpr std::string_view key = "\"iteration\":";
+    auto position = line.find(key);
+    if (position == std::string_view::npos) {
+        return fallback;
+    }
+    position += key.size();
+    if (position < line.size() && line[position] == '"') {
+        ++position;
+    }
+    std::uint32_t iteration = 0;
+    auto const [end, ec] = std::from_chars(
+        line.data() + position, line.data() + line.size(), iteration);
+    return ec == std::errc{} ? iteration : fallback;
+}
+
+/**
+ * Offset of the first line of a segment from offset on whose iteration is
+ * at least bound, or above it, or the end of the lines
+ * @param iteration Of the line before offset, for the lines without one
+ */
+std::size_t seek(
+    char const* data,
+    std::size_t size,
+    std::size_t offset,
+    std::uint32_t iteration,
+    std::uint32_t bound,
+    bool above)
+{
+    while (offset < size) {
+        auto line = std::string_view(data + offset, size - offset);
+        line = line.substr(0, line.find('\n') + 1);
+        iteration = lineIteration(line, iteration);
+        if (above ? iteration > bound : iteration >= bound) {
+            return offset;
+        }
+        offset += line.size();
+    }
+    return size;
+}
+
+} // namespace
+
+RunLog::RunLog(std::string path, std::size_t segmentSize)
+    : path_(std::move(path))
+    , segmentSize_(segmentSize)
+{ }
+
+RunLog::~RunLog()
+{
+    close();
+}
+
+std::size_t RunLog::append(std::string_view message)
+{
+    if (failed_ || closed_) {
+        return 0;
+    }
+
+    // The line break a JSON writer ends with is the line's own
+    while (!message.empty() &&
+           (message.back() == '\n' || message.back() == '\r' || message.back() == ' ')) {
+        message.remove_suffix(1);
+    }
+
+    // JSON has no control characters but its white space, so a message with
+    // any is binary, such as a frame that did not decode: it is not a line
+    line_.assign(message.data(), message.size());
+    for (auto& c : line_) {
+        if (c == '\n' || c == '\r') {
+            c = ' ';
+        } else if (static_cast<unsigned char>(c) < ' ' && c != '\t') {
+            return 0;
+        }
+    }
+    line_ += '\n';
+    auto const lineSize = line_.size();
+
+    auto* segment = segments_.empty() ? nullptr : segments_.back().get();
+    auto offset = segment ? segment->size.load(std::memory_order_relaxed) : 0;
+    if (!segment || offset + lineSize > segment->capacity) {
+        if (!rotate(lineSize)) {
+            return 0;
+        }
+        segment = segments_.back().get();
+        offset = 0;
+    }
+
+    // Written rather than copied into the mapping, so that the file only
+    // ever holds whole lines, and a torn one at worst, whenever the server
+    // stops; the mapping shows the same pages
+    for (std::size_t written = 0; written < lineSize;) {
+        auto const result = ::pwrite(segment->fd, line_.data() + written,
+            lineSize - written, static_cast<off_t>(offset + written));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            failed_ = true;
+            logger().write(LogLevel::error, "run log", lastError());
+            return 0;
+        }
+        written += static_cast<std::size_t>(result);
+    }
+    segment->size.store(offset + lineSize, std::memory_order_release);
+    size_.fetch_add(lineSize, std::memory_order_relaxed);
+
+    auto const line = std::string_view(line_.data(), lineSize - 1);
+
+    iteration_ = lineIteration(line, iteration_);
+    if (offset == 0 || lines_ % indexStride == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index_.push_back(Entry{iteration_, segments_.size() - 1, offset});
+    }
+    ++lines_;
+    return lineSize;
+}
+
+bool RunLog::rotate(std::size_t lineSize)
+{
+    if (lineSize > segmentSize_) {
+        logger().write(LogLevel::warning, "run log", "line larger than a segment");
+        return false;
+    }
+
+    auto const fail = [this]
+    {
+        failed_ = true;
+        logger().write(LogLevel::error, "run log", lastError());
+        return false;
+    };
+
+    auto segment = std::make_shared<Segment>();
+    auto const path =
+        path_ + '.' + std::to_string(segments_.size()) + ".ndjson";
+    segment->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (segment->fd < 0) {
+        return fail();
+    }
+    // Past the end of the file for now: only the lines written are read
+    auto const data = ::mmap(
+        nullptr, segmentSize_, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (data == MAP_FAILED) {
+        return fail();
+    }
+    segment->data = static_cast<char*>(data);
+    segment->capacity = segmentSize_;
+
+    if (!segments_.empty()) {
+        segments_.back()->release();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    segments_.push_back(std::move(segment));
+    return true;
+}
+
+void RunLog::close()
+{
+    closed_ = true;
+    if (!segments_.empty()) {
+        segments_.back()->release();
+    }
+}
+
+RunLog::Range RunLog::read(std::uint32_t first, std::uint32_t last) const
+{
+    Range range;
+    if (first > last) {
+        return range;
+    }
+
+    // The iterations of a run only grow, so the lines of the range start
+    // after the last entry before first, and end within the stride of the
+    // last entry up to last
+    Entry start;
+    Entry end;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const from = std::lower_bound(index_.begin(), index_.end(), first,
+            [](Entry const& entry, std::uint32_t iteration)
+            {
+                return entry.iteration < iteration;
+            });
+        auto const to = std::upper_bound(index_.begin(), index_.end(), last,
+            [](std::uint32_t iteration, Entry const& entry)
+            {
+                return iteration < entry.iteration;
+            });
+        if (to == index_.begin()) {
+            return range;
+        }
+        start = from == index_.begin() ? *from : *std::prev(from);
+        end = *std::prev(to);
+        range.segments.assign(
+            segments_.begin() + static_cast<std::ptrdiff_t>(start.segment),
+            segments_.begin() + static_cast<std::ptrdiff_t>(end.segment) + 1);
+    }
+
+    auto const size = [](Segment const& segment)
+    {
+        return segment.size.load(std::memory_order_acquire);
+    };
+    auto const& tail = *range.segments.back();
+    auto const endOffset = seek(
+        tail.data, size(tail), end.offset, end.iteration, last, true);
+
+    for (std::size_t i = 0; i < range.segments.size(); ++i) {
+        auto const& segment = *range.segments[i];
+        auto const lines = i + 1 == range.segments.size() ? endOffset : size(segment);
+        auto const from = i == 0
+            ? seek(segment.data, lines, start.offset, start.iteration, first, false)
+            : 0;
+        if (from < lines) {
+            range.buffers.emplace_back(segment.data + from, lines - from);
+            range.size += lines - from;
+        }
+    }
+    return range;
+}
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <filesystem>
+#include <utility>
+
+#include "run_registry.hpp"
+
+RunRegistry::RunRegistry(
+    std::size_t limit,
+    std::size_t historyLength,
+    std::size_t historyMemory,
+    std::string logDirectory,
+    std::size_t logSegment)
+    : limit_(std::max<std::size_t>(limit, 1))
+    // A single run never holds more than the whole budget
+    , historyLength_(
+          std::min(historyLength, historyMemory / ResidualHistory::entrySize))
+    , historyMemory_(historyMemory)
+    , logDirectory_(std::move(logDirectory))
+    , logSegment_(logSegment)
+{
+    if (!logDirectory_.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(logDirectory_, ec);
+    }
+}
+
+std::uint64_t RunRegistry::open()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (runs_.size() == limit_) {
+        // Forget the oldest run that is over, or else the oldest one
+        auto const over = std::find_if(runs_.begin(), runs_.end(),
+            [](Run const& run){ return run.finished || !run.live; });
+        auto const forgotten = over != runs_.end() ? over : runs_.begin();
+        historyBytes_ -= forgotten->history.bytes();
+        runs_.erase(forgotten);
+    }
+
+    Run run;
+    run.id = nextId_++;
+    run.started = std::chrono::system_clock::now();
+    run.history = ResidualHistory(historyLength_);
+    if (!logDirectory_.empty()) {
+        // Ids start over with the server, the start time tells runs apart
+        auto const started = std::chrono::duration_cast<std::chrono::milliseconds>(
+            run.started.time_since_epoch()).count();
+        run.log = std::make_shared<RunLog>(
+            logDirectory_ + "/run-" + std::to_string(started) + '-' +
+                std::to_string(run.id),
+            logSegment_);
+    }
+    runs_.push_back(std::move(run));
+    return runs_.back().id;
+}
+
+void RunRegistry::record(
+    std::uint64_t id,
+    std::shared_ptr<std::string const> message,
+    residual::Frame const* frame)
+{
+    // The client solver writes "finished":"true" with its last iteration
+    auto const finished =
+        message->find("\"finished\":\"true\"") != std::string::npos ||
+        message->find("\"finished\":true") != std::string::npos;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto const run = find(id)) {
+        ++run->messages;
+        run->finished = run->finished || finished;
+        run->latest = std::move(message);
+
+        if (frame) {
+            auto const before = run->history.bytes();
+            run->history.append(*frame);
+            auto const after = run->history.bytes();
+            if (after != before) {
+                historyBytes_ += after - before;
+                trimHistories(*run);
+            }
+        }
+    }
+}
+
+std::string RunRegistry::snapshot(
+    std::uint64_t id,
+    bool binary,
+    std::size_t points) const
+{
+    ResidualHistory history;
+    bool finished = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const run = find(id);
+        if (!run || run->history.empty()) {
+            return {};
+        }
+        history = run->history;
+        finished = run->finished;
+    }
+    return binary
+        ? history.snapshot(id, finished ? residual::Flags::finished : 0, points)
+        : history.json(id, finished, points);
+}
+
+std::size_t RunRegistry::historyBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return historyBytes_;
+}
+
+std::shared_ptr<RunLog> RunRegistry::log(std::uint64_t id) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const run = find(id);
+    return run ? run->log : nullptr;
+}
+
+void RunRegistry::trimHistories(Run const& keep)
+{
+    auto const victim = [this, &keep](bool over)
+    {
+        return std::find_if(runs_.begin(), runs_.end(),
+            [&keep, over](Run const& run)
+            {
+                return &run != &keep && run.history.bytes() > 0 &&
+                       (!over || run.finished || !run.live);
+            });
+    };
+
+    while (historyBytes_ > historyMemory_) {
+        // The oldest history of a run that is over, or else the oldest one
+        auto run = victim(true);
+        if (run == runs_.end()) {
+            run = victim(false);
+        }
+        if (run == runs_.end()) {
+            return;
+        }
+        historyBytes_ -= run->history.bytes();
+        run->history.clear();
+    }
+}
+
+void RunRegistry::close(std::uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto const run = find(id)) {
+        run->live = false;
+    }
+}
+
+std::size_t RunRegistry::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return runs_.size();
+}
+
+RunRegistry::Run const* RunRegistry::find(std::uint64_t id) const
+{
+    // Ids only grow, but evictions leave gaps
+    auto const found = std::lower_bound(runs_.begin(), runs_.end(), id,
+        [](Run const& run, std::uint64_t id){ return run.id < id; });
+    return found != runs_.end() && found->id == id ? &*found : nullptr;
+}
+
+RunRegistry::Run* RunRegistry::find(std::uint64_t id)
+{
+    return const_cast<Run*>(std::as_const(*this).find(id));
+}
@@ -0,0 +1,124 @@
+#include <string>
+#include <algorithm>
+#include <utility>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "server.hpp"
+#include "listener.hpp"
+#include "shared_state.hpp"
+#include "logger.hpp"
+
+namespace
+{
+
+// Pin the calling thread to a CPU. Only supported on Linux.
+void pinThread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        logger().write(LogLevel::warning, "affinity",
+            "unable to pin thread to cpu " + std::to_string(cpu));
+    }
+#else
+    logger().write(LogLevel::warning, "affinity", "not supported on this platform");
+#endif
+}
+
+} // namespace
+
+Server::Server(ServerConfig config, std::shared_ptr<SharedState> const& state)
+    : config_(std::move(config))
+    , state_(state)
+{
+    config_.threads = std::max<std::size_t>(config_.threads, 1);
+
+    tcp::endpoint endpoint{config_.address, config_.port};
+
+    if (!config_.reusePort) {
+        // One context shared by the pool, with a strand per thread
+        contexts_.push_back(std::make_unique<net::io_context>(
+            static_cast<int>(config_.threads)));
+        auto const firstShard = state_->shardCount();
+        for (std::size_t i = 0; i < config_.threads; ++i) {
+            state_->addShard(net::make_strand(*contexts_.front()));
+        }
+        listeners_.push_back(std::make_shared<Listener>(
+            *contexts_.front(), endpoint, state_,
+            false, firstShard, config_.threads));
+        return;
+    }
+
+    // One single-threaded context and listener per shard. The strand is
+    // never contended, it only gives the sessions the same executor type.
+    for (std::size_t i = 0; i < config_.threads; ++i) {
+        contexts_.push_back(std::make_unique<net::io_context>(1));
+        auto const shard = state_->addShard(net::make_strand(*contexts_.back()));
+        listeners_.push_back(std::make_shared<Listener>(
+            *contexts_.back(), endpoint, state_, true, shard, 1));
+
+        // Every shard must bind the port the first one got
+        if (endpoint.port() == 0) {
+            endpoint.port(listeners_.front()->localEndpoint().port());
+        }
+    }
+}
+
+Server::~Server()
+{
+    stop();
+    join();
+
+    // The shard executors must not outlive the contexts
+    listeners_.clear();
+    state_->removeShards();
+}
+
+tcp::endpoint Server::localEndpoint() const
+{
+    return listeners_.front()->localEndpoint();
+}
+
+void Server::runThread(std::size_t index)
+{
+    if (!config_.affinity.empty()) {
+        pinThread(config_.affinity[index % config_.affinity.size()]);
+    }
+    contexts_[index % contexts_.size()]->run();
+}
+
+void Server::start()
+{
+    for (auto const& listener : listeners_) {
+        listener->run();
+    }
+
+    threads_.reserve(config_.threads);
+    for (std::size_t i = 0; i < config_.threads; ++i) {
+        threads_.emplace_back([this, i]{ runThread(i); });
+    }
+}
+
+void Server::stop()
+{
+    // Causes run() to return immediately on every thread, eventually
+    // destroying the io_contexts and any remaining handlers in them.
+    for (auto const& context : contexts_) {
+        context->stop();
+    }
+}
+
+void Server::join()
+{
+    for (auto& thread : threads_) {
+        if (thread.joinable() && thread.get_id() != std::this_thread::get_id()) {
+            thread.join();
+        }
+    }
+}
@@ -1,39 +1,425 @@
 #include <vector>
+#include <algorithm>
 #include <memory>
-#include <iostream>
-
-#include <boost/date_time.hpp>
+#include <ostream>
 
 #include "shared_state.hpp"
 #include "websocket_session.hpp"
+#include "logger.hpp"
+
+namespace
+{
+
+using SessionList = std::vector<
+    std::pair<WebSocketSession*, std::weak_ptr<WebSocketSession>>>;
+
+// Replace a published list by a copy without a session
+void removeSession(
+    std::shared_ptr<SessionList const>& list,
+    WebSocketSession* session)
+{
+    if (!list) {
+        return;
+    }
+    auto sessions = std::make_shared<SessionList>();
+    sessions->reserve(list->size());
+    for (auto const& entry : *list) {
+        if (entry.first != session) {
+            sessions->push_back(entry);
+        }
+    }
+    list = sessions->empty() ? nullptr : std::move(sessions);
+}
 
-SharedState::SharedState(std::string documentRoot)
-    : documentRoot_(std::move(documentRoot))
+} // namespace
+
+SharedState::SharedState(ServerConfig config)
+    : config_(std::move(config))
+    , fileCache_(
+        config_.cacheSize,
+        config_.cacheEntrySize,
+        config_.cacheRevalidate,
+        config_.compress)
+    , runs_(
+        config_.runLimit,
+        config_.historyLength,
+        config_.historyMemory,
+        config_.runLogDirectory,
+        config_.runLogSegment)
+    , metrics_(std::make_shared<Metrics>())
+    , fanout_(std::make_shared<Fanout>())
 { }
 
-void SharedState::join(WebSocketSession* session)
+std::size_t SharedState::addShard(ShardExecutor executor)
 {
-    sessions_.insert(session);
+    auto shard = std::make_unique<Shard>(std::move(executor));
+    shard->sessions = std::make_shared<SessionList const>();
+    shard->topics = std::make_shared<Topics const>();
+    shards_.push_back(std::move(shard));
+    return shards_.size() - 1;
+}
+
+void SharedState::removeShards()
+{
+    shards_.clear();
+}
+
+void SharedState::join(std::shared_ptr<WebSocketSession> const& session)
+{
+    auto& shard = *shards_[session->shard()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto sessions = std::make_shared<SessionList>(*shard.sessions);
+    sessions->emplace_back(session.get(), session);
+    std::atomic_store(
+        &shard.sessions, std::shared_ptr<SessionList const>(sessions));
 }
 
 void SharedState::leave(WebSocketSession* session)
 {
-    sessions_.erase(session);
+    // The server is shutting down
+    if (session->shard() >= shards_.size()) {
+        return;
+    }
+
+    auto& shard = *shards_[session->shard()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    // Only the lists of its own topics are rebuilt
+    if (!session->topics().empty()) {
+        auto topics = std::make_shared<Topics>(*shard.topics);
+        for (auto const& topic : session->topics()) {
+            removeSession(topics->at(topic), session);
+        }
+        topics->prune();
+        std::atomic_store(
+            &shard.topics, std::shared_ptr<Topics const>(std::move(topics)));
+    }
+
+    // Sessions that failed the handshake never joined
+    auto const joined = std::any_of(
+        shard.sessions->begin(), shard.sessions->end(),
+        [session](auto const& entry){ return entry.first == session; });
+    if (!joined) {
+        return;
+    }
+
+    auto sessions = std::make_shared<SessionList>();
+    sessions->reserve(shard.sessions->size());
+    for (auto const& entry : *shard.sessions) {
+        if (entry.first != session) {
+            sessions->push_back(entry);
+        }
+    }
+    std::atomic_store(
+        &shard.sessions, std::shared_ptr<SessionList const>(sessions));
+}
+
+std::size_t SharedState::size() const
+{
+    std::size_t result = 0;
+    for (auto const& shard : shards_) {
+        result += std::atomic_load(&shard->sessions)->size();
+    }
+    return result;
 }
 
 void SharedState::send(std::string message)
 {
     // Put a message in a shared pointer so we can re-use it for each client
-    auto const messageSPtr =
-        std::make_shared<std::string const>(std::move(message));
+    send(std::make_shared<std::string const>(std::move(message)));
+}
 
-    // Send message to each client
-    for(auto session : sessions_) {
-        session->send(messageSPtr);
+void SharedState::send(std::shared_ptr<std::string const> messageSPtr)
+{
+    auto const done = fanoutDone();
+
+    // Post one job per shard: it runs on the executor of the sessions of the
+    // shard, so it can enqueue the message on each of them directly. The jobs
+    // draw from the recycled memory of their shard.
+    for (auto const& shard : shards_) {
+        auto sessions = std::atomic_load(&shard->sessions);
+        if (sessions->empty()) {
+            done();
+            continue;
+        }
+        net::post(shard->executor, recycle(*shard->postMemory,
+            [memory = shard->postMemory, sessions = std::move(sessions),
+             messageSPtr, done]()
+            {
+                for (auto const& entry : *sessions) {
+                    if (auto session = entry.second.lock()) {
+                        session->deliver(messageSPtr);
+                    }
+                }
+                done();
+            }));
     }
 
-    // Show the sent message on cout
-    auto localTime = boost::posix_time::second_clock::universal_time();
-    std::cout << '[' << localTime << "] " << *messageSPtr << '\n';
+    logger().write(LogLevel::info, "broadcast", *messageSPtr);
+}
+
+void SharedState::subscribe(
+    std::shared_ptr<WebSocketSession> const& session,
+    std::string_view topic)
+{
+    auto& shard = *shards_[session->shard()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto topics = std::make_shared<Topics>(*shard.topics);
+    auto& list = topics->at(topic);
+    auto sessions = list
+        ? std::make_shared<SessionList>(*list)
+        : std::make_shared<SessionList>();
+    sessions->emplace_back(session.get(), session);
+    list = std::move(sessions);
+    std::atomic_store(
+        &shard.topics, std::shared_ptr<Topics const>(std::move(topics)));
 }
 
+void SharedState::unsubscribe(WebSocketSession* session, std::string_view topic)
+{
+    auto& shard = *shards_[session->shard()];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto topics = std::make_shared<Topics>(*shard.topics);
+    removeSession(topics->at(topic), session);
+    topics->prune();
+    std::atomic_store(
+        &shard.topics, std::shared_ptr<Topics const>(std::move(topics)));
+}
+
+void SharedState::publish(
+    std::string_view topic,
+    std::shared_ptr<std::string const> messageSPtr,
+    std::shared_ptr<std::string const> binarySPtr)
+{
+    auto const done = fanoutDone();
+    auto const publication =
+        publications_.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    // Shards without a subscriber of the topic are not bothered, so the cost
+    // of a message follows its subscribers rather than the connections
+    auto const name = std::make_shared<std::string const>(topic);
+    for (auto const& shard : shards_) {
+        auto topics = std::atomic_load(&shard->topics);
+        auto matched = false;
+        topics->forEach(*name, [&matched](SessionList const&){ matched = true; });
+        if (!matched) {
+            done();
+            continue;
+        }
+        net::post(shard->executor, recycle(*shard->postMemory,
+            [memory = shard->postMemory, topics = std::move(topics), name,
+             messageSPtr, binarySPtr, publication, done]()
+            {
+                topics->forEach(*name, [&](SessionList const& sessions)
+                {
+                    for (auto const& entry : sessions) {
+                        if (auto session = entry.second.lock()) {
+                            session->deliver(
+                                *name, messageSPtr, binarySPtr, publication);
+                        }
+                    }
+                });
+                done();
+            }));
+    }
+
+    logger().write(LogLevel::info, "publish", *messageSPtr);
+}
+
+bool SharedState::validTopic(std::string_view topic) noexcept
+{
+    if (topic.empty() || topic.size() > maxTopicSize) {
+        return false;
+    }
+
+    // Printable, no quotes or escapes, and '*' only as a trailing wildcard
+    auto const star = topic.find('*');
+    if (star != std::string_view::npos && star + 1 != topic.size()) {
+        return false;
+    }
+    return std::all_of(topic.begin(), topic.end(), [](char c)
+    {
+        return c > ' ' && c < '\x7f' && c != '"' && c != '\\';
+    });
+}
+
+std::size_t SharedState::subscriptions() const
+{
+    std::size_t result = 0;
+    for (auto const& shard : shards_) {
+        auto const topics = std::atomic_load(&shard->topics);
+        for (auto const& entry : topics->exact) {
+            result += entry.second->size();
+        }
+        for (auto const& entry : topics->prefixes) {
+            result += entry.second->size();
+        }
+    }
+    return result;
+}
+
+SharedState::FanoutDone SharedState::fanoutDone() const
+{
+    using Counter = std::atomic<std::size_t>;
+    return FanoutDone{
+        fanout_,
+        metrics_,
+        std::allocate_shared<Counter>(
+            HandlerAllocator<Counter>(fanout_->pending), shards_.size()),
+        std::chrono::steady_clock::now()};
+}
+
+void SharedState::FanoutDone::operator()() const
+{
+    // The last shard to finish records the fan-out latency
+    if (pending->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        auto const elapsed = std::chrono::steady_clock::now() - start;
+        fanout->record(elapsed);
+        metrics->record(Metrics::Histogram::fanout, elapsed);
+    }
+}
+
+SharedState::Topics::List& SharedState::Topics::at(std::string_view topic)
+{
+    if (topic.empty() || topic.back() != '*') {
+        return exact[std::string(topic)];
+    }
+
+    topic.remove_suffix(1);
+    auto found = std::find_if(prefixes.begin(), prefixes.end(),
+        [topic](auto const& entry){ return entry.first == topic; });
+    if (found == prefixes.end()) {
+        prefixes.emplace_back(std::string(topic), nullptr);
+        return prefixes.back().second;
+    }
+    return found->second;
+}
+
+void SharedState::Topics::prune()
+{
+    for (auto it = exact.begin(); it != exact.end();) {
+        it = it->second ? std::next(it) : exact.erase(it);
+    }
+    prefixes.erase(
+        std::remove_if(prefixes.begin(), prefixes.end(),
+            [](auto const& entry){ return !entry.second; }),
+        prefixes.end());
+}
+
+FanoutStats SharedState::fanoutStats() const
+{
+    FanoutStats stats;
+    stats.count = fanout_->count.load(std::memory_order_relaxed);
+    stats.last = std::chrono::nanoseconds(fanout_->lastNs.load());
+    stats.max = std::chrono::nanoseconds(fanout_->maxNs.load());
+    if (stats.count > 0) {
+        stats.mean = std::chrono::nanoseconds(fanout_->totalNs.load() / stats.count);
+    }
+    return stats;
+}
+
+void SharedState::countDrops(std::uint64_t drops)
+{
+    queues_.drops.fetch_add(drops, std::memory_order_relaxed);
+}
+
+void SharedState::countDisconnect()
+{
+    queues_.disconnects.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedState::countDepth(std::size_t depth)
+{
+    auto peak = queues_.peakDepth.load(std::memory_order_relaxed);
+    while (depth > peak && !queues_.peakDepth.compare_exchange_weak(peak, depth)) { }
+}
+
+QueueStats SharedState::queueStats() const
+{
+    QueueStats stats;
+    stats.drops = queues_.drops.load(std::memory_order_relaxed);
+    stats.disconnects = queues_.disconnects.load(std::memory_order_relaxed);
+    stats.peakDepth = queues_.peakDepth.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool SharedState::reserveDeflate(std::size_t bytes)
+{
+    auto const limit = config_.wsDeflateMemory;
+    auto memory = deflate_.memory.load(std::memory_order_relaxed);
+    do {
+        if (bytes > limit || memory > limit - bytes) {
+            deflate_.refused.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    } while (!deflate_.memory.compare_exchange_weak(memory, memory + bytes));
+
+    deflate_.sessions.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void SharedState::releaseDeflate(std::size_t bytes)
+{
+    deflate_.memory.fetch_sub(bytes, std::memory_order_relaxed);
+    deflate_.sessions.fetch_sub(1, std::memory_order_relaxed);
+}
+
+DeflateStats SharedState::deflateStats() const
+{
+    DeflateStats stats;
+    stats.memory = deflate_.memory.load(std::memory_order_relaxed);
+    stats.sessions = deflate_.sessions.load(std::memory_order_relaxed);
+    stats.refused = deflate_.refused.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void SharedState::writeMetrics(std::ostream& out) const
+{
+    metrics_->write(out);
+
+    auto const queues = queueStats();
+    auto const deflate = deflateStats();
+    auto const metric = [&out](
+        char const* name, char const* type, char const* help, auto value)
+    {
+        out << "# HELP " << name << ' ' << help << '\n'
+            << "# TYPE " << name << ' ' << type << '\n'
+            << name << ' ' << value << '\n';
+    };
+    metric("adaptiv_websocket_joined_sessions", "gauge",
+        "Websocket sessions receiving broadcasts.", size());
+    metric("adaptiv_websocket_subscriptions", "gauge",
+        "Topic subscriptions of the websocket sessions.", subscriptions());
+    metric("adaptiv_websocket_queue_peak_messages", "gauge",
+        "Largest write queue of any websocket session.", queues.peakDepth);
+    metric("adaptiv_websocket_dropped_messages_total", "counter",
+        "Messages discarded by the slow consumer policy.", queues.drops);
+    metric("adaptiv_websocket_slow_disconnects_total", "counter",
+        "Sessions closed by the slow consumer policy.", queues.disconnects);
+    metric("adaptiv_websocket_deflate_memory_bytes", "gauge",
+        "zlib memory reserved by websocket sessions.", deflate.memory);
+    metric("adaptiv_websocket_deflate_refused_total", "counter",
+        "Sessions left uncompressed by the zlib memory budget.", deflate.refused);
+    metric("adaptiv_run_history_bytes", "gauge",
+        "Memory of the residual histories of the runs.", runs_.historyBytes());
+    metric("adaptiv_file_cache_bytes", "gauge",
+        "Bytes held by the static file cache.", fileCache_.size());
+    metric("adaptiv_log_dropped_records_total", "counter",
+        "Log records lost because a ring buffer was full.", logger().dropped());
+}
+
+void SharedState::Fanout::record(std::chrono::steady_clock::duration elapsed)
+{
+    auto const ns = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+
+    lastNs.store(ns, std::memory_order_relaxed);
+    totalNs.fetch_add(ns, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+
+    auto max = maxNs.load(std::memory_order_relaxed);
+    while (ns > max && !maxNs.compare_exchange_weak(max, ns)) { }
+}
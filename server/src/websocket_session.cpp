@@ -1,18 +1,88 @@
-#include <iostream>
+#include <algorithm>
+#include <charconv>
 
 #include "websocket_session.hpp"
+#include "logger.hpp"
+
+namespace
+{
+
+// The value of a control message with this key, empty if it is not one
+std::string_view controlValue(std::string_view message, std::string_view key)
+{
+    // {"key":"topic"}
+    auto const head = 2 + key.size() + 3;
+    if (message.size() <= head + 2 ||
+        message.compare(0, 2, "{\"") != 0 ||
+        message.compare(2, key.size(), key) != 0 ||
+        message.compare(2 + key.size(), 3, "\":\"") != 0 ||
+        message.compare(message.size() - 2, 2, "\"}") != 0) {
+        return {};
+    }
+    return message.substr(head, message.size() - head - 2);
+}
+
+// Parse the whole of a control value as a number
+template<class T>
+bool parseNumber(std::string_view text, T& value)
+{
+    auto const end = text.data() + text.size();
+    auto const [last, ec] = std::from_chars(text.data(), end, value);
+    return ec == std::errc{} && last == end;
+}
+
+// Upper bound of the zlib memory of a session: the window, hash chains and
+// buffers of the deflater, plus the window of the inflater, which clients
+// size up to 15 bits unless they offer client_max_window_bits
+std::size_t deflateMemory(ServerConfig const& config)
+{
+    std::size_t constexpr state = 16 * 1024;
+    auto const deflater =
+        (std::size_t{1} << (config.wsDeflateWindowBits + 2)) +
+        (std::size_t{1} << (config.wsDeflateMemLevel + 9));
+    auto const inflater = std::size_t{1} << 15;
+    return deflater + inflater + state;
+}
+
+} // namespace
 
 WebSocketSession::WebSocketSession(
-    tcp::socket&& socket,
-    std::shared_ptr<SharedState> const& state)
+    ShardSocket&& socket,
+    std::shared_ptr<SharedState> const& state,
+    std::size_t shard)
     : websocket_(std::move(socket))
     , state_(state)
-{ }
+    , shard_(shard)
+    , queue_(boost::circular_buffer_space_optimized<Outgoing>::capacity_type(
+            state->config().wsQueueMessages,
+            std::min(state->config().wsQueueMessages, reservedMessages)))
+    , maxQueuedMessages_(state->config().wsQueueMessages)
+    , maxQueuedBytes_(state->config().wsQueueBytes)
+    , policy_(state->config().slowConsumer)
+    , timer_(websocket_.get_executor())
+{
+    state_->metrics().add(Metrics::Gauge::websocketSessions, 1);
+}
 
 WebSocketSession::~WebSocketSession()
 {
     // Remove this session from the list of active sessions
     state_->leave(this);
+
+    if (deflateMemory_ > 0) {
+        state_->releaseDeflate(deflateMemory_);
+    }
+    if (runId_ != 0) {
+        state_->runs().close(runId_);
+    }
+    if (log_) {
+        log_->close();
+    }
+
+    auto& metrics = state_->metrics();
+    metrics.add(Metrics::Gauge::websocketSessions, -1);
+    metrics.add(Metrics::Gauge::queuedMessages,
+        -static_cast<std::int64_t>(queue_.size()));
 }
 
 void WebSocketSession::fail(error_code ec, char const* what)
@@ -22,7 +92,31 @@ void WebSocketSession::fail(error_code ec, char const* what)
         ec == websocket::error::closed){
         return;
     }
-    std::cerr << what << ": " << ec.message() << "\n";
+    logger().write(LogLevel::error, what, ec);
+}
+
+void WebSocketSession::negotiateDeflate(beast::string_view extensions)
+{
+    auto const& config = state_->config();
+
+    // Only clients that offer the extension are charged to the budget
+    if (!config.wsDeflate ||
+        extensions.find("permessage-deflate") == beast::string_view::npos) {
+        return;
+    }
+    auto const memory = deflateMemory(config);
+    if (!state_->reserveDeflate(memory)) {
+        return;
+    }
+    deflateMemory_ = memory;
+
+    websocket::permessage_deflate options;
+    options.server_enable = true;
+    options.server_max_window_bits = config.wsDeflateWindowBits;
+    options.server_no_context_takeover = !config.wsDeflateTakeover;
+    options.compLevel = config.wsDeflateLevel;
+    options.memLevel = config.wsDeflateMemLevel;
+    websocket_.set_option(options);
 }
 
 void WebSocketSession::onAccept(error_code ec)
@@ -33,7 +127,7 @@ void WebSocketSession::onAccept(error_code ec)
     }
 
     // Add this session the list of active sessions
-    state_->join(this);
+    state_->join(shared_from_this());
 
     // Read a message
     doRead();
@@ -43,21 +137,33 @@ void WebSocketSession::doRead()
 {
     websocket_.async_read(
         buffer_,
-        [self = shared_from_this()](error_code ec, std::size_t bytes)
-        {
-            self->onRead(ec, bytes);
-        });
+        recycle(handlerMemory_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                self->onRead(ec, bytes);
+            }));
 }
 
 void WebSocketSession::onRead(error_code ec, std::size_t bytesTransferred)
 {
     // Handle the error, if any
     if (ec) {
+        stop();
         return fail(ec, "read");
     }
 
-    // Send to all connections
-    state_->send(beast::buffers_to_string(buffer_.data()));
+    auto const data = buffer_.data();
+    auto const text = std::string_view(
+        static_cast<char const*>(data.data()), data.size());
+    if (websocket_.got_text()) {
+        if (!control(text)) {
+            publish(std::make_shared<std::string const>(text));
+        }
+    } else if (!publishFrames(text)) {
+        // Relayed as text, the bytes would fail the subscribers on invalid
+        // UTF-8, and there is nothing else to relay them as
+        logger().write(LogLevel::warning, "publish", "binary message is not a frame");
+    }
 
     // Clear the buffer
     buffer_.consume(buffer_.size());
@@ -73,50 +179,386 @@ std::shared_ptr<std::string const> const& messageSPtr)
     // will not be accessed concurrently.
     // We must copy messageSPtr to extend its lifetime.
     net::post(websocket_.get_executor(),
-        [self = shared_from_this(), messageSPtr]()
+        recycle(handlerMemory_, [self = shared_from_this(), messageSPtr]()
         {
             self->onSend(messageSPtr);
-
-        });
+        }));
 }
 
-void WebSocketSession::onSend(
+void WebSocketSession::deliver(
 std::shared_ptr<std::string const> const& messageSPtr)
 {
-    // Always add to the queue
-    queue_.push_back(messageSPtr);
+    onSend(messageSPtr);
+}
+
+void WebSocketSession::deliver(
+std::string_view topic,
+std::shared_ptr<std::string const> const& messageSPtr,
+std::shared_ptr<std::string const> const& binarySPtr,
+std::uint64_t publication)
+{
+    if (closing_ || publication == publication_) {
+        return;
+    }
+    publication_ = publication;
+
+    auto const binary = binary_ && binarySPtr;
+    auto const& message = binary ? binarySPtr : messageSPtr;
+    if (interval_ == clock::duration::zero()) {
+        return onSend(message, binary);
+    }
+    throttle(topic, message, binary);
+}
+
+void WebSocketSession::throttle(
+    std::string_view topic,
+    std::shared_ptr<std::string const> const& message,
+    bool binary)
+{
+    if (closing_) {
+        return;
+    }
+    auto const now = clock::now();
+    auto found = std::find_if(throttles_.begin(), throttles_.end(),
+        [topic](Throttle const& throttle){ return throttle.topic == topic; });
+    if (found == throttles_.end()) {
+        // Topics that went quiet for an interval are forgotten
+        throttles_.erase(
+            std::remove_if(throttles_.begin(), throttles_.end(),
+                [now](Throttle const& throttle)
+                {
+                    return !throttle.pending && throttle.next <= now;
+                }),
+            throttles_.end());
+        throttles_.push_back(Throttle{std::string(topic), now, nullptr, false});
+        found = std::prev(throttles_.end());
+    }
+
+    if (found->pending) {
+        state_->metrics().add(Metrics::Counter::coalescedMessages);
+    } else if (found->next <= now) {
+        found->next = now + interval_;
+        return onSend(message, binary);
+    }
+    found->pending = message;
+    found->pendingBinary = binary;
+    schedule(found->next);
+}
 
-    // Are we already writing?
-    if (queue_.size() > 1) {
+void WebSocketSession::schedule(clock::time_point deadline)
+{
+    if (closing_ || (timerArmed_ && timer_.expiry() <= deadline)) {
+        return;
+    }
+    // Moving the expiry aborts the wait for the later one
+    timerArmed_ = true;
+    timer_.expires_at(deadline);
+    timer_.async_wait(recycle(handlerMemory_,
+        [self = shared_from_this()](error_code ec)
+        {
+            self->onTimer(ec);
+        }));
+}
+
+void WebSocketSession::onTimer(error_code ec)
+{
+    if (ec == net::error::operation_aborted) {
+        return;
+    }
+    timerArmed_ = false;
+    flushThrottles(false);
+}
+
+void WebSocketSession::flushThrottles(bool all)
+{
+    auto const now = clock::now();
+    auto earliest = clock::time_point::max();
+    for (auto& throttle : throttles_) {
+        if (throttle.pending && (all || throttle.next <= now)) {
+            throttle.next = now + interval_;
+            auto const message = std::move(throttle.pending);
+            throttle.pending = nullptr;
+            onSend(message, throttle.pendingBinary);
+        }
+        if (throttle.pending) {
+            earliest = std::min(earliest, throttle.next);
+        }
+    }
+    if (earliest != clock::time_point::max()) {
+        schedule(earliest);
+    }
+}
+
+void WebSocketSession::publish(
+    std::shared_ptr<std::string const> messageSPtr,
+    std::shared_ptr<std::string const> binarySPtr,
+    residual::Frame const* frame)
+{
+    // Keep the latest update of the run for the REST API, and the history
+    // of its frames for the late subscribers
+    if (runId_ == 0) {
+        runId_ = state_->runs().open();
+        log_ = state_->runs().log(runId_);
+    }
+    state_->runs().record(runId_, messageSPtr, frame);
+
+    // The log is written outside of the registry lock, as only this session
+    // appends to it
+    if (log_) {
+        if (auto const bytes = log_->append(*messageSPtr)) {
+            state_->metrics().add(Metrics::Counter::runLogBytes, bytes);
+        }
+    }
+
+    // Send to the subscribers of the run
+    std::string topic = "runs/";
+    topic += std::to_string(runId_);
+    state_->publish(topic, std::move(messageSPtr), std::move(binarySPtr));
+}
+
+bool WebSocketSession::publishFrames(std::string_view message)
+{
+    auto const count = residual::frameCount(message);
+    if (count == 0) {
+        return false;
+    }
+    auto const size = message.size() / count;
+    for (std::size_t offset = 0; offset < message.size(); offset += size) {
+        publishFrame(message.substr(offset, size));
+    }
+    return true;
+}
+
+void WebSocketSession::publishFrame(std::string_view message)
+{
+    residual::Frame frame;
+    residual::decode(message, frame, frame_);
+    frame_ = frame;
+
+    // Subscribers may start anywhere in the stream, so delta encoded frames
+    // are sent on as float64. The run id is the server's.
+    if (runId_ == 0) {
+        runId_ = state_->runs().open();
+        log_ = state_->runs().log(runId_);
+    }
+    frame.run = runId_;
+    auto const encoding = frame.encoding == residual::Encoding::float32
+        ? residual::Encoding::float32
+        : residual::Encoding::float64;
+    char binary[residual::maxFrameSize];
+    auto const binarySize = residual::encode(frame, encoding, binary);
+
+    char json[residual::maxJsonSize];
+    auto const jsonSize = residual::toJson(frame, json);
+
+    publish(
+        std::make_shared<std::string const>(json, jsonSize),
+        std::make_shared<std::string const>(binary, binarySize),
+        &frame);
+}
+
+bool WebSocketSession::control(std::string_view message)
+{
+    auto const format = controlValue(message, "format");
+    if (format == "json" || format == "binary") {
+        binary_ = format == "binary";
+        return true;
+    }
+
+    // Publications per second and topic, at most
+    auto const rate = controlValue(message, "rate");
+    if (!rate.empty()) {
+        double hz = 0;
+        if (parseNumber(rate, hz) && hz >= 0) {
+            // Lower rates are raised to the least, so that the interval
+            // cannot overflow the duration of the clock
+            interval_ = hz > 0
+                ? std::chrono::duration_cast<clock::duration>(
+                      std::chrono::duration<double>(1 / std::max(hz, minRate)))
+                : clock::duration::zero();
+            if (interval_ == clock::duration::zero()) {
+                flushThrottles(true);
+                throttles_.clear();
+            }
+        }
+        return true;
+    }
+
+    // Iterations in the history snapshots, at most
+    auto const points = controlValue(message, "points");
+    if (!points.empty()) {
+        parseNumber(points, points_);
+        return true;
+    }
+
+    auto topic = controlValue(message, "subscribe");
+    auto const subscribe = !topic.empty();
+    if (!subscribe) {
+        topic = controlValue(message, "unsubscribe");
+    }
+    if (topic.empty()) {
+        return false;
+    }
+
+    // Malformed requests are answered by nothing, but not published either
+    if (!SharedState::validTopic(topic)) {
+        logger().write(LogLevel::warning, "subscribe",
+            beast::string_view(topic.data(), topic.size()));
+        return true;
+    }
+    auto const found = std::find(topics_.begin(), topics_.end(), topic);
+    if (subscribe) {
+        if (found != topics_.end() ||
+            topics_.size() >= state_->config().wsTopics) {
+            return true;
+        }
+        topics_.emplace_back(topic);
+        state_->subscribe(shared_from_this(), topic);
+        sendSnapshot(topic);
+    } else if (found != topics_.end()) {
+        topics_.erase(found);
+        state_->unsubscribe(this, topic);
+    }
+    return true;
+}
+
+void WebSocketSession::sendSnapshot(std::string_view topic)
+{
+    // Only a run's own topic: a wildcard would send every history at once
+    constexpr std::string_view prefix = "runs/";
+    if (topic.substr(0, prefix.size()) != prefix) {
+        return;
+    }
+    std::uint64_t id = 0;
+    auto const digits = topic.substr(prefix.size());
+    auto const [end, ec] =
+        std::from_chars(digits.data(), digits.data() + digits.size(), id);
+    if (ec != std::errc{} || end != digits.data() + digits.size()) {
+        return;
+    }
+
+    // Taken after subscribing, so no iteration falls between the snapshot
+    // and the live frames, but the first few may be in both: the subscribers
+    // skip the frames whose iteration the snapshot already has
+    auto snapshot = state_->runs().snapshot(id, binary_, points_);
+    if (!snapshot.empty()) {
+        onSend(std::make_shared<std::string const>(std::move(snapshot)), binary_);
+    }
+}
+
+void WebSocketSession::onSend(
+std::shared_ptr<std::string const> const& messageSPtr,
+bool binary)
+{
+    if (closing_) {
         return;
     }
 
     // We are not currently writing, so send this immediately
-    doWrite();
+    if (!writing_.message) {
+        writing_ = Outgoing{messageSPtr, binary};
+        return doWrite();
+    }
+
+    // Otherwise wait in the queue, if there is room
+    if (!makeRoom(messageSPtr->size())) {
+        stop();
+        state_->countDisconnect();
+        fail(net::error::no_buffer_space, "write");
+        beast::get_lowest_layer(websocket_).close();
+        return;
+    }
+    queue_.push_back(Outgoing{messageSPtr, binary});
+    queuedBytes_ += messageSPtr->size();
+    state_->metrics().add(Metrics::Gauge::queuedMessages, 1);
+
+    if (queue_.size() > peakDepth_) {
+        peakDepth_ = queue_.size();
+        state_->countDepth(peakDepth_);
+    }
+}
+
+bool WebSocketSession::makeRoom(std::size_t bytes)
+{
+    auto const full = [this, bytes]
+    {
+        return queue_.size() >= maxQueuedMessages_ ||
+               queuedBytes_ + bytes > maxQueuedBytes_;
+    };
+    if (queue_.empty() || !full()) {
+        return true;
+    }
+
+    std::uint64_t dropped = 0;
+    switch (policy_) {
+    case SlowConsumerPolicy::dropOldest:
+        while (!queue_.empty() && full()) {
+            queuedBytes_ -= queue_.front().message->size();
+            queue_.pop_front();
+            ++dropped;
+        }
+        break;
+    case SlowConsumerPolicy::keepLatest:
+        dropped = queue_.size();
+        queue_.clear();
+        queuedBytes_ = 0;
+        break;
+    case SlowConsumerPolicy::disconnect:
+        return false;
+    }
+
+    drops_ += dropped;
+    state_->countDrops(dropped);
+    state_->metrics().add(Metrics::Gauge::queuedMessages,
+        -static_cast<std::int64_t>(dropped));
+    return true;
 }
 
 void WebSocketSession::doWrite()
 {
+    websocket_.binary(writing_.binary);
     websocket_.async_write(
-        net::buffer(*queue_.front()),
-        [self = shared_from_this()](error_code ec, std::size_t bytes)
-        {
-            self->onWrite(ec, bytes);
-        });
+        net::buffer(*writing_.message),
+        recycle(handlerMemory_,
+            [self = shared_from_this()](error_code ec, std::size_t bytes)
+            {
+                self->onWrite(ec, bytes);
+            }));
+}
+
+void WebSocketSession::stop()
+{
+    closing_ = true;
+    timer_.cancel();
+    timerArmed_ = false;
+    throttles_.clear();
+
+    // The message being written, if any, stays until its write completes
+    state_->metrics().add(Metrics::Gauge::queuedMessages,
+        -static_cast<std::int64_t>(queue_.size()));
+    queue_.clear();
+    queuedBytes_ = 0;
 }
 
 void WebSocketSession::onWrite(error_code ec, std::size_t bytesTransferred)
 {
+    auto& metrics = state_->metrics();
+    metrics.add(Metrics::Counter::websocketBytes, bytesTransferred);
+
     // Handle the error, if any
     if (ec) {
+        writing_ = Outgoing{};
+        stop();
         return fail(ec, "write");
     }
 
-    // Remove the string from the queue
-    queue_.erase(queue_.begin());
-
     // Send the next message if any
+    writing_ = Outgoing{};
     if (!queue_.empty()) {
+        writing_ = std::move(queue_.front());
+        queue_.pop_front();
+        queuedBytes_ -= writing_.message->size();
+        metrics.add(Metrics::Gauge::queuedMessages, -1);
         doWrite();
     }
 }